@@ -60,6 +60,14 @@
 
 
 #pragma link C++ class FFTtools::Averager; 
+#pragma link C++ class FFTtools::Workspace; 
+#pragma link C++ class FFTtools::CorrelationEngine; 
+#pragma link C++ class FFTtools::TemplateBank; 
+#pragma link C++ class FFTtools::TemplateMatch; 
+#pragma link C++ class FFTtools::SkyMap; 
+#pragma link C++ class FFTtools::Beamformer; 
+#pragma link C++ class FFTtools::FFTLengthStats; 
+#pragma link C++ class FFTtools::FFTStats; 
 
 #endif
 
@@ -0,0 +1,76 @@
+#ifndef FFTTOOLS_BEAMFORMER_H
+#define FFTTOOLS_BEAMFORMER_H
+
+#include <vector>
+#include <cstddef>
+#include "Workspace.h"
+
+class FFTWComplex;
+
+/* Delay-and-sum beamforming in the frequency domain
+ *
+ * Beam b is (1/nchan) sum_c y_c(t + delay[b][c]). Each channel is shifted by
+ * multiplying its spectrum by a phase ramp, so fractional delays need no
+ * interpolation (but, like any FFT shift, it's circular, so pad the waveforms
+ * if they shouldn't wrap around). The beams are inverse transformed a few at a
+ * time with doInvFFTBatch.
+ *
+ * For fixed directions, setDelays keeps the phase ramps (nbeams x nchan x
+ * (length/2+1) complex numbers), so forming beams is just products and inverse FFTs.
+ **/
+
+namespace FFTtools
+{
+  class Beamformer
+  {
+    public:
+      /** A beamformer for waveforms of length samples. batch is how many beams are inverse transformed at once. */
+      Beamformer(int length, int batch = 16);
+
+      /** Set the spectra (each length/2+1 long, as returned by doFFT) of nchan channels. They are copied. */
+      void setSpectra(int nchan, const FFTWComplex * const * spectra);
+
+      /** Set the waveforms (each length long) of nchan channels. They are transformed here. */
+      void setWaveforms(int nchan, const double * const * waveforms);
+
+      /** Sets (and computes the phase ramps for) nbeams beams. delays[b*nchan + c] is the delay, in samples, of channel c in beam b. */
+      void setDelays(int nbeams, int nchan, const double * delays);
+
+      /** Forms the beams set with setDelays. out must have room for nbeams x length. */
+      void form(double * out);
+
+      /** Forms nbeams beams with these delays (laid out as in setDelays), computing the phase ramps as it goes. out must have room for nbeams x length. */
+      void form(int nbeams, const double * delays, double * out);
+
+      int getLength() const { return length; }
+      int nChannels() const { return nchan; }
+      int nBeams() const { return nbeams; }
+
+    private:
+      /** fills ramp with exp(2 pi i k tau / length) (the Nyquist bin is made real) */
+      void phaseRamp(double tau, FFTWComplex * ramp) const;
+
+      /** adds spectrum * ramp to sum */
+      void accumulate(const FFTWComplex * spectrum, const FFTWComplex * ramp, FFTWComplex * sum) const;
+
+      /** inverse transforms nthis summed spectra into out */
+      void finish(int nthis, double * out);
+
+      int length;
+      int nfreq;
+      int batch;
+      int nchan;
+      int nbeams;
+
+      std::vector<FFTWComplex> spectra; // nchan x nfreq
+      std::vector<FFTWComplex> ramps; // nbeams x nchan x nfreq
+
+      // scratch, all from ws
+      Workspace ws;
+      FFTWComplex * sums; // batch x nfreq
+      FFTWComplex * ramp; // nfreq
+      double * input; // length
+  };
+}
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef FFTTOOLS_CORRELATION_ENGINE_H
+#define FFTTOOLS_CORRELATION_ENGINE_H
+
+#include <vector>
+#include <map>
+#include <cstddef>
+
+class FFTWComplex;
+
+/* All-pairs cross-correlation of a set of channels
+ *
+ * Each correlation is exactly what FFTCorrelation would return for that pair,
+ * but the band weights and channel norms are only computed once, and the
+ * results go into one lag matrix that is reused from event to event. With
+ * FFTTOOLS_USE_OMP, pairs are correlated in parallel. SkyMap sums them into a
+ * map of directions.
+ **/
+
+namespace FFTtools
+{
+  class CorrelationEngine
+  {
+    public:
+      /** Create an engine which bandpasses between min_i and max_i with a butterworth filter of order order (same meaning as in FFTCorrelation). */
+      CorrelationEngine(int min_i = 0, int max_i = 0, int order = 1);
+      ~CorrelationEngine();
+
+      /** Change the band. Takes effect at the next compute. */
+      void setBand(int min_i, int max_i, int order = 1) { band_min = min_i; band_max = max_i; band_order = order; }
+
+      /** Set the spectra (each length/2+1 long, as returned by doFFT) of nchan channels. They are copied. */
+      void setSpectra(int nchan, int length, const FFTWComplex * const * spectra);
+
+      /** Set the waveforms (each length long) of nchan channels. They are transformed here. */
+      void setWaveforms(int nchan, int length, const double * const * waveforms);
+
+      /** Correlate all pairs (i,j) with i < j. Pair k is (pairFirst(k), pairSecond(k)), ordered (0,1), (0,2) ... (1,2) ... */
+      void computeAll();
+
+      /** Correlate only the npairs pairs (first[k], second[k]). */
+      void computePairs(int npairs, const int * first, const int * second);
+
+      /** Number of pairs from the last compute */
+      int nPairs() const { return (int) pair_first.size(); }
+      int pairFirst(int k) const { return pair_first[k]; }
+      int pairSecond(int k) const { return pair_second[k]; }
+
+      /** The correlation (length long, same layout as FFTCorrelation) of pair k. Valid until the next set or compute. */
+      const double * getCorrelation(int k) const { return lags + k * stride; }
+
+      /** Number of doubles between the starts of consecutive rows of the lag matrix (which is at least the length) */
+      int getStride() const { return stride; }
+
+      /** The whole lag matrix, nPairs() rows of getStride() */
+      const double * getLags() const { return lags; }
+
+      /** The butterworth band weight for each of the length/2+1 frequency bins. These are cached, so asking again is cheap. */
+      const double * bandWeights(int length, int min_i, int max_i, int order);
+
+      int nChannels() const { return nchan; }
+      int getLength() const { return length; }
+
+    private:
+      struct BandKey
+      {
+        int length, min_i, max_i, order;
+        bool operator<(const BandKey & o) const;
+      };
+
+      void setup(int nchan, int length);
+      void computeNorms(const double * w);
+
+      int nchan;
+      int length;
+      int nfreq;
+      int band_min, band_max, band_order;
+
+      FFTWComplex * spectra; // nchan x spec_stride
+      int spec_stride;
+      std::vector<double> rms; // weighted rms of each channel
+
+      std::vector<int> pair_first, pair_second;
+      double * lags; // pairs x stride
+      int stride;
+      size_t lags_capacity;
+
+      FFTWComplex * work; // one row of spec_stride per thread
+      size_t work_capacity;
+
+      std::map<BandKey, std::vector<double> > weights;
+
+      // not copyable
+      CorrelationEngine(const CorrelationEngine &);
+      CorrelationEngine & operator=(const CorrelationEngine &);
+  };
+}
+
+#endif
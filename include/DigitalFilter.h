@@ -2,7 +2,10 @@
 #define FFTTOOLS_DIGITAL_FILTER_HH
 
 class TGraph; 
+class FFTWComplex; 
 #include <vector>
+#include <map>
+#include <algorithm>
 #include <complex>
 #include <cstdlib>
 
@@ -57,6 +60,39 @@ namespace FFTtools
          * */
         virtual void filterReplace(size_t n, double * w) const; 
 
+        /** Filter several channels (each n long) with the same filter. 
+         *
+         * The default just filters each in turn, but IIR filters run several channels 
+         * at once (one per SIMD lane), since their recursion can't be vectorized along time. 
+         *
+         * @param nchan number of channels
+         * @param n size of each channel
+         * @param in the input channels
+         * @param out the output channels (assumed to be allocated, and each may be the same as its input) 
+         * @param steady if true, recursive filters start as if each channel's first sample had always been there, 
+         *               instead of from rest (i.e. no transient from the edge). Filters without state ignore it. 
+         * */ 
+        virtual void filterOutChannels(size_t nchan, size_t n, const double * const * in, double * const * out, bool steady = false) const; 
+
+        /** Zero-phase filtering (like Matlab's or scipy's filtfilt), in place. 
+         *
+         * The waveform is extended past each end by padlen samples of its odd 
+         * extension (reflected about the end value), filtered forwards and then 
+         * backwards starting in steady state, and the extension dropped, so the 
+         * magnitude response is squared and the phase cancels, without a big transient at either end. 
+         *
+         * @param n size of waveform 
+         * @param w waveform, which is replaced by the output
+         * @param padlen samples of extension at each end, or -1 for edgePadding(). At most n-1 are used. 
+         * */ 
+        virtual void filtfilt(size_t n, double * w, int padlen = -1) const; 
+
+        /** filtfilt on several channels at once (see filterOutChannels), in place */ 
+        virtual void filtfiltChannels(size_t nchan, size_t n, double * const * w, int padlen = -1) const; 
+
+        /** How much filtfilt pads each end by default */ 
+        virtual size_t edgePadding() const { return 0; } 
+
 
         /** Filter response to unit impulse. A delay may be given which is helpful for acausal filters. 
          * This works by applying filterOut on an input array with all zeroes and one one at position delay.  
@@ -110,6 +146,31 @@ namespace FFTtools
         /* Computes transfer function */ 
         virtual std::complex<double> transfer(std::complex<double> z) const = 0;  
 
+
+        /** Streaming: filter the next n samples of a continuous record, keeping whatever state is needed for the next block. 
+         *
+         * Feeding a record through process in blocks of any size (and then calling flush) 
+         * gives exactly the output filterOut would give for the whole record at once. 
+         * Filters that need samples after the one they're computing (see latency) 
+         * return fewer samples at the start, and the rest from flush. 
+         * Nothing is allocated once the blocks are as big as they're going to get. 
+         *
+         * @param n number of samples in this block
+         * @param w the samples (must not overlap out) 
+         * @param out where the output is written (room for n needed) 
+         * @returns the number of output samples written
+         * */ 
+        virtual size_t process(size_t n, const double * w, double * out); 
+
+        /** Streaming: ends the record, writing the outputs still pending (at most latency() of them) and resetting. Returns how many were written. */ 
+        virtual size_t flush(double * out) { (void) out; reset(); return 0; } 
+
+        /** Streaming: forget the current record, so the next process starts a new one. */ 
+        virtual void reset() {; } 
+
+        /** Streaming: how many samples behind the input the output of process is */ 
+        virtual size_t latency() const { return 0; } 
+
         virtual ~DigitalFilter() {;} 
     }; 
 
@@ -123,6 +184,7 @@ namespace FFTtools
 
         /* Initialize filter series with a filter */ 
         DigitalFilterSeries(const DigitalFilter * f) { add(f); } 
+        DigitalFilterSeries(DigitalFilter * f) { add(f); } 
 
         /* Empty filter series */ 
         DigitalFilterSeries() {; } 
@@ -131,31 +193,143 @@ namespace FFTtools
         virtual void filterOut(size_t n, const double *w, double *out) const; 
         virtual std::complex<double> transfer(std::complex<double> z) const;  
 
-        /* Add a filter to the series. Does NOT take ownership of it */ 
-        virtual void add(const DigitalFilter *f) { series.push_back(f); }
+        /* Streaming through a series uses (and changes) the streaming state of each filter in it, so they must all have been 
+         * added non-const, and while streaming, don't use them in anything else */ 
+        virtual size_t process(size_t n, const double * w, double * out); 
+        virtual size_t flush(double * out); 
+        virtual void reset(); 
+        virtual size_t latency() const; 
+
+        virtual void filterOutChannels(size_t nchan, size_t n, const double * const * in, double * const * out, bool steady = false) const; 
+        virtual size_t edgePadding() const; 
+
+        /* Add a filter to the series. Does NOT take ownership of it. The series can only be streamed through (see process) if every filter was added non-const */ 
+        virtual void add(const DigitalFilter *f) { series.push_back(f); streamable.push_back(0); }
+        virtual void add(DigitalFilter *f) { series.push_back(f); streamable.push_back(f); }
         virtual ~DigitalFilterSeries() {; }
 
       protected:
         std::vector<const DigitalFilter*> series; 
+        std::vector<DigitalFilter*> streamable; // the same filters, or 0 for those added const 
+
+      private: 
+        /* whether every filter can be streamed through, warning about the first that can't */ 
+        bool canStream(const char * caller) const; 
+
+        std::vector<double> stream_buf[2]; 
+
+    };
+
+
+    /** Runs another filter (e.g. a whole DigitalFilterSeries) in the frequency domain. 
+     *
+     * The input is transformed once, multiplied by the filter's transfer function evaluated at the FFT 
+     * frequencies (computed the first time each length is seen, then cached) and transformed back, 
+     * so for long records and deep chains it costs one FFT pair instead of running every filter. 
+     *
+     * Multiplying spectra is circular convolution. With pad = 0, the record is treated as one period 
+     * of a periodic signal, so the filter's response to the end wraps around into the start (and 
+     * an acausal filter's response to the start wraps into the end). With pad > 0, the record is 
+     * zero-padded by at least pad samples first, which gives the linear convolution (filterOut with 
+     * zeroes outside the record) as long as the impulse response, both sides of it for acausal filters, 
+     * dies out within pad samples. An IIR filter's never quite does, so that's only ever approximately 
+     * filterOut, to however much of the response is cut off. FIR filters that extend the record past 
+     * its ends (like SavitzkyGolayFilter) will differ near the ends either way. 
+     *
+     * The filter is not owned. If it changes, call clearCache. 
+     */
+    class FrequencyDomainFilter : public DigitalFilter
+    {
+      public: 
+        FrequencyDomainFilter(const DigitalFilter * f, size_t pad = 0) : f(f), pad(pad) {; } 
+
+        virtual void filterOut(size_t n, const double *w, double *out) const; 
+        virtual std::complex<double> transfer(std::complex<double> z) const { return f->transfer(z); } 
+        virtual size_t edgePadding() const { return f->edgePadding(); } 
 
+        /* Forget the cached responses (needed if the filter changes) */ 
+        void clearCache(); 
+        size_t getPad() const { return pad; } 
+        virtual ~FrequencyDomainFilter() {; }
+
+      private: 
+        /** the transfer function at the L/2+1 frequencies of an FFT of length L, computed the first time it's needed */ 
+        const std::complex<double> * frequencyResponse(int L) const; 
+
+        const DigitalFilter * f; 
+        size_t pad; 
+        mutable std::map<int, std::vector<std::complex<double> > > responses; 
     }; 
+ 
 
     /* FIR filter*/
     class FIRFilter : public DigitalFilter
     {
       public:
+        /** How filterOut convolves */
+        enum Method
+        {
+          AUTO,         //!< whichever of the below should be cheaper per sample for this many taps (the record length doesn't matter, so very short records may be faster with DIRECT)
+          DIRECT,       //!< directConvolve
+          OVERLAP_SAVE  //!< FFT convolution, in blocks
+        };
+
         //FIR filter of length N with values x. if extend is true, input to filter will be extended by copying first and last values N times before and after
-        FIRFilter(size_t N, int delay = 0, bool extend =false) : coeffs(N),delay(delay),extend(extend) {; }
-        FIRFilter(size_t N, const double * x, int delay = 0, bool extend = false) : coeffs(x,x+N), delay(delay), extend(extend) {; }
+        FIRFilter(size_t N, int delay = 0, bool extend =false) : coeffs(N),delay(delay),extend(extend),method(AUTO),stream_first(0),stream_in(0),stream_out(0),stream_start_val(0),stream_y_read(0) {; }
+        FIRFilter(size_t N, const double * x, int delay = 0, bool extend = false) : coeffs(x,x+N), delay(delay), extend(extend), method(AUTO),stream_first(0),stream_in(0),stream_out(0),stream_start_val(0),stream_y_read(0) {; }
         virtual void filterOut(size_t n, const double * w, double * out) const; 
         virtual std::complex<double> transfer(std::complex<double> z) const ;  
         virtual void setDelay(int d) { delay = d; } 
         virtual void setExtend(bool ext) { extend = ext; } 
+        void setMethod(Method m) { method = m; } 
+
+        /* Streaming convolves the same way filterOut does (with OVERLAP_SAVE, in the same blocks), so is bit-identical to it. 
+         * With OVERLAP_SAVE, the outputs come a block at a time, so the latency is about the block length */ 
+        virtual size_t process(size_t n, const double * w, double * out); 
+        virtual size_t flush(double * out); 
+        virtual void reset() { stream_x.clear(); stream_y.clear(); stream_y_read = 0; stream_first = 0; stream_in = 0; stream_out = 0; } 
+        virtual size_t latency() const; 
+        virtual size_t edgePadding() const { return coeffs.size(); } 
 
       protected: 
         std::vector<double> coeffs; 
         int delay; 
         bool extend; 
+        Method method; 
+
+      private: 
+        /* the output sample i from the samples seen so far (those past the end are end_val) */ 
+        double streamSample(long i, double end_val) const; 
+
+        /* OVERLAP_SAVE blocks from stream_out until one starts at or after last, appending their outputs to stream_y */ 
+        void streamBlocks(long last, double end_val); 
+
+        // input samples from stream_first on, and how many came in / were computed so far 
+        std::vector<double> stream_x; 
+        long stream_first; 
+        long stream_in; 
+        long stream_out; 
+        double stream_start_val; 
+
+        // OVERLAP_SAVE outputs, those from stream_y_read on not returned yet 
+        std::vector<double> stream_y; 
+        size_t stream_y_read; 
+
+        // OVERLAP_SAVE scratch for streaming, which only grows 
+        std::vector<double> stream_block; 
+        std::vector<double> stream_spectrum; 
+
+      private:
+        /** the OVERLAP_SAVE block length, and what AUTO means, which only depend on the taps */ 
+        int blockLength() const; 
+        Method chosenMethod() const; 
+
+        /** overlap-save convolution of one block of length L in place (spectrum is scratch) */ 
+        void convolveBlock(int L, double * block, FFTWComplex * spectrum) const; 
+
+        /** conj(FFT(coeffs)) zero-padded to block length L, computed the first time it's needed */ 
+        const std::complex<double> * tapSpectrum(int L) const; 
+        mutable std::map<int, std::vector<std::complex<double> > > tap_spectra; 
     }; 
 
     class SavitzkyGolayFilter : public FIRFilter
@@ -195,12 +369,13 @@ namespace FFTtools
     class IIRFilter : public DigitalFilter 
     {
       public:
-        IIRFilter() {order = 0;}
+        IIRFilter() {order = 0; stream_n = 0;}
         /* Initialize filter from coeffs */ 
         IIRFilter(size_t order, const double * acoeffs, const double * bcoeffs) 
-          : order(order+1), acoeffs(acoeffs, acoeffs+order+1), bcoeffs(bcoeffs, bcoeffs + order+1) {; } 
+          : order(order+1), acoeffs(acoeffs, acoeffs+order+1), bcoeffs(bcoeffs, bcoeffs + order+1), stream_n(0) {; } 
 
         IIRFilter(std::complex<double> gain, size_t nzeroes, std::complex<double> * digi_zeroes, size_t npoles, std::complex<double> * digi_poles) 
+          : stream_n(0)
         {
           computeCoeffsFromDigiPoles(gain, nzeroes, digi_zeroes, npoles, digi_poles); 
           order = npoles > nzeroes ? npoles : nzeroes; 
@@ -210,6 +385,12 @@ namespace FFTtools
         virtual void filterOut(size_t n, const double * w, double * out) const; 
         virtual std::complex<double> transfer(std::complex<double> z) const ;  
 
+        virtual size_t process(size_t n, const double * w, double * out); 
+        virtual size_t flush(double * out) { (void) out; reset(); return 0; } 
+        virtual void reset() { stream_n = 0; } 
+        virtual void filterOutChannels(size_t nchan, size_t n, const double * const * in, double * const * out, bool steady = false) const; 
+        virtual size_t edgePadding() const { return 3 * std::max(acoeffs.size(), bcoeffs.size()); } 
+
         /*analytic order, may not be number of coeffs if bandpass or notch */
         size_t getOrder() const { return order; } 
         size_t nAcoeffs() const { return acoeffs.size(); } 
@@ -223,6 +404,12 @@ namespace FFTtools
         std::vector<double> acoeffs; 
         std::vector<double> bcoeffs; 
         void computeCoeffsFromDigiPoles(std::complex<double> gain, size_t nzeroes, std::complex<double> * zeros, size_t npoles, std::complex<double> * poles); 
+
+      private: 
+        // the last few inputs and outputs (most recent first), and how many samples came through so far 
+        std::vector<double> stream_x; 
+        std::vector<double> stream_y; 
+        long stream_n; 
     };
 
     /* Classic filter topologies */ 
@@ -239,16 +426,16 @@ namespace FFTtools
     class TransformedZPKFilter : public IIRFilter
     {
       public:
-        TransformedZPKFilter() { ; } 
+        TransformedZPKFilter() : method(DIRECT_FORM) { ; } 
         TransformedZPKFilter( int npoles, std::complex<double> *poles, int nzeroes, std::complex<double> * zeroes, double gain)
-          : poles(poles, poles+npoles), zeroes(zeroes, zeroes+nzeroes), gain(gain) 
+          : poles(poles, poles+npoles), zeroes(zeroes, zeroes+nzeroes), gain(gain), method(DIRECT_FORM) 
         {
           order = npoles > nzeroes ? npoles : nzeroes; 
           bilinearTransform(); 
         }
 
         TransformedZPKFilter(int npoles, std::complex<double> *poles, int nzeroes, std::complex<double> * zeroes, double gain, FilterTopology type, double w, double dw)
-          : poles(poles, poles+npoles), zeroes(zeroes, zeroes+nzeroes), gain(gain) 
+          : poles(poles, poles+npoles), zeroes(zeroes, zeroes+nzeroes), gain(gain), method(DIRECT_FORM) 
         {
           order = npoles > nzeroes ? npoles : nzeroes; 
           transform(type,w,dw); 
@@ -268,6 +455,28 @@ namespace FFTtools
         const std::complex<double> * getDigiZeroes() { return &digi_zeroes[0]; } 
         std::complex<double> getDigiGain() const { return digi_gain; } 
 
+        /** How the filter is run. DIRECT_FORM is the single recursion with acoeffs and bcoeffs. 
+         * SECOND_ORDER_SECTIONS is a cascade of biquads, each from a pair of the digital poles and zeroes, 
+         * which stays accurate at high orders, where the expanded polynomials lose precision. */ 
+        enum Method
+        {
+          DIRECT_FORM, 
+          SECOND_ORDER_SECTIONS
+        }; 
+
+        void setMethod(Method m) { method = m; reset(); } 
+        Method getMethod() const { return method; } 
+
+        virtual void filterOut(size_t n, const double * w, double * out) const; 
+        virtual std::complex<double> transfer(std::complex<double> z) const ;  
+        virtual size_t process(size_t n, const double * w, double * out); 
+        virtual void reset(); 
+        virtual void filterOutChannels(size_t nchan, size_t n, const double * const * in, double * const * out, bool steady = false) const; 
+
+        /* The sections, each b0 b1 b2 a1 a2 (a0 is 1), with the gain in the first one */ 
+        size_t nSections() const { return sections.size() / 5; } 
+        const double * getSections() const { return &sections[0]; } 
+
 
       protected:
         std::vector<std::complex<double> > poles; 
@@ -280,6 +489,13 @@ namespace FFTtools
         double gain; 
         std::complex<double> digi_gain; 
 
+      private: 
+        /* groups the digital poles and zeroes into sections */ 
+        void computeSections(); 
+
+        Method method; 
+        std::vector<double> sections; 
+        std::vector<double> section_state; // two per section, for process 
     }; 
 
 
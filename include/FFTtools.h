@@ -8,8 +8,15 @@
 #define FFTTOOLS_ALLOCATE_CONTIGUOUS 
 //#define FFTTOOLS_THREAD_SAFE 
 
+// With ENABLE_VECTORIZE, gcc (8 or later) and clang on x86-64 build the vectorized kernels once per instruction set, and pick one at run time (see FFTtools::simdWidth) 
+#if defined(ENABLE_VECTORIZE) && defined(__x86_64__) && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 8))
+#define FFTTOOLS_SIMD_DISPATCH
+#endif
+
 // c++ libraries thingies
 #include <map>
+#include <vector>
+#include <climits>
 #include <algorithm>
 #include <iostream>
 #include <fstream>
@@ -33,6 +40,8 @@
 class TRandom; 
 class TH2; 
 
+namespace FFTtools { class Workspace; }
+
 // FFTW
 #include <complex>
 
@@ -78,11 +87,21 @@ namespace FFTtools
   */
    TGraph *getInterpolatedGraphFreqDom(TGraph *grIn, Double_t deltaT);
 
+  //! Version of getInterpolatedGraphFreqDom that takes its temporaries from a Workspace
+  /*!
+    \param grIn A pointer to the input TGraph.
+    \param deltaT The desired period (1/rate) of the interpolated waveform.
+    \param ws The Workspace the temporary arrays are taken from.
+    \param out If non-zero, this TGraph is used for the output (and resized if necessary) instead of allocating a new one.
+    \return A pointer to ther interpolated TGraph, it is the users responsibility to delete this after use.
+  */
+   TGraph *getInterpolatedGraphFreqDom(TGraph *grIn, Double_t deltaT, Workspace & ws, TGraph * out = 0);
+
   //! Convolution
   /*!
     \param grA A pointer to the input TGraph A.
     \param grB A pointer to the input TGraph B
-    \return A pointer to the convolution of A and B stored in a TGraph, it is the users responsibility to delete this after use.
+    \return A pointer to the convolution of A and B stored in a TGraph, it is the users responsibility to delete this after use. The convolution is circular. If setPadToFastLength is on and the length isn't already fast, the transforms are zero-padded to a fast length and the result wrapped around afterwards, so it's the same (up to rounding).
   */
    TGraph *getConvolution(TGraph *grA, TGraph *grB);
   //! Convolution
@@ -123,14 +142,59 @@ namespace FFTtools
    void doInvFFTClobber(int length, FFTWComplex * properly_aligned_input_that_will_likely_be_clobbered, double * properly_aligned_output); 
 
    /** Version of doInvFFt that only requires copying of input. The input is
-    * copied to a properly-aligned temporary on the stack.  If the output is
+    * copied to a properly-aligned per-thread scratch array.  If the output is
     * not  aligned properly (i.e. allocated with fftw_malloc, memalign or
     * equivalent), bad things might happen. Things will probably be a bit
     * faster if the input is aligned properly, as long as memcpy dispatches
     * correctly. 
     * */ 
 
-   void doInvFFTNoClobber(int length, const FFTWComplex * properly_aligned_input, double * properly_aligned_output); 
+   void doInvFFTNoClobber(int length, const FFTWComplex * properly_aligned_input, double * properly_aligned_output);
+
+  //! Computes the FFTs of many waveforms of the same length at once, using a single (cached) FFTW plan.
+  /*!
+    Waveform i is read from in + i * in_dist and its length/2+1 frequency
+    bins are written to out + i * out_dist. Nothing is allocated once the plan
+    for this geometry has been made. Aligned arrays (i.e. allocated with
+    fftw_malloc) will be faster, but aren't required.
+
+    \param length The length of each waveform
+    \param nbatch The number of waveforms
+    \param in The input waveforms
+    \param out The output array, with room for nbatch spectra
+    \param in_dist The distance (in doubles) between successive input waveforms. 0 means length (i.e. contiguous).
+    \param out_dist The distance (in FFTWComplex) between successive output spectra. 0 means length/2+1 (i.e. contiguous).
+  */
+   void doFFTBatch(int length, int nbatch, const double * in, FFTWComplex * out, int in_dist = 0, int out_dist = 0);
+
+  //! Computes the (normalized) inverse FFTs of many spectra of the same length at once, using a single (cached) FFTW plan.
+  /*!
+    Layout is as in doFFTBatch. Like doInvFFTClobber, the input is used as
+    scratch space and will likely be clobbered.
+
+    \param length The length of each output waveform
+    \param nbatch The number of spectra
+    \param in The input spectra, each of length/2+1 bins. Will likely be clobbered.
+    \param out The output array, with room for nbatch waveforms
+    \param in_dist The distance (in FFTWComplex) between successive input spectra. 0 means length/2+1 (i.e. contiguous).
+    \param out_dist The distance (in doubles) between successive output waveforms. 0 means length (i.e. contiguous).
+  */
+   void doInvFFTBatch(int length, int nbatch, FFTWComplex * in, double * out, int in_dist = 0, int out_dist = 0);
+
+   /** Single precision version of doFFT, using fftwf. The output has length/2+1 bins. It is the users responsibility to delete this after use. */
+   std::complex<float> * doFFT(int length, const float * theInput);
+
+   /** Single precision version of doInvFFT, using fftwf. The input has length/2+1 bins. It is the users responsibility to delete this after use. */
+   float * doInvFFT(int length, const std::complex<float> * theInput);
+
+   /** Single precision version of doFFT that doesn't copy memory. If these are not aligned properly (i.e. allocated with fftwf_malloc, memalign or equivalent), bad things might happen. */
+   void doFFT(int length, const float * properly_aligned_input, std::complex<float> * properly_aligned_output);
+
+   /** Single precision version of doInvFFTClobber. If these are not aligned properly, bad things might happen. Note that the input may be clobbered. */
+   void doInvFFTClobber(int length, std::complex<float> * properly_aligned_input_that_will_likely_be_clobbered, float * properly_aligned_output);
+
+   /** Single precision version of doInvFFTNoClobber. The input is copied to a per-thread scratch array, but the output must be aligned properly. */
+   void doInvFFTNoClobber(int length, const std::complex<float> * input, float * properly_aligned_output);
 
   //! Converts inputMag (linear units) to time domain by means of hilbert transform assuming R_signal = 1/sqrt(2) (R_mag - i R^_mag);
   /*!
@@ -156,8 +220,18 @@ namespace FFTtools
     \return The correlation as an array of <i>length</i> real numbers.
   */
    double *getCorrelation(int length,float *oldY1, float *oldY2);
+
+  //! Computes the correlation of two arrays entirely in single precision
+  /*!
+    \param length The length of the arrays
+    \param oldY1 The first array in the correlation.
+    \param oldY2 The second array in the correlation.
+    \param out The output array of <i>length</i> floats (the correlation)
+  */
+   void getCorrelation(int length, const float *oldY1, const float *oldY2, float * out);
   //! Computes the correlation of two arrays
   /*!
+    To match one waveform against many templates, TemplateBank is faster.
     \param length The length of the arrays
     \param oldY1 The first array in the correlation.
     \param oldY2 The second array in the correlation.
@@ -165,6 +239,40 @@ namespace FFTtools
   */
    double *getCorrelation(int length,double *oldY1, double *oldY2);
 
+  //! Version of getCorrelation that doesn't allocate
+  /*!
+    \param length The length of the arrays
+    \param oldY1 The first array in the correlation.
+    \param oldY2 The second array in the correlation.
+    \param ws The Workspace the temporaries and the output are taken from.
+    \return The correlation as an array of <i>length</i> real numbers. This belongs to ws, so is only valid until ws is reset.
+  */
+   double *getCorrelation(int length, const double *oldY1, const double *oldY2, Workspace & ws);
+
+   /** How getRestrictedCorrelation computes its sums */
+   enum CorrelationMethod
+   {
+     CORRELATION_AUTO,   //!< whichever of the below should be cheaper
+     CORRELATION_DIRECT, //!< sum the products for each lag (vectorized with ENABLE_VECTORIZE)
+     CORRELATION_FFT     //!< zero-padded FFT correlation, then pick out the lags
+   };
+
+  //! Computes the correlation of two arrays at only the lags in [lagMin, lagMax]
+  /*!
+    out[lag-lagMin] is the sum over j of y1[j+lag]*y2[j] (not circular: samples outside the arrays are zero).
+    For a narrow range of lags, summing directly is much cheaper than an FFT (and only the lags wanted are stored).
+    \param n1 The length of y1
+    \param y1 The first array in the correlation
+    \param n2 The length of y2
+    \param y2 The second array in the correlation
+    \param lagMin The first lag (in samples) to compute
+    \param lagMax The last lag (in samples) to compute
+    \param out If non-zero, the output is stored here (must have room for lagMax-lagMin+1 values), otherwise a new array is allocated
+    \param method How to compute it. CORRELATION_AUTO picks the cheaper method based on the number of products vs. the FFT size.
+    \return The correlation at lags lagMin to lagMax (out, if it was given)
+  */
+   double *getRestrictedCorrelation(int n1, const double *y1, int n2, const double *y2, int lagMin, int lagMax, double *out = 0, CorrelationMethod method = CORRELATION_AUTO);
+
 
   //! This is designed for when you want to average a number of graphs of the same thing together. It uses a correlation to find the deltaT between graphs and then shifts the graphs and coherently sums them. The return is the average of the input graphs
   /*!
@@ -195,31 +303,45 @@ namespace FFTtools
   */
    Double_t *combineValuesUsingFFTs(Int_t numArrays, Double_t **thePtrPtr, Int_t eachLength);
 
+  //! Version of combineValuesUsingFFTs that doesn't allocate
+  /*!
+    \param numArrays The number of arrays to sum.
+    \param thePtrPtr A pointer to a two-dimensional array of doubles <i>[numArrays][eachLength]</i>.
+    \param eachLength The length of each array.
+    \param ws The Workspace the temporaries and the output are taken from.
+    \return The time domain result of the frequency domain summation. This belongs to ws, so is only valid until ws is reset.
+  */
+   Double_t *combineValuesUsingFFTs(Int_t numArrays, Double_t **thePtrPtr, Int_t eachLength, Workspace & ws);
+
   //Higher level functions that take and return TGraphs
   //! Returns the power spectral density. Note the PSD is unormalised (or if you prefer is normalised to the sum squared amplitude of the time domain). <a href="http://www.hep.ucl.ac.uk/~rjn/saltStuff/fftNormalisation.pdf">See this short note for my terminology.</a>
   /*!
     \param grWave The input time domain waveform
+    \param out If non-zero, this TGraph is used for the output (and resized if necessary) instead of allocating a new one.
     \return A pointer to a TGraph containing the power spectrum. 
   */
-   TGraph *makePowerSpectrum(TGraph *grWave);
+   TGraph *makePowerSpectrum(TGraph *grWave, TGraph *out=0);
   //! Returns the power spectral density. Note the PSD returned is the periodogram (or if you prefer is normalised to the mean squared amplitude of the time domain). <a href="http://www.hep.ucl.ac.uk/~rjn/saltStuff/fftNormalisation.pdf">See this short note for my terminology.</a>
   /*!
     \param grWave The input time domain waveform
+    \param out If non-zero, this TGraph is used for the output (and resized if necessary) instead of allocating a new one.
     \return A pointer to a TGraph containing the power spectrum. 
   */
-   TGraph *makePowerSpectrumPeriodogram(TGraph *grWave);
+   TGraph *makePowerSpectrumPeriodogram(TGraph *grWave, TGraph *out=0);
   //! Returns the power spectral density. Note the PSD returned is normalised and divided by frequency bin width (or if you prefer it is normalised to the time-integral squared amplitude of the time domain and then divided by frequency bin width). <a href="http://www.hep.ucl.ac.uk/~rjn/saltStuff/fftNormalisation.pdf">See this short note for my terminology.</a> As the name suggests this function expects the input waveform to be a volts-seconds one.
   /*!
     \param grWave The input time domain waveform with units of volts-seconds.
+    \param out If non-zero, this TGraph is used for the output (and resized if necessary) instead of allocating a new one.
     \return A pointer to a TGraph containing the power spectrum. 
   */  
-   TGraph *makePowerSpectrumVoltsSeconds(TGraph *grWave);
+   TGraph *makePowerSpectrumVoltsSeconds(TGraph *grWave, TGraph *out=0);
   //! Returns the power spectral density of the input waveform convolved with a Bartlett Window. Note the PSD returned is normalised and divided by frequency bin width (or if you prefer it is normalised to the time-integral squared amplitude of the time domain and then divided by frequency bin width). <a href="http://www.hep.ucl.ac.uk/~rjn/saltStuff/fftNormalisation.pdf">See this short note for my terminology.</a> As the name suggests this function expects the input waveform to be a volts-seconds one.
   /*!
     \param grWave The input time domain waveform with units of volts-seconds.
+    \param out If non-zero, this TGraph is used for the output (and resized if necessary) instead of allocating a new one.
     \return A pointer to a TGraph containing the power spectrum. 
   */  
-   TGraph *makePowerSpectrumVoltsSecondsBartlett(TGraph *grWave);
+   TGraph *makePowerSpectrumVoltsSecondsBartlett(TGraph *grWave, TGraph *out=0);
   //! Returns the power spectral density of the input waveform. In this one we first zero pad the waveform and then split it up into overlapping segments and convolve each segment with the Bartlett window before summing the resulting PSD's. As the name suggests this function expects the input waveform to be a volts-seconds one. No idea if this one actually works, or where I read oabout this crazy method which is supposed to reduce the variance of the PSD estimator.
   /*!
     \param grWave The input time domain waveform with units of volts-seconds.
@@ -232,45 +354,51 @@ namespace FFTtools
   //! Returns the power spectral density in dB units. Note the PSD returned is normalised and divided by frequency bin width (or if you prefer it is normalised to the time-integral squared amplitude of the time domain and then divided by frequency bin width). <a href="http://www.hep.ucl.ac.uk/~rjn/saltStuff/fftNormalisation.pdf">See this short note for my terminology.</a> As the name suggests this function expects the input waveform to be a volts-seconds one.
   /*!
     \param grWave The input time domain waveform with units of volts-seconds.
+    \param out If non-zero, this TGraph is used for the output (and resized if necessary) instead of allocating a new one.
     \return A pointer to a TGraph containing the power spectrum in dB units, the frequency units are MHz. 
   */  
-   TGraph *makePowerSpectrumVoltsSecondsdB(TGraph *grWave);
+   TGraph *makePowerSpectrumVoltsSecondsdB(TGraph *grWave, TGraph *out=0);
  //! Returns the power spectral density in dB units. Note the PSD returned is normalised and divided by frequency bin width (or if you prefer it is normalised to the time-integral squared amplitude of the time domain and then divided by frequency bin width). <a href="http://www.hep.ucl.ac.uk/~rjn/saltStuff/fftNormalisation.pdf">See this short note for my terminology.</a> As the name suggests this function expects the input waveform to be a millivolts-nanoseconds one.
   /*!
     \param grWave The input time domain waveform with units of millivolts-nanoseconds.
+    \param out If non-zero, this TGraph is used for the output (and resized if necessary) instead of allocating a new one.
     \return A pointer to a TGraph containing the power spectrum in dB units, the frequency units are MHz. 
   */  
-   TGraph *makePowerSpectrumMilliVoltsNanoSeconds(TGraph *grWave);
-   TGraph *makePowerSpectrumMilliVoltsNanoSecondsdB(TGraph *grWave);
+   TGraph *makePowerSpectrumMilliVoltsNanoSeconds(TGraph *grWave, TGraph *out=0);
+   TGraph *makePowerSpectrumMilliVoltsNanoSecondsdB(TGraph *grWave, TGraph *out=0);
   //! Returns the power spectral density of the input waveform zero-padded by some factor. Note the PSD returned is normalised and divided by frequency bin width (or if you prefer it is normalised to the time-integral squared amplitude of the time domain and then divided by frequency bin width). <a href="http://www.hep.ucl.ac.uk/~rjn/saltStuff/fftNormalisation.pdf">See this short note for my terminology.</a> As the name suggests this function expects the input waveform to be a volts-seconds one.
   /*!
     \param grWave The input time domain waveform with units of volts-seconds.
     \param padFactor The factor by which to zero pad the wave.
+    \param out If non-zero, this TGraph is used for the output (and resized if necessary) instead of allocating a new one.
     \return A pointer to a TGraph containing the power spectrum. 
   */  
-   TGraph *makePowerSpectrumVoltsSecondsPadded(TGraph *grWave, Int_t padFactor=4);
+   TGraph *makePowerSpectrumVoltsSecondsPadded(TGraph *grWave, Int_t padFactor=4, TGraph *out=0);
   //! Returns the power spectral density in dB units of the input waveform zero-padded by some factor. Note the PSD returned is normalised and divided by frequency bin width (or if you prefer it is normalised to the time-integral squared amplitude of the time domain and then divided by frequency bin width). <a href="http://www.hep.ucl.ac.uk/~rjn/saltStuff/fftNormalisation.pdf">See this short note for my terminology.</a> As the name suggests this function expects the input waveform to be a volts-seconds one.
   /*!
     \param grWave The input time domain waveform with units of volts-seconds.
     \param padFactor The factor by which to zero pad the wave.
+    \param out If non-zero, this TGraph is used for the output (and resized if necessary) instead of allocating a new one.
     \return A pointer to a TGraph containing the power spectrum in dB units with MHz as the frequency unit. 
   */    
-   TGraph *makePowerSpectrumVoltsSecondsPaddeddB(TGraph *grWave, Int_t padFactor=4);
+   TGraph *makePowerSpectrumVoltsSecondsPaddeddB(TGraph *grWave, Int_t padFactor=4, TGraph *out=0);
   
   //! Returns the power spectral density in completely unormalised unit (as in Parseval's theorem is not obeyed and there is an extra factor of N not removed form the PSD). <a href="http://www.hep.ucl.ac.uk/~rjn/saltStuff/fftNormalisation.pdf">See this short note for my terminology.</a>
   /*!
     \param grWave The input time domain waveform.
+    \param out If non-zero, this TGraph is used for the output (and resized if necessary) instead of allocating a new one.
     \return A pointer to a TGraph containing the power spectrum. 
   */    
-   TGraph *makeRawPowerSpectrum(TGraph *grWave);
+   TGraph *makeRawPowerSpectrum(TGraph *grWave, TGraph *out=0);
 
    //! Returns the correlation of two TGraphs
   /*!
     \param gr1 The first input TGraph
     \param gr2 The second input TGraph
-    \return A pointer to a TGraph containing the correlation of <i>gr1</i> and <i>gr2</i>.
+    \param out If non-zero, this TGraph is used for the output (and resized if necessary) instead of allocating a new one.
+    \return A pointer to a TGraph containing the correlation of <i>gr1</i> and <i>gr2</i>. If setPadToFastLength is on, a shorter (fast length) transform is used, but the output has the same lags (and values, up to rounding).
   */    
-   TGraph *getCorrelationGraph(TGraph *gr1, TGraph *gr2, Int_t *zeroOffset=0);
+   TGraph *getCorrelationGraph(TGraph *gr1, TGraph *gr2, Int_t *zeroOffset=0, TGraph *out=0);
 
 
 
@@ -278,12 +406,14 @@ namespace FFTtools
   /*!
     \param gr1 The first input TGrap  (must be zero meaned)
     \param gr2 The second input TGraph (must be zero meaned)
+    \param out If non-zero, this TGraph is used for the output (and resized if necessary) instead of allocating a new one. It must not be gr1 or gr2.
     \return A pointer to a TGraph containing the correlation of <i>gr1</i> and <i>gr2</i> where each point is normalised by the number of valid samples in the correlation and by the product of the RMS of the input graphs.
   */    
-   TGraph *getNormalisedCorrelationGraph(TGraph *gr1, TGraph *gr2, Int_t *zeroOffset=0);
+   TGraph *getNormalisedCorrelationGraph(TGraph *gr1, TGraph *gr2, Int_t *zeroOffset=0, TGraph *out=0);
 
    //! Returns the normalised correlation of two TGraphs
   /*!
+    This is O(N^2). getNormalisedCorrelationGraphFFT gives the same result faster.
     \param gr1 The first input TGrap  (must be zero meaned)
     \param gr2 The second input TGraph (must be zero meaned)
     \param zeroOffset A pointer to an integer where the sample corresponding to zero offset will be stored
@@ -293,6 +423,19 @@ namespace FFTtools
   */  
    TGraph *getNormalisedCorrelationGraphTimeDomain(TGraph *gr1, TGraph *gr2, Int_t *zeroOffset=0, Int_t useDtRange=0, Double_t dtMin=-1000, Double_t dtMax=1000);
 
+   //! Returns the normalised correlation of two TGraphs, computed by FFT
+  /*!
+    Gives the same result (up to rounding) as getNormalisedCorrelationGraphTimeDomain, but in O(N log N) rather than O(N^2).
+    \param gr1 The first input TGrap  (must be zero meaned)
+    \param gr2 The second input TGraph (must be zero meaned)
+    \param zeroOffset A pointer to an integer where the sample corresponding to zero offset will be stored
+    \param useDtRange A flag to enable the setting of a limited range of deltat's to try
+    \param dtMin The minimum delta-t to include in the correlation, the maximum delta-t to include in the correlation
+    \param out If non-zero, this TGraph is used for the output (and resized if necessary) instead of allocating a new one.
+    \return A pointer to a TGraph containing the correlation of <i>gr1</i> and <i>gr2</i> where each point is normalised by the number of valid samples in the correlation and by the product of the RMS of the input graphs.
+  */
+   TGraph *getNormalisedCorrelationGraphFFT(TGraph *gr1, TGraph *gr2, Int_t *zeroOffset=0, Int_t useDtRange=0, Double_t dtMin=-1000, Double_t dtMax=1000, TGraph *out=0);
+
    //! Returns the correlation of two interpolated TGraphs
   /*!
     \param grIn1 The first input TGraph 
@@ -301,6 +444,90 @@ namespace FFTtools
     \return A pointer to a TGraph containing the correlation of <i>gr1</i> and <i>gr2</i>, after each is interpolated to have a timestep of <i>deltaT</i>.
   */      
    TGraph *getInterpolatedCorrelationGraph(TGraph *grIn1, TGraph *grIn2, Double_t deltaT);
+
+   //! Returns the correlation of two TGraphs, upsampled in the frequency domain
+  /*!
+    Same as getCorrelationGraph, except that the cross spectrum is zero-padded
+    to upsample times its length before the inverse FFT, so the output has
+    upsample times as many lags, spaced by deltaT/upsample. This is the
+    band-limited (sinc) interpolation of the correlation, and costs one bigger
+    inverse FFT, rather than correlating waveforms interpolated to the finer
+    step as getInterpolatedCorrelationGraph does.
+    \param gr1 The first input TGraph
+    \param gr2 The second input TGraph
+    \param upsample The upsampling factor
+    \param zeroOffset A pointer to an integer where the sample corresponding to zero offset will be stored
+    \param out If non-zero, this TGraph is used for the output (and resized if necessary) instead of allocating a new one.
+    \return A pointer to a TGraph containing the upsampled correlation of <i>gr1</i> and <i>gr2</i>
+  */
+   TGraph *getUpsampledCorrelationGraph(TGraph *gr1, TGraph *gr2, Int_t upsample, Int_t *zeroOffset=0, TGraph *out=0);
+
+   //! Returns the time of the peak of the correlation of two TGraphs, to a fraction of a sample
+  /*!
+    The peak is found on the correlation band-limited interpolated to
+    deltaT/upsample, then refined with a parabola through the three points
+    around it. If window is positive, only the plain correlation is
+    computed in full, and the interpolated one only within window samples of
+    its peak (so this is much cheaper than getUpsampledCorrelationGraph,
+    but might miss a peak that only wins after interpolation).
+    \param gr1 The first input TGraph
+    \param gr2 The second input TGraph
+    \param upsample The upsampling factor. 1 means just fit the parabola to the plain correlation.
+    \param window Half-width, in samples, of the region around the coarse peak to upsample. 0 or less upsamples all lags.
+    \param absolute If true, the peak of the absolute value of the correlation is found instead
+    \param peak If non-zero, the (interpolated) correlation at the peak is stored here
+    \return The time (on the x axis of getCorrelationGraph) of the peak
+  */
+   Double_t getCorrelationDelay(TGraph *gr1, TGraph *gr2, Int_t upsample=16, Int_t window=2, bool absolute=false, Double_t *peak=0);
+
+   //! Returns the correlation of two TGraphs, but only at lags (in samples) in [lagMin, lagMax]
+  /*!
+    The points are the same as those getCorrelationGraph gives at those lags (same x and same scale), but see getRestrictedCorrelation for how they are computed.
+    \param gr1 The first input TGraph
+    \param gr2 The second input TGraph
+    \param lagMin The first lag (in samples) to compute
+    \param lagMax The last lag (in samples) to compute
+    \param out If non-zero, this TGraph is used for the output (and resized if necessary) instead of allocating a new one.
+    \param method How to compute it (see getRestrictedCorrelation)
+    \return A pointer to a TGraph with lagMax-lagMin+1 points
+  */
+   TGraph *getRestrictedCorrelationGraph(TGraph *gr1, TGraph *gr2, int lagMin, int lagMax, TGraph *out=0, CorrelationMethod method = CORRELATION_AUTO);
+
+   /** A peak of a correlation, see getCorrelationPeaks */
+   struct CorrelationPeak
+   {
+     int lag;         //!< the lag, in samples, of the highest sample of the peak (the first one, if it's flat-topped, as for getPeakBin)
+     double value;    //!< the correlation there
+     double position; //!< the lag of the peak refined with a parabola through its three highest samples (in samples, so the time is position*deltaT plus any offset)
+   };
+
+  //! Finds the highest peaks of the correlation of two spectra, without making a TGraph
+  /*!
+    The correlation is the (unnormalised, circular) one of two waveforms of length samples,
+    computed in this thread's scratch space, so nothing is allocated once this length has been seen.
+    \param length The length of the waveforms that A and B are the spectra of
+    \param A The spectrum of the first waveform (length/2+1 bins)
+    \param B The spectrum of the second waveform
+    \param k The maximum number of peaks to find
+    \param peaks Where to put them (room for k), highest first
+    \param lagMin Only look at lags >= lagMin
+    \param lagMax Only look at lags <= lagMax
+    \return The number of peaks found
+  */
+   int getCorrelationPeaks(int length, const FFTWComplex *A, const FFTWComplex *B, int k, CorrelationPeak *peaks, int lagMin = INT_MIN, int lagMax = INT_MAX);
+
+  //! Finds the highest peaks of the correlation of two TGraphs, without making a TGraph
+  /*!
+    The lags are those of getCorrelationGraph, i.e. the peak at lag is at x = lag*deltaT + (the difference in start times) on its output.
+    \param gr1 The first input TGraph
+    \param gr2 The second input TGraph
+    \param k The maximum number of peaks to find
+    \param peaks Where to put them (room for k), highest first
+    \param lagMin Only look at lags >= lagMin
+    \param lagMax Only look at lags <= lagMax
+    \return The number of peaks found
+  */
+   int getCorrelationPeaks(TGraph *gr1, TGraph *gr2, int k, CorrelationPeak *peaks, int lagMin = INT_MIN, int lagMax = INT_MAX);
   //! Returns the inverse FFT of the FFT of the input TGraph. Seems pointless.
   /*!
     \param grWave A pointer to the input TGraph
@@ -327,15 +554,23 @@ namespace FFTtools
   //! The Hilbert transform of the input TGraph
   /*!
     \param grWave A pointer to the input TGraph
+    \param out If non-zero, this TGraph is used for the output (and resized if necessary) instead of allocating a new one.
     \return A pointer to a TGraph containing the Hilbert transform
   */
-   TGraph *getHilbertTransform(TGraph *grWave);
+   TGraph *getHilbertTransform(TGraph *grWave, TGraph *out=0);
   //! The Hilbert envelope of the input TGraph. This is defined as e_i=sqrt(v_i^2 + h_i^2), where e_i, v_i and h_i are the i-th sample of the envelope, input graph and hilbert transform of the input graph repsectively.
   /*!
     \param grWave A pointer to the input TGraph
+    \param out If non-zero, this TGraph is used for the output (and resized if necessary) instead of allocating a new one.
     \return A pointer to a TGraph containing the Hilbert envelope function.
   */
-   TGraph *getHilbertEnvelope(TGraph *grWave);
+   TGraph *getHilbertEnvelope(TGraph *grWave, TGraph *out=0);
+
+   /** The Hilbert transform of n samples of y, written to out (which may be y). Nothing is allocated once the plan exists. */
+   void getHilbertTransform(int n, const double *y, double *out);
+
+   /** The Hilbert envelope of n samples of y, written to out (which may be y). Nothing is allocated once the plan exists. */
+   void getHilbertEnvelope(int n, const double *y, double *out);
 
   //Utility functions (not necessarily FFT related but they'll live here for now
 
@@ -538,18 +773,20 @@ namespace FFTtools
     \param grWave The input graph.
     \param minFreq The lowest frequency to pass.
     \param maxFreq The highest frequency to pass.
+    \param out If non-zero, this TGraph is used for the output (and resized if necessary) instead of allocating a new one.
     \return The derviative of grWave.
   */      
-   TGraph *simplePassBandFilter(TGraph *grWave, Double_t minFreq, Double_t maxFreq);
+   TGraph *simplePassBandFilter(TGraph *grWave, Double_t minFreq, Double_t maxFreq, TGraph *out=0);
 
  //! This returns a TGraph which has had a simple notch band filter applied
   /*!
     \param grWave The input graph.
     \param minFreq The lower frequency of the notch.
     \param maxFreq The upper frequency of the notch.
+    \param out If non-zero, this TGraph is used for the output (and resized if necessary) instead of allocating a new one.
     \return The derviative of grWave.
   */      
-   TGraph *simpleNotchFilter(TGraph *grWave, Double_t minFreq, Double_t maxFreq);
+   TGraph *simpleNotchFilter(TGraph *grWave, Double_t minFreq, Double_t maxFreq, TGraph *out=0);
 
 
   //! This returns a TGraph which has had N simple notch band filters applied
@@ -558,9 +795,10 @@ namespace FFTtools
     \param numNotches The number of notch regiosn
     \param minFreq An array of lower frequency of the notches.
     \param maxFreq An array upper frequency of the notch.
+    \param out If non-zero, this TGraph is used for the output (and resized if necessary) instead of allocating a new one.
     \return The derviative of grWave.
   */      
-   TGraph *multipleSimpleNotchFilters(TGraph *grWave, Int_t numNotches, Double_t minFreq[], Double_t maxFreq[]);
+   TGraph *multipleSimpleNotchFilters(TGraph *grWave, Int_t numNotches, Double_t minFreq[], Double_t maxFreq[], TGraph *out=0);
 
 //! This returns a TGraph which has been cropped in.
   /*!
@@ -612,10 +850,32 @@ namespace FFTtools
     * Correlation between two FFTs
     * bandpasses between min_i and max_i using butterworth filter of order order
     * work can be used for temporary to avoid allocation of new memory 
+    * To correlate many pairs of channels, CorrelationEngine is faster.
     */
    double * FFTCorrelation(int waveformlength, const FFTWComplex * A, const FFTWComplex * B, FFTWComplex * work = 0, 
                            int min_i = 0, int max_i =0, int order=1);  
 
+   /*!
+    * Single precision version of FFTCorrelation
+    */
+   float * FFTCorrelation(int waveformlength, const std::complex<float> * A, const std::complex<float> * B, std::complex<float> * work = 0,
+                          int min_i = 0, int max_i =0, int order=1);
+
+   /** Returns the smallest length >= n of the form 2^a 3^b 5^c 7^d, which FFTW transforms much faster than lengths with large prime factors.
+    *
+    * FFTCorrelation works on transforms that are already done, so to use
+    * it with a fast length, zero-pad the waveforms to nextFastLength before
+    * transforming them.
+    */
+   int nextFastLength(int n);
+
+   /** If enabled, getCorrelationGraph and getConvolution (and everything
+    * that uses them) pad their transforms to a fast length (see
+    * nextFastLength) instead of a power of 2 or the input length. The output
+    * is on the same axis as without padding. Off by default.
+    */
+   void setPadToFastLength(bool enable);
+
 
    /*! in place array rotation
     */
@@ -640,9 +900,17 @@ namespace FFTtools
 
     /*!convolution without FFT of x with kernel h. y should have same size as x (it is cropped symmetrically) 
       if delay = 0, h will be centered around its middle sample, if - M/2 , will be purely causal, etc. 
+      Away from the edges, this is vectorized if compiled with ENABLE_VECTORIZE (see simdWidth). 
     */
     double * directConvolve(int N, const double *x, int M, const double * h, double *y = 0, int delay = 0,  DirectConvolveEdgeBehavior edge_behavior = ZEROES_OUTSIDE); 
 
+    /*! single precision version of directConvolve */
+    float * directConvolve(int N, const float *x, int M, const float * h, float *y = 0, int delay = 0,  DirectConvolveEdgeBehavior edge_behavior = ZEROES_OUTSIDE); 
+
+    /** The width, in bytes, of the vectors the vectorized kernels (directConvolve, IIRFilter::filterOutChannels, SkyMap::compute) use on this CPU:
+     * 64 with AVX-512, 32 with AVX2, otherwise 16. 0 if they aren't built for several instruction sets (FFTTOOLS_SIMD_DISPATCH isn't defined). */
+    int simdWidth(); 
+
 
     /*! wraps periodic array of doubles. center assumed to be period/2 */ 
    void wrap(size_t N, double * vals, double period = 360); 
@@ -703,6 +971,103 @@ namespace FFTtools
    int loadWisdom(const char * file); 
    int saveWisdom(const char * file); 
 
+   /** How hard FFTW should try when making a new plan. More rigor means faster transforms, but slower planning. */
+   enum FFTPlanRigor
+   {
+     PLAN_ESTIMATE,  //!< FFTW_ESTIMATE: planning is nearly free, transforms may be slow
+     PLAN_MEASURE,   //!< FFTW_MEASURE: the default
+     PLAN_PATIENT,   //!< FFTW_PATIENT: the default if compiled with FFTW_USE_PATIENT
+     PLAN_EXHAUSTIVE //!< FFTW_EXHAUSTIVE: only sensible if you save wisdom
+   };
+
+   /** Sets the planner rigor for plans made from now on (plans that already exist are kept).
+    *
+    * If min_length and max_length are both <= 0, this sets the default
+    * (and forgets any ranges set before). Otherwise, it applies only to
+    * lengths in [min_length, max_length] (max_length <= 0 means no upper
+    * limit), taking precedence over previously set ranges.
+    */
+   void setPlanRigor(FFTPlanRigor rigor, int min_length = 0, int max_length = 0);
+
+   /** Makes (double precision) transforms of at least min_length samples use nthreads of FFTW's own threads (fftw_plan_with_nthreads).
+    *
+    * This is meant for very long single transforms. Shorter transforms are
+    * not affected. nthreads <= 1 goes back to single-threaded plans for
+    * everything. Plans are cached per thread count, so switching back and
+    * forth doesn't replan. This requires compiling with FFTTOOLS_FFTW_THREADS
+    * and linking against fftw3_threads (otherwise a warning is printed).
+    */
+   void setFFTWThreads(int nthreads, int min_length = 1 << 18);
+
+   /** Statistics for one transform length, summed over all threads. See getFFTStats. */
+   struct FFTLengthStats
+   {
+     FFTLengthStats() : length(0), single_precision(false), hits(0), misses(0), plan_time(0),
+                        n_forward(0), n_backward(0), forward_time(0), backward_time(0) {; }
+
+     int length;
+     bool single_precision;
+     unsigned long hits;   //!< transforms that found this length already set up in their thread
+     unsigned long misses; //!< times a thread had to set this length up (allocating its arrays, and planning if no thread had yet)
+     double plan_time;     //!< seconds spent planning this length (both directions)
+     unsigned long n_forward;  //!< number of forward transforms
+     unsigned long n_backward; //!< number of backward transforms
+     double forward_time;  //!< seconds spent in forward transforms (only counted while setFFTTiming is on)
+     double backward_time; //!< seconds spent in backward transforms (only counted while setFFTTiming is on)
+   };
+
+   /** See getFFTStats */
+   struct FFTStats
+   {
+     std::vector<FFTLengthStats> lengths;     //!< one per (length, precision) seen, sorted by length
+     std::vector<size_t> thread_buffer_bytes; //!< bytes of transform arrays held by each live thread that has done any transforms
+     size_t total_buffer_bytes;               //!< the sum of thread_buffer_bytes
+   };
+
+   /** Returns statistics about the plan cache and the transforms done so far.
+    *
+    * Only the single (not batched) transforms are counted. Counters of other
+    * threads are read while they might still be running, so they may be a
+    * little behind. Threads that have exited still count, except for their
+    * (freed) arrays.
+    */
+   FFTStats getFFTStats();
+
+   /** Zeroes the counters and plan times in getFFTStats (buffer sizes are kept, since they're still allocated) */
+   void resetFFTStats();
+
+   /** Enable or disable timing each transform for getFFTStats (off by default, since reading the clock costs about as much as a short FFT) */
+   void setFFTTiming(bool enable);
+
+   /** Limits how much the transform caches may hold on to, for long-running jobs that see many different lengths.
+    *
+    * @param max_bytes_per_thread if non-zero, when a thread's transform arrays of one precision (double or float; see FFTStats::thread_buffer_bytes for both together) would exceed this, the arrays of its least recently used lengths of that precision are freed. The two most recently used lengths are always kept. A thread also keeps the batched plans (see doFFTBatch) of no more geometries than it has double lengths (or two), giving back the least recently used.
+    * @param max_unused_plans if >= 0, at most this many plans that no thread is using are kept (the least recently used are destroyed). Plans a thread has arrays for are always kept.
+    */
+   void setFFTCacheLimits(size_t max_bytes_per_thread, int max_unused_plans = -1);
+
+   /** Frees the calling thread's transform arrays and scratch memory, and destroys all plans that no thread is using anymore.
+    *
+    * Other threads keep their caches (they can call this themselves, and
+    * anything they hold is released when they exit). Nothing is lost but
+    * time: lengths seen again are set up again (with the help of FFTW's
+    * wisdom, which is kept).
+    */
+   void releaseCaches();
+
+   /** Makes the plans for the given lengths now, so that they don't have to be made the first time each length is seen.
+    *
+    * @param lengths the lengths to plan
+    * @param n the number of lengths
+    * @param background if true, planning is done in a separate thread and this returns immediately. This requires compiling with FFTTOOLS_THREAD_SAFE or FFTTOOLS_USE_OMP (otherwise planning happens now). Transforms of a length still being planned will wait for it.
+    * @param wisdom_file if non-zero, (double precision) wisdom is loaded from this file (if it exists) before planning and saved to it afterwards, as in loadWisdom and saveWisdom
+    * @param single_precision if true, also make the single-precision (fftwf) plans
+    */
+   void warmPlans(const int * lengths, int n, bool background = false, const char * wisdom_file = 0, bool single_precision = false);
+
+   /** Waits for any background planning started by warmPlans to finish */
+   void waitForWarmPlans();
+
 
    /**
     *  Make a welch periodogram of evenly sampled input. A Bartlett periodogram can be emulated using overlap_fraction = 0 and window = &RECTANGULAR_WINDOW
@@ -718,6 +1083,13 @@ namespace FFTtools
     */ 
    TGraph * welchPeriodogram(const TGraph * gin, int segment_size, double overlap_fraction = 0.5, const FFTWindowType * window = &GAUSSIAN_WINDOW , bool truncate_extra = true, TGraph * gout = 0); 
 
+   /** Single precision version of welchPeriodogram, working on a bare array of N evenly spaced samples.
+    *
+    *  @param out if non-zero, used for output (must hold segment_size/2+1 values). Otherwise a new array is allocated, which the caller must delete.
+    *  @return the Welch Periodogram. Bin i corresponds to frequency i / (segment_size * dt)
+    */
+   float * welchPeriodogram(int N, const float * y, int segment_size, double overlap_fraction = 0.5, const FFTWindowType * window = &GAUSSIAN_WINDOW , bool truncate_extra = true, float * out = 0);
+
 
 
    
@@ -399,9 +399,10 @@ namespace FFTtools
          *  @param g The graphs. Will be modified. 
          *  @param dt The nominal sample rate for uneven waveforms. If <=0, then the graphs are assumed to be even and dt is computed from first time step. 
          *  @param w Scales for the input values. If the y-axis have different scales (different gains or units) you should pass an array here. If 0, everything is equally-weighted. 
+         *  @param ws If non-zero, the FFT scratch arrays are taken from this Workspace instead of being allocated for each call.
          *
          */
-        void subtractCW(int ng, TGraph ** g, double dt, const double * w = 0); 
+        void subtractCW(int ng, TGraph ** g, double dt, const double * w = 0, Workspace * ws = 0); 
 
         /** Set limits on the frequencies to try to subtract. If the units of the graph are in ns, the frequencies should be in GHz. 
          *
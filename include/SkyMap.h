@@ -0,0 +1,93 @@
+#ifndef FFTTOOLS_SKY_MAP_H
+#define FFTTOOLS_SKY_MAP_H
+
+#include <vector>
+#include <cstddef>
+
+/* Interferometric map of pair correlations over a grid of directions
+ *
+ * The geometry is given once, as a function returning the delay (in
+ * samples of the correlations) of each antenna pair for a direction. The
+ * delays for every grid point are then tabulated, and filling a map for an
+ * event is just summing (linearly interpolated) correlation values looked up
+ * in the table, which is what the correlation functions from FFTCorrelation
+ * or a CorrelationEngine are for.
+ *
+ * The correlations are indexed as FFTCorrelation returns them, i.e.
+ * circularly, with lag 0 at index 0 and negative lags at the end.
+ *
+ * With FFTTOOLS_USE_OMP, the rows of the map are filled in parallel.
+ * With ENABLE_VECTORIZE, the interpolation along each row is vectorized (see
+ * FFTtools::simdWidth), though the table lookups are still one at a time.
+ **/
+
+namespace FFTtools
+{
+  class CorrelationEngine;
+
+  class SkyMap
+  {
+    public:
+      /** Delay, in samples, of pair for the direction (phi,theta). data is whatever was passed to setGeometry. */
+      typedef double (*DelayFunction)(int pair, double phi, double theta, void * data);
+
+      /** A map with nphi x ntheta bins, centred at evenly spaced directions within [phi_min, phi_max] x [theta_min, theta_max] */
+      SkyMap(int nphi, double phi_min, double phi_max, int ntheta, double theta_min, double theta_max);
+
+      /** Sets the number of pairs and the delay function, and tabulates the delays on the grid. This is the slow part, so do it once. */
+      void setGeometry(int npairs, DelayFunction delay, void * data = 0);
+
+      /** Fills the map from npairs correlations (as from FFTCorrelation), each length long. Each bin is the average over the pairs. */
+      void compute(int length, const double * const * correlations);
+
+      /** Fills the map from all the pairs of a CorrelationEngine (which should be in the same order as in the DelayFunction) */
+      void compute(const CorrelationEngine & engine);
+
+      /** Finds the highest bin. Any of the pointers may be zero. Returns its value. */
+      double getPeak(double * phi = 0, double * theta = 0, int * iphi = 0, int * itheta = 0) const;
+
+      /** Refines the peak of the last compute: finds the highest point on a
+       *  finer nphi x ntheta grid spanning one coarse bin either side of the
+       *  coarse peak, calling the DelayFunction directly (so this should be
+       *  small). This can be repeated (zooming in each time) by passing nzooms > 1.
+       *  Any of the pointers may be zero. Returns the value at the peak.
+       */
+      double zoom(int nphi, int ntheta, double * phi = 0, double * theta = 0, int nzooms = 1);
+
+      /** The map, ntheta rows of nphi */
+      const double * getMap() const { return &map[0]; }
+      double getValue(int iphi, int itheta) const { return map[itheta * nphi + iphi]; }
+
+      int getNPhi() const { return nphi; }
+      int getNTheta() const { return ntheta; }
+      double getPhi(int iphi) const { return phi0 + (iphi + 0.5) * dphi; }
+      double getTheta(int itheta) const { return theta0 + (itheta + 0.5) * dtheta; }
+
+    private:
+      /** the interpolated value of a correlation with wrap-around, at delay d */
+      double interpolate(const double * corr, double d) const;
+
+      int nphi, ntheta;
+      double phi0, dphi, theta0, dtheta;
+
+      int npairs;
+      DelayFunction delay_fn;
+      void * delay_data;
+
+      std::vector<double> delays; // npairs x ngrid, in samples
+
+      // for each pair and grid point, the sample below the delay (already
+      // wrapped for the current length) and how far past it the delay is
+      int table_length;
+      std::vector<int> lower;
+      std::vector<float> frac;
+
+      std::vector<double> map;
+
+      // the last correlations, (each with the first sample repeated at the end) for zoom
+      int length;
+      std::vector<double> padded;
+  };
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef FFTTOOLS_TEMPLATE_BANK_H
+#define FFTTOOLS_TEMPLATE_BANK_H
+
+#include <vector>
+#include <cstddef>
+#include "Workspace.h"
+
+class FFTWComplex;
+
+/* Matched filtering against a bank of templates
+ *
+ * Template spectra are computed once, when added. Matching transforms the
+ * waveform once and inverse transforms the products a few templates at a
+ * time, scanning each for its peak. The score is the circular
+ * cross-correlation divided by both L2 norms, so between -1 and 1.
+ *
+ * match uses scratch space kept in the bank, so don't match against one bank from several threads.
+ **/
+
+namespace FFTtools
+{
+
+  /** The result of TemplateBank::match */
+  struct TemplateMatch
+  {
+    TemplateMatch() : index(-1), lag(0), score(0) {; }
+
+    /** Which template matched best (-1 if there are none) */
+    int index;
+
+    /** The shift (in samples, between -length/2 and length/2) of the waveform relative to the template, i.e. waveform[t+lag] ~ template[t] */
+    int lag;
+
+    /** The normalised correlation at that lag */
+    double score;
+  };
+
+
+  class TemplateBank
+  {
+    public:
+      /** Create an empty bank. All templates and waveforms are zero-padded (or truncated) to length. batch is how many templates are inverse transformed at once. */
+      TemplateBank(int length, int batch = 16);
+
+      /** Add a template of n samples. Returns its index. */
+      int addTemplate(int n, const double * y);
+
+      /** Find the template, and lag, that best matches the waveform y of n samples.
+       *
+       * If absolute is true, the largest |score| wins (so inverted templates match too), otherwise the largest score.
+       * If scores and/or lags are non-zero, they are filled with the best score and lag of each template (so need room for nTemplates()).
+       */
+      TemplateMatch match(int n, const double * y, bool absolute = false, double * scores = 0, int * lags = 0);
+
+      int nTemplates() const { return ntemplates; }
+      int getLength() const { return length; }
+
+      /** Removes all templates */
+      void clear() { ntemplates = 0; spectra.clear(); }
+
+    private:
+      /** zero-pad or truncate y into the aligned input buffer, returning its L2 norm */
+      double loadInput(int n, const double * y);
+
+      int length;
+      int nfreq;
+      int batch;
+      int ntemplates;
+
+      std::vector<FFTWComplex> spectra; // ntemplates x nfreq, conjugated and normalised
+
+      // scratch, all from ws
+      Workspace ws;
+      double * input; // length
+      FFTWComplex * input_fft; // nfreq
+      FFTWComplex * products; // batch x nfreq
+      double * corrs; // batch x length
+  };
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef FFTTOOLS_WORKSPACE_H
+#define FFTTOOLS_WORKSPACE_H
+
+#include <vector>
+#include <cstddef>
+
+class FFTWComplex;
+
+/* Scratch memory arena, for the overloads that take one instead of allocating
+ *
+ * Memory is handed out by bumping a pointer and only given back, all at once,
+ * by reset(), so keep one per worker thread and reset it for each event. Reset
+ * merges the blocks, so after a typical event nothing more gets allocated.
+ **/
+
+namespace FFTtools
+{
+  class Workspace
+  {
+    public:
+      /** Create a workspace, with room for nbytes to start with (it grows as needed). */
+      Workspace(size_t nbytes = 0);
+      ~Workspace();
+
+      /** Returns nbytes of uninitialized memory, aligned at least as well as fftw_malloc (so the aligned doFFT variants can use it).
+       * This is valid until the next reset() (or until the Workspace is destroyed).
+       */
+      void * alloc(size_t nbytes);
+
+      /** Convenience versions of alloc for arrays of n elements */
+      double * allocDouble(size_t n) { return (double*) alloc(n * sizeof(double)); }
+      float * allocFloat(size_t n) { return (float*) alloc(n * sizeof(float)); }
+      FFTWComplex * allocComplex(size_t n) { return (FFTWComplex*) alloc(n * 2 * sizeof(double)); }
+
+      /** Makes all memory available again. Anything returned by alloc before should not be used anymore. */
+      void reset();
+
+      /** Bytes handed out since the last reset */
+      size_t used() const { return nused; }
+
+      /** Total bytes currently allocated */
+      size_t capacity() const;
+
+    private:
+      struct Block
+      {
+        char * mem;
+        size_t size;
+      };
+
+      void addBlock(size_t nbytes);
+
+      std::vector<Block> blocks;
+      size_t offset; // in the last block
+      size_t nused;
+
+      // not copyable
+      Workspace(const Workspace &);
+      Workspace & operator=(const Workspace &);
+  };
+}
+
+#endif
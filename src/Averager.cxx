@@ -101,28 +101,19 @@ void FFTtools::Averager::add(const TGraph *g)
     return; 
   }
 
-  TGraph * cg = FFTtools::getCorrelationGraph(avg,gg); 
+  // only lags whose time shift (x of getCorrelationGraph) is within max_shift
+  double dt = avg->GetX()[1] - avg->GetX()[0]; 
+  double offset = avg->GetX()[0] - gg->GetX()[0]; 
+  int min_lag = (int) ceil((-max_shift - offset) / dt); 
+  int max_lag = (int) floor((max_shift - offset) / dt); 
 
-  int peak = -1; 
-  double max = 0; 
   int shift = 0; 
-
-  for (int i = 0; i <cg->GetN(); i++)
+  FFTtools::CorrelationPeak peak; 
+  if (FFTtools::getCorrelationPeaks(avg, gg, 1, &peak, min_lag, max_lag))
   {
-    double shiftval = cg->GetX()[i]; 
-    if (fabs(shiftval) > max_shift) continue; 
-    if (peak < 0 || cg->GetY()[i] > max)
-    {
-      shift = peak - cg->GetN()/2; 
-      max = cg->GetY()[i]; 
-      peak = i; 
-    }
+    shift = peak.lag; 
   }
 
-
-
-  delete cg; 
-  
   for (int j = 0; j < sum->GetN(); j++)
   {
      int jj = j - shift; 
@@ -0,0 +1,173 @@
+#include "Beamformer.h"
+#include "FFTtools.h"
+#include "FFTWComplex.h"
+#include "TMath.h"
+#include <string.h>
+#include <math.h>
+#include <iostream>
+
+
+/* The phase ramps are built by repeated multiplication, restarting from an
+ * exact value this often, so the rounding errors can't pile up. */
+static const int ramp_restart = 64;
+
+
+FFTtools::Beamformer::Beamformer(int len, int nbatch)
+  : length(len), nfreq(len/2+1), batch(nbatch > 0 ? nbatch : 1), nchan(0), nbeams(0)
+{
+  sums = ws.allocComplex(nfreq * batch);
+  ramp = ws.allocComplex(nfreq);
+  input = ws.allocDouble(length);
+}
+
+
+void FFTtools::Beamformer::setSpectra(int n, const FFTWComplex * const * in)
+{
+  nchan = n;
+  spectra.resize(nchan * nfreq);
+  for (int c = 0; c < nchan; c++)
+  {
+    memcpy(&spectra[c * nfreq], in[c], nfreq * sizeof(FFTWComplex));
+  }
+}
+
+
+void FFTtools::Beamformer::setWaveforms(int n, const double * const * in)
+{
+  nchan = n;
+  spectra.resize(nchan * nfreq);
+  for (int c = 0; c < nchan; c++)
+  {
+    // the aligned doFFT needs an aligned input, but the output doesn't have to be
+    memcpy(input, in[c], length * sizeof(double));
+    FFTtools::doFFT(length, input, ramp);
+    memcpy(&spectra[c * nfreq], ramp, nfreq * sizeof(FFTWComplex));
+  }
+}
+
+
+void FFTtools::Beamformer::phaseRamp(double tau, FFTWComplex * out) const
+{
+  double dphase = 2 * TMath::Pi() * tau / length;
+  double step_re = cos(dphase);
+  double step_im = sin(dphase);
+
+  double re = 1, im = 0;
+  for (int k = 0; k < nfreq; k++)
+  {
+    if (k % ramp_restart == 0)
+    {
+      re = cos(k * dphase);
+      im = sin(k * dphase);
+    }
+
+    out[k].re = re;
+    out[k].im = im;
+
+    double next_re = re * step_re - im * step_im;
+    im = re * step_im + im * step_re;
+    re = next_re;
+  }
+
+  // the Nyquist bin of a real signal has to stay real
+  if (length % 2 == 0)
+  {
+    out[nfreq-1].re = cos(TMath::Pi() * tau);
+    out[nfreq-1].im = 0;
+  }
+}
+
+
+void FFTtools::Beamformer::accumulate(const FFTWComplex * spectrum, const FFTWComplex * r, FFTWComplex * sum) const
+{
+  for (int k = 0; k < nfreq; k++)
+  {
+    sum[k].re += spectrum[k].re * r[k].re - spectrum[k].im * r[k].im;
+    sum[k].im += spectrum[k].re * r[k].im + spectrum[k].im * r[k].re;
+  }
+}
+
+
+void FFTtools::Beamformer::finish(int nthis, double * out)
+{
+  double norm = 1. / nchan;
+  for (int i = 0; i < nthis * nfreq; i++)
+  {
+    sums[i].re *= norm;
+    sums[i].im *= norm;
+  }
+
+  FFTtools::doInvFFTBatch(length, nthis, sums, out);
+}
+
+
+void FFTtools::Beamformer::setDelays(int nb, int n, const double * delays)
+{
+  if (nchan && n != nchan)
+  {
+    std::cerr << "Warning! " << __PRETTY_FUNCTION__ << ": " << n << " channels of delays, but " << nchan << " channels of data" << std::endl;
+  }
+
+  nbeams = nb;
+  ramps.resize(nbeams * n * nfreq);
+  for (int b = 0; b < nbeams; b++)
+  {
+    for (int c = 0; c < n; c++)
+    {
+      phaseRamp(delays[b * n + c], &ramps[(b * n + c) * nfreq]);
+    }
+  }
+}
+
+
+void FFTtools::Beamformer::form(double * out)
+{
+  if (!nchan || (int) ramps.size() != nbeams * nchan * nfreq)
+  {
+    std::cerr << "Warning! " << __PRETTY_FUNCTION__ << ": the data and the delays (from setDelays) don't have the same channels" << std::endl;
+    return;
+  }
+
+  for (int first = 0; first < nbeams; first += batch)
+  {
+    int nthis = nbeams - first < batch ? nbeams - first : batch;
+    memset(sums, 0, nthis * nfreq * sizeof(FFTWComplex));
+
+    for (int j = 0; j < nthis; j++)
+    {
+      for (int c = 0; c < nchan; c++)
+      {
+        accumulate(&spectra[c * nfreq], &ramps[((first + j) * nchan + c) * nfreq], sums + j * nfreq);
+      }
+    }
+
+    finish(nthis, out + first * length);
+  }
+}
+
+
+void FFTtools::Beamformer::form(int nb, const double * delays, double * out)
+{
+  if (!nchan)
+  {
+    std::cerr << "Warning! " << __PRETTY_FUNCTION__ << ": no channels set. Call setSpectra or setWaveforms first." << std::endl;
+    return;
+  }
+
+  for (int first = 0; first < nb; first += batch)
+  {
+    int nthis = nb - first < batch ? nb - first : batch;
+    memset(sums, 0, nthis * nfreq * sizeof(FFTWComplex));
+
+    for (int j = 0; j < nthis; j++)
+    {
+      for (int c = 0; c < nchan; c++)
+      {
+        phaseRamp(delays[(first + j) * nchan + c], ramp);
+        accumulate(&spectra[c * nfreq], ramp, sums + j * nfreq);
+      }
+    }
+
+    finish(nthis, out + first * length);
+  }
+}
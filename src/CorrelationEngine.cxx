@@ -0,0 +1,244 @@
+#include "CorrelationEngine.h"
+#include "FFTtools.h"
+#include "FFTWComplex.h"
+#include "TMath.h"
+#include <fftw3.h>
+#include <string.h>
+#include <math.h>
+#include <iostream>
+
+#ifdef FFTTOOLS_USE_OMP
+#include <omp.h>
+#endif
+
+
+/* rows are padded to this many bytes, so each starts as aligned as the fftw_malloc'd block */
+static const int row_align = 64;
+
+static int paddedLength(int n, int elem_size)
+{
+  int per = row_align / elem_size;
+  return ((n + per - 1) / per) * per;
+}
+
+
+bool FFTtools::CorrelationEngine::BandKey::operator<(const BandKey & o) const
+{
+  if (length != o.length) return length < o.length;
+  if (min_i != o.min_i) return min_i < o.min_i;
+  if (max_i != o.max_i) return max_i < o.max_i;
+  return order < o.order;
+}
+
+
+FFTtools::CorrelationEngine::CorrelationEngine(int min_i, int max_i, int order)
+  : nchan(0), length(0), nfreq(0), band_min(min_i), band_max(max_i), band_order(order),
+    spectra(0), spec_stride(0), lags(0), stride(0), lags_capacity(0), work(0), work_capacity(0)
+{
+}
+
+
+FFTtools::CorrelationEngine::~CorrelationEngine()
+{
+  if (spectra) fftw_free(spectra);
+  if (lags) fftw_free(lags);
+  if (work) fftw_free(work);
+}
+
+
+void FFTtools::CorrelationEngine::setup(int n, int len)
+{
+  int new_stride = paddedLength(len/2+1, sizeof(FFTWComplex));
+
+  if (!spectra || n * new_stride > nchan * spec_stride)
+  {
+    if (spectra) fftw_free(spectra);
+    spectra = (FFTWComplex*) fftw_malloc(sizeof(FFTWComplex) * n * new_stride);
+  }
+
+  nchan = n;
+  length = len;
+  nfreq = len/2+1;
+  spec_stride = new_stride;
+  stride = paddedLength(len, sizeof(double));
+  rms.resize(n);
+}
+
+
+void FFTtools::CorrelationEngine::setSpectra(int n, int len, const FFTWComplex * const * in)
+{
+  setup(n, len);
+  for (int ichan = 0; ichan < n; ichan++)
+  {
+    memcpy(spectra + ichan * spec_stride, in[ichan], nfreq * sizeof(FFTWComplex));
+  }
+}
+
+
+void FFTtools::CorrelationEngine::setWaveforms(int n, int len, const double * const * in)
+{
+  setup(n, len);
+
+  // the aligned doFFT wants an aligned input, so borrow the start of the lag matrix for it
+  if (lags_capacity < (size_t) stride)
+  {
+    if (lags) fftw_free(lags);
+    lags = (double*) fftw_malloc(sizeof(double) * stride);
+    lags_capacity = stride;
+  }
+
+  for (int ichan = 0; ichan < n; ichan++)
+  {
+    memcpy(lags, in[ichan], len * sizeof(double));
+    FFTtools::doFFT(len, lags, spectra + ichan * spec_stride);
+  }
+}
+
+
+const double * FFTtools::CorrelationEngine::bandWeights(int len, int min_i, int max_i, int order)
+{
+  // same clamping as FFTCorrelation
+  int fftlen = len/2+1;
+  if (max_i <= 0 || max_i >= fftlen) max_i = fftlen-1;
+  if (min_i < 0) min_i = 0;
+
+  BandKey key;
+  key.length = len;
+  key.min_i = min_i;
+  key.max_i = max_i;
+  key.order = order;
+
+  std::map<BandKey, std::vector<double> >::iterator it = weights.find(key);
+  if (it != weights.end()) return &it->second[0];
+
+  std::vector<double> & w = weights[key];
+  w.resize(fftlen);
+
+  for (int i = 0; i < fftlen; i++)
+  {
+    double weight = 1;
+
+    if (min_i > 0)
+    {
+      weight /= (1 + TMath::Power(double(min_i)/i,2*order));
+    }
+
+    if (max_i < fftlen - 1)
+    {
+      weight /=( 1 +TMath::Power(double(i)/max_i,2*order));
+    }
+
+    w[i] = weight;
+  }
+
+  return &w[0];
+}
+
+
+void FFTtools::CorrelationEngine::computeNorms(const double * w)
+{
+  for (int ichan = 0; ichan < nchan; ichan++)
+  {
+    const FFTWComplex * X = spectra + ichan * spec_stride;
+    double sum = 0;
+    for (int i = 1; i < nfreq; i++) //don't add DC component to RMS!
+    {
+      sum += w[i]*(X[i].re * X[i].re + X[i].im * X[i].im) * 2 / (length*length);
+    }
+    rms[ichan] = sum;
+  }
+}
+
+
+void FFTtools::CorrelationEngine::computeAll()
+{
+  pair_first.clear();
+  pair_second.clear();
+
+  for (int i = 0; i < nchan; i++)
+  {
+    for (int j = i+1; j < nchan; j++)
+    {
+      pair_first.push_back(i);
+      pair_second.push_back(j);
+    }
+  }
+
+  computePairs(pair_first.size(), 0, 0);
+}
+
+
+void FFTtools::CorrelationEngine::computePairs(int npairs, const int * first, const int * second)
+{
+  if (!nchan)
+  {
+    std::cerr << "Warning! " << __PRETTY_FUNCTION__ << ": no channels set. Call setSpectra or setWaveforms first." << std::endl;
+    return;
+  }
+
+  // computeAll fills in the pairs itself
+  if (first)
+  {
+    pair_first.assign(first, first + npairs);
+    pair_second.assign(second, second + npairs);
+  }
+
+  if (lags_capacity < (size_t) npairs * stride)
+  {
+    if (lags) fftw_free(lags);
+    lags_capacity = (size_t) npairs * stride;
+    lags = (double*) fftw_malloc(sizeof(double) * lags_capacity);
+  }
+
+  const double * w = bandWeights(length, band_min, band_max, band_order);
+  computeNorms(w);
+
+  // one row per thread of the loop below (the number of threads may have changed since the last time)
+#ifdef FFTTOOLS_USE_OMP
+  int nthreads = omp_get_max_threads();
+#else
+  int nthreads = 1;
+#endif
+
+  if ((size_t) nthreads * spec_stride > work_capacity)
+  {
+    if (work) fftw_free(work);
+    work_capacity = (size_t) nthreads * spec_stride;
+    work = (FFTWComplex*) fftw_malloc(sizeof(FFTWComplex) * work_capacity);
+  }
+
+#ifdef FFTTOOLS_USE_OMP
+#pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+#endif
+  for (int k = 0; k < npairs; k++)
+  {
+#ifdef FFTTOOLS_USE_OMP
+    FFTWComplex * tmp = work + omp_get_thread_num() * spec_stride;
+#else
+    FFTWComplex * tmp = work;
+#endif
+    const FFTWComplex * A = spectra + pair_first[k] * spec_stride;
+    const FFTWComplex * B = spectra + pair_second[k] * spec_stride;
+
+    for (int i = 0; i < nfreq; i++)
+    {
+      double reFFT1=A[i].re;
+      double imFFT1=A[i].im;
+      double reFFT2=B[i].re;
+      double imFFT2=B[i].im;
+      tmp[i].re=w[i]*(reFFT1*reFFT2+imFFT1*imFFT2)/length;
+      tmp[i].im=w[i]*(imFFT1*reFFT2-reFFT1*imFFT2)/length;
+    }
+
+    double * out = lags + k * stride;
+    FFTtools::doInvFFTClobber(length, tmp, out);
+
+    double rmsA = rms[pair_first[k]];
+    double rmsB = rms[pair_second[k]];
+    double norm = (rmsA && rmsB) ? 1./(sqrt(rmsA*rmsB)) : 1;
+    for (int i = 0; i < length; i++)
+    {
+      out[i] *= norm;
+    }
+  }
+}
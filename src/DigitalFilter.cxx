@@ -9,6 +9,67 @@
 
 #include "TMatrixD.h"
 #include "TDecompLU.h"
+#include <fftw3.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+
+#ifdef FFTTOOLS_THREAD_SAFE
+#include "TMutex.h"
+static TMutex tap_spectra_mutex;
+static TMutex responses_mutex;
+#endif
+
+/* The IIR recursions for several channels at once, one per lane: the channels
+ * are interleaved, filter_lanes at a time, and the kernels below go through
+ * those as vectors of type V. With FFTTOOLS_SIMD_DISPATCH, that's the
+ * compiler's vector type, instantiated for each instruction set's register
+ * width (see FFTtools::simdWidth). Otherwise it's just double, which still
+ * keeps several independent recursions in flight. */ 
+static const int filter_lanes = 8; 
+
+#ifdef FFTTOOLS_SIMD_DISPATCH
+#define LANES_INLINE inline __attribute__((always_inline))
+typedef double Lanes16 __attribute__((vector_size(16)));
+typedef double Lanes32 __attribute__((vector_size(32)));
+typedef double Lanes64 __attribute__((vector_size(64)));
+#else
+#define LANES_INLINE inline
+#endif
+
+// fully unrolled, the per-vector state stays in registers 
+#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 8)
+#define UNROLL_LANES _Pragma("GCC unroll 8")
+#else
+#define UNROLL_LANES
+#endif
+
+/* Copies channels [first, first + nlanes) of in into lanes, x[j*filter_lanes + l]. Unused lanes are zero. */ 
+static void interleave(size_t n, const double * const * in, size_t first, int nlanes, double * x)
+{
+  const double * c[filter_lanes]; 
+  for (int l = 0; l < filter_lanes; l++) c[l] = l < nlanes ? in[first + l] : 0; 
+
+  // a sample at a time, so x is written in order rather than with a stride for each channel 
+  for (size_t j = 0; j < n; j++) 
+  {
+    for (int l = 0; l < filter_lanes; l++) 
+    {
+      x[j*filter_lanes + l] = c[l] ? c[l][j] : 0; 
+    }
+  }
+}
+
+static void deinterleave(size_t n, const double * y, size_t first, int nlanes, double * const * out)
+{
+  for (size_t j = 0; j < n; j++) 
+  {
+    for (int l = 0; l < nlanes; l++) 
+    {
+      out[first + l][j] = y[j*filter_lanes + l]; 
+    }
+  }
+}
 
 
 
@@ -178,6 +239,67 @@ void FFTtools::DigitalFilter::filterGraph(TGraph * g, bool filterErrors) const
   }
 }
 
+void FFTtools::DigitalFilter::filterOutChannels(size_t nchan, size_t n, const double * const * in, double * const * out, bool steady) const 
+{
+  (void) steady; 
+
+  for (size_t c = 0; c < nchan; c++) 
+  {
+    if (in[c] == out[c]) 
+    {
+      filterReplace(n, out[c]); 
+    }
+    else 
+    {
+      filterOut(n, in[c], out[c]); 
+    }
+  }
+}
+
+void FFTtools::DigitalFilter::filtfilt(size_t n, double * w, int padlen) const 
+{
+  filtfiltChannels(1, n, &w, padlen); 
+}
+
+void FFTtools::DigitalFilter::filtfiltChannels(size_t nchan, size_t n, double * const * w, int padlen) const 
+{
+  if (!n || !nchan) return; 
+
+  size_t pad = padlen < 0 ? edgePadding() : padlen; 
+  if (pad > n-1) pad = n-1; 
+  size_t m = n + 2*pad; 
+
+  // odd extension: reflected about the end values 
+  std::vector<double> ext(nchan * m); 
+  std::vector<double *> chans(nchan); 
+  for (size_t c = 0; c < nchan; c++) 
+  {
+    double * e = &ext[c*m]; 
+    const double * x = w[c]; 
+    for (size_t i = 0; i < pad; i++) 
+    {
+      e[i] = 2*x[0] - x[pad-i]; 
+      e[pad+n+i] = 2*x[n-1] - x[n-2-i]; 
+    }
+    memcpy(e + pad, x, n * sizeof(double)); 
+    chans[c] = e; 
+  }
+
+  const double * const * in = &chans[0]; 
+  filterOutChannels(nchan, m, in, &chans[0], true); 
+  for (size_t c = 0; c < nchan; c++) std::reverse(chans[c], chans[c] + m); 
+  filterOutChannels(nchan, m, in, &chans[0], true); 
+
+  // the middle, reversed back 
+  for (size_t c = 0; c < nchan; c++) 
+  {
+    for (size_t i = 0; i < n; i++) 
+    {
+      w[c][i] = chans[c][m-1-pad-i]; 
+    }
+  }
+}
+
 double * FFTtools::DigitalFilter::filter(size_t n, const double * w) const 
 {
   double * out = new double[n]; 
@@ -186,6 +308,20 @@ double * FFTtools::DigitalFilter::filter(size_t n, const double * w) const
 }
 
 
+size_t FFTtools::DigitalFilter::process(size_t n, const double * w, double * out) 
+{
+  static bool warned = false; 
+  if (!warned) 
+  {
+    std::cerr << "Warning! " << __PRETTY_FUNCTION__ << ": this filter has no streaming state, so each block is filtered on its own" << std::endl; 
+    warned = true; 
+  }
+
+  filterOut(n,w,out); 
+  return n; 
+}
+
+
 std::complex<double> FFTtools::DigitalFilterSeries::transfer(std::complex<double> z) const 
 {
   std::complex<double> answer(1,0); 
@@ -234,7 +370,212 @@ void FFTtools::DigitalFilterSeries::filterOut(size_t n, const double * w, double
 }
 
 
+bool FFTtools::DigitalFilterSeries::canStream(const char * caller) const 
+{
+  for (size_t i = 0; i < series.size(); i++) 
+  {
+    if (!streamable[i]) 
+    {
+      std::cerr << "Warning! " << caller << ": filter " << i << " of the series was added const, so it can't be streamed through" << std::endl; 
+      return false; 
+    }
+  }
+  return true; 
+}
+
+
+size_t FFTtools::DigitalFilterSeries::process(size_t n, const double * w, double * out) 
+{
+  if (!series.size())
+  {
+    memcpy(out,w, n * sizeof(double)); 
+    return n; 
+  }
+
+  if (!canStream(__PRETTY_FUNCTION__)) return 0; 
+
+  // no stage outputs more than it's given, so two blocks' worth is enough 
+  for (int b = 0; b < 2; b++) 
+  {
+    if (stream_buf[b].size() < n+1) stream_buf[b].resize(n+1); 
+  }
+
+  const double * xin = w; 
+  for (size_t i = 0; i < series.size(); i++) 
+  {
+    double * y = i == series.size()-1 ? out : &stream_buf[i % 2][0]; 
+    n = streamable[i]->process(n, xin, y); 
+    xin = y; 
+  }
+
+  return n; 
+}
+
+
+size_t FFTtools::DigitalFilterSeries::flush(double * out) 
+{
+  if (!canStream(__PRETTY_FUNCTION__)) return 0; 
+
+  size_t need = latency(); 
+  for (int b = 0; b < 2; b++) 
+  {
+    if (stream_buf[b].size() < need+1) stream_buf[b].resize(need+1); 
+  }
+
+  // what each stage still has goes through the stages after it, which are flushed after that 
+  size_t total = 0; 
+  for (size_t i = 0; i < series.size(); i++) 
+  {
+    int b = 0; 
+    double * y = i == series.size()-1 ? out + total : &stream_buf[b][0]; 
+    size_t m = streamable[i]->flush(y); 
+
+    for (size_t j = i+1; j < series.size(); j++) 
+    {
+      const double * xin = y; 
+      b = 1-b; 
+      y = j == series.size()-1 ? out + total : &stream_buf[b][0]; 
+      m = streamable[j]->process(m, xin, y); 
+    }
+
+    total += m; 
+  }
+
+  return total; 
+}
+
+
+void FFTtools::DigitalFilterSeries::reset() 
+{
+  // (the ones added const were never streamed through) 
+  for (size_t i = 0; i < series.size(); i++) 
+  {
+    if (streamable[i]) streamable[i]->reset(); 
+  }
+}
+
+
+void FFTtools::DigitalFilterSeries::filterOutChannels(size_t nchan, size_t n, const double * const * in, double * const * out, bool steady) const 
+{
+  if (!series.size())
+  {
+    for (size_t c = 0; c < nchan; c++) 
+    {
+      if (in[c] != out[c]) memcpy(out[c], in[c], n * sizeof(double)); 
+    }
+    return; 
+  }
+
+  // each stage starts in steady state with what the one before it gives, so just chain them (in place after the first) 
+  series[0]->filterOutChannels(nchan, n, in, out, steady); 
+  for (size_t i = 1; i < series.size(); i++) 
+  {
+    series[i]->filterOutChannels(nchan, n, out, out, steady); 
+  }
+}
+
+
+size_t FFTtools::DigitalFilterSeries::edgePadding() const 
+{
+  size_t total = 0; 
+  for (size_t i = 0; i < series.size(); i++) 
+  {
+    total += series[i]->edgePadding(); 
+  }
+  return total; 
+}
+
+
+size_t FFTtools::DigitalFilterSeries::latency() const 
+{
+  size_t total = 0; 
+  for (size_t i = 0; i < series.size(); i++) 
+  {
+    total += series[i]->latency(); 
+  }
+  return total; 
+}
+
+
+
+
+
+const std::complex<double> * FFTtools::FrequencyDomainFilter::frequencyResponse(int L) const
+{
+  const std::complex<double> * answer = 0; 
+
+#ifdef FFTTOOLS_THREAD_SAFE
+  responses_mutex.Lock(); 
+#endif
+#ifdef FFTTOOLS_USE_OMP
+#pragma omp critical (frequency_domain_responses)
+#endif
+  {
+    std::vector<std::complex<double> > & H = responses[L]; 
+    if (!H.size())
+    {
+      H.resize(L/2+1); 
+      for (int i = 0; i < L/2+1; i++) 
+      {
+        H[i] = f->transfer(std::polar(1., 2 * TMath::Pi() * i / L)); 
+      }
+
+      //a real filter is real at Nyquist, but make sure rounding doesn't say otherwise
+      if (L % 2 == 0) H[L/2] = std::real(H[L/2]); 
+    }
+    answer = &H[0]; 
+  }
+#ifdef FFTTOOLS_THREAD_SAFE
+  responses_mutex.UnLock(); 
+#endif
+
+  return answer; 
+}
+
+
+void FFTtools::FrequencyDomainFilter::clearCache() 
+{
+#ifdef FFTTOOLS_THREAD_SAFE
+  responses_mutex.Lock(); 
+#endif
+#ifdef FFTTOOLS_USE_OMP
+#pragma omp critical (frequency_domain_responses)
+#endif
+  responses.clear(); 
+#ifdef FFTTOOLS_THREAD_SAFE
+  responses_mutex.UnLock(); 
+#endif
+}
+
+
+void FFTtools::FrequencyDomainFilter::filterOut(size_t n, const double * x, double * out) const
+{
+  if (!n) return; 
+
+  int L = pad ? nextFastLength(n + pad) : n; 
+  const std::complex<double> * H = frequencyResponse(L); 
+
+  double * block = (double*) fftw_malloc(sizeof(double) * L); 
+  FFTWComplex * spectrum = (FFTWComplex*) fftw_malloc(sizeof(FFTWComplex) * (L/2+1)); 
 
+  memcpy(block, x, sizeof(double) * n); 
+  if (L > (int) n) memset(block + n, 0, sizeof(double) * (L - n)); 
+
+  doFFT(L, block, spectrum); 
+  for (int i = 0; i < L/2+1; i++) 
+  {
+    double re = spectrum[i].re * H[i].real() - spectrum[i].im * H[i].imag(); 
+    double im = spectrum[i].re * H[i].imag() + spectrum[i].im * H[i].real(); 
+    spectrum[i].re = re; 
+    spectrum[i].im = im; 
+  }
+  doInvFFTClobber(L, spectrum, block); 
+
+  memcpy(out, block, sizeof(double) * n); 
+
+  fftw_free(block); 
+  fftw_free(spectrum); 
+}
 
 
 //almost equivalent to matlab poly. (except indices are reversed so that the index matches the order)
@@ -426,12 +767,222 @@ void FFTtools::TransformedZPKFilter::bilinearTransform()
   //Now, get coefficients from poles and zeroes
 
   computeCoeffsFromDigiPoles(digi_gain, n, &digi_zeroes[0], n, &digi_poles[0]); 
+
+  //And the same as second-order sections
+  computeSections(); 
+}
+
+
+/* One or two roots of a second-order section. Complex roots come with their conjugates.  */ 
+struct SectionRoots 
+{
+  SectionRoots(std::complex<double> r1, std::complex<double> r2, int n) : r1(r1), r2(r2), n(n) {; }
+  std::complex<double> r1, r2; 
+  int n; 
+}; 
+
+/* for sorting: a's poles are farther from the unit circle than b's */ 
+static bool lessResonant(const SectionRoots & a, const SectionRoots & b) 
+{
+  return fabs(1 - std::abs(a.r1)) > fabs(1 - std::abs(b.r1)); 
+}
+
+static std::vector<SectionRoots> pairRoots(const std::vector<std::complex<double> > & roots) 
+{
+  std::vector<SectionRoots> pairs; 
+  std::vector<double> reals; 
+
+  for (size_t i = 0; i < roots.size(); i++) 
+  {
+    if (fabs(roots[i].imag()) <= 1e-10 * std::max(1., std::abs(roots[i]))) 
+    {
+      reals.push_back(roots[i].real()); 
+    }
+    else if (roots[i].imag() > 0) 
+    {
+      pairs.push_back(SectionRoots(roots[i], std::conj(roots[i]),2)); 
+    }
+  }
+
+  std::sort(reals.begin(), reals.end()); 
+  for (size_t i = 0; i+1 < reals.size(); i+=2) 
+  {
+    pairs.push_back(SectionRoots(reals[i], reals[i+1],2)); 
+  }
+  if (reals.size() % 2) 
+  {
+    pairs.push_back(SectionRoots(reals.back(), 0, 1)); 
+  }
+
+  return pairs; 
+}
+
+static void sectionPolynomial(const SectionRoots & r, double * c) 
+{
+  c[0] = r.n == 2 ? -std::real(r.r1 + r.r2) : -r.r1.real(); 
+  c[1] = r.n == 2 ? std::real(r.r1 * r.r2) : 0; 
+}
+
+void FFTtools::TransformedZPKFilter::computeSections() 
+{
+  std::vector<SectionRoots> pole_pairs = pairRoots(digi_poles); 
+  std::vector<SectionRoots> zero_pairs = pairRoots(digi_zeroes); 
+
+  // the least resonant sections first, each with the zeroes nearest its poles 
+  std::sort(pole_pairs.begin(), pole_pairs.end(), lessResonant); 
+
+  size_t nsec = std::max(std::max(pole_pairs.size(), zero_pairs.size()), size_t(1)); 
+  sections.assign(5*nsec, 0); 
+  section_state.clear(); 
+
+  for (size_t s = 0; s < nsec; s++) 
+  {
+    double * c = &sections[5*s]; 
+    c[0] = 1; 
+
+    if (s < pole_pairs.size()) 
+    {
+      sectionPolynomial(pole_pairs[s], c + 3); 
+
+      if (zero_pairs.size()) 
+      {
+        size_t best = 0; 
+        for (size_t z = 1; z < zero_pairs.size(); z++) 
+        {
+          if (std::abs(zero_pairs[z].r1 - pole_pairs[s].r1) < std::abs(zero_pairs[best].r1 - pole_pairs[s].r1)) best = z; 
+        }
+        sectionPolynomial(zero_pairs[best], c + 1); 
+        zero_pairs.erase(zero_pairs.begin() + best); 
+      }
+    }
+    else if (zero_pairs.size()) 
+    {
+      sectionPolynomial(zero_pairs[0], c + 1); 
+      zero_pairs.erase(zero_pairs.begin()); 
+    }
+  }
+
+  // the gain goes in the first section 
+  double g = std::real(digi_gain); 
+  for (int i = 0; i < 3; i++) sections[i] *= g; 
+}
+
+
+const std::complex<double> * FFTtools::FIRFilter::tapSpectrum(int L) const
+{
+  const std::complex<double> * answer = 0; 
+
+#ifdef FFTTOOLS_THREAD_SAFE
+  tap_spectra_mutex.Lock(); 
+#endif
+#ifdef FFTTOOLS_USE_OMP
+#pragma omp critical (fir_tap_spectra)
+#endif
+  {
+    std::vector<std::complex<double> > & H = tap_spectra[L]; 
+    if (!H.size())
+    {
+      double * h = (double*) fftw_malloc(sizeof(double) * L); 
+      FFTWComplex * Hf = (FFTWComplex*) fftw_malloc(sizeof(FFTWComplex) * (L/2+1)); 
+      memset(h, 0, sizeof(double) * L); 
+      memcpy(h, &coeffs[0], sizeof(double) * coeffs.size()); 
+      doFFT(L, h, Hf); 
+
+      //conjugate, since directConvolve really correlates with the taps
+      H.resize(L/2+1); 
+      for (int i = 0; i < L/2+1; i++) 
+      {
+        H[i] = std::complex<double>(Hf[i].re, -Hf[i].im); 
+      }
+      fftw_free(h); 
+      fftw_free(Hf); 
+    }
+    answer = &H[0]; 
+  }
+#ifdef FFTTOOLS_THREAD_SAFE
+  tap_spectra_mutex.UnLock(); 
+#endif
+
+  return answer; 
+}
+
+
+int FFTtools::FIRFilter::blockLength() const
+{
+  // blocks long enough that most of each is output
+  int M = coeffs.size(); 
+  return nextFastLength(std::max(8*M, 64)); 
+}
+
+
+FFTtools::FIRFilter::Method FFTtools::FIRFilter::chosenMethod() const
+{
+  if (method != AUTO) return method; 
+
+  // direct is one multiply-add per tap per sample, vs. two transforms and a product per block of step samples. 
+  // This doesn't depend on the record, so process convolves the same way filterOut does. 
+  int M = coeffs.size(); 
+  int L = blockLength(); 
+  int step = L - M + 1; 
+  double direct_cost = M; 
+  double fft_cost = (5. * L * TMath::Log2(L) + 4. * L) / step; 
+  return direct_cost > fft_cost ? OVERLAP_SAVE : DIRECT; 
+}
+
+
+void FFTtools::FIRFilter::convolveBlock(int L, double * block, FFTWComplex * spectrum) const
+{
+  const std::complex<double> * H = tapSpectrum(L); 
+  doFFT(L, block, spectrum); 
+  for (int i = 0; i < L/2+1; i++) 
+  {
+    double re = spectrum[i].re * H[i].real() - spectrum[i].im * H[i].imag(); 
+    double im = spectrum[i].re * H[i].imag() + spectrum[i].im * H[i].real(); 
+    spectrum[i].re = re; 
+    spectrum[i].im = im; 
+  }
+  doInvFFTClobber(L, spectrum, block); 
 }
 
 
 void FFTtools::FIRFilter::filterOut(size_t n, const double* x, double * out) const
 {
-  directConvolve(n,x,coeffs.size(), &coeffs[0], out, delay, extend ? REPEAT_OUTSIDE : ZEROES_OUTSIDE); 
+  if (chosenMethod() == DIRECT) 
+  {
+    directConvolve(n,x,coeffs.size(), &coeffs[0], out, delay, extend ? REPEAT_OUTSIDE : ZEROES_OUTSIDE); 
+    return; 
+  }
+
+  // Same as directConvolve: out[i] = sum_k coeffs[k] * x[i + k + offset], with x extended past its ends 
+  int M = coeffs.size(); 
+  int N = n; 
+  int L = blockLength(); 
+  int step = L - M + 1; 
+  int offset = delay - M/2; 
+  double start_val = extend ? x[0] : 0; 
+  double end_val = extend ? x[N-1] : 0; 
+
+  double * block = (double*) fftw_malloc(sizeof(double) * L); 
+  FFTWComplex * spectrum = (FFTWComplex*) fftw_malloc(sizeof(FFTWComplex) * (L/2+1)); 
+
+  for (int first = 0; first < N; first += step) 
+  {
+    // block[t] = x[first + offset + t], copying what's inside and filling the rest
+    int x0 = first + offset; 
+    int inside_start = std::max(0, -x0); 
+    int inside_end = std::min(L, N - x0); 
+    for (int t = 0; t < std::min(inside_start, L); t++) block[t] = start_val; 
+    if (inside_end > inside_start) memcpy(block + inside_start, x + x0 + inside_start, sizeof(double) * (inside_end - inside_start)); 
+    for (int t = std::max(inside_end, inside_start); t < L; t++) block[t] = end_val; 
+
+    convolveBlock(L, block, spectrum); 
+
+    // only the first step outputs didn't wrap around
+    memcpy(out + first, block, sizeof(double) * std::min(step, N - first)); 
+  }
+
+  fftw_free(block); 
+  fftw_free(spectrum); 
 }
 
 
@@ -471,19 +1022,184 @@ static void computeSavitzkyGolayCoefficients(double *x, int m, int nl, int nr, i
 
 
 FFTtools::SavitzkyGolayFilter::SavitzkyGolayFilter(int polynomial_order, int wleft, int wright, int deriv) 
-  : FIRFilter(wright < 0 ? 2*wleft + 1 : wleft +wright +1, wright < 0 ? 0 : wright- wleft,true)
+  : FIRFilter(wright < 0 ? 2*wleft + 1 : wleft +wright +1, wright < 0 ? 0 : (wleft+wright+1)/2 - wleft,true)
 {
   if (wright < 0) wright = wleft; 
   computeSavitzkyGolayCoefficients(&coeffs[0], polynomial_order, wleft, wright, deriv); 
 }
 
 
+double FFTtools::FIRFilter::streamSample(long i, double end_val) const 
+{
+  int M = coeffs.size(); 
+  long offset = delay - M/2; 
+
+  // the same sum, in the same order, as directConvolve 
+  double sum = 0; 
+  for (int k = 0; k < M; k++) 
+  {
+    long j = i + offset + k; 
+    double X = j < 0 ? stream_start_val : j >= stream_in ? end_val : stream_x[j - stream_first]; 
+    sum += X * coeffs[k]; 
+  }
+  return sum; 
+}
+
+
+/* n doubles inside v (which only ever grows), aligned like fftw_malloc, so the
+ * aligned doFFT can use them. Unlike a fftw_malloc'd pointer, v can be copied
+ * along with the filter. */
+static double * alignedScratch(std::vector<double> & v, size_t n) 
+{
+  const size_t align = 64; 
+  if (v.size() < n + align / sizeof(double)) v.resize(n + align / sizeof(double)); 
+  size_t misalign = ((size_t) &v[0]) % align; 
+  return &v[0] + (misalign ? (align - misalign) / sizeof(double) : 0); 
+}
+
+
+void FFTtools::FIRFilter::streamBlocks(long last, double end_val) 
+{
+  int M = coeffs.size(); 
+  long offset = delay - M/2; 
+  int L = blockLength(); 
+  int step = L - M + 1; 
+
+  double * block = alignedScratch(stream_block, L); 
+  FFTWComplex * spectrum = (FFTWComplex*) alignedScratch(stream_spectrum, 2 * (L/2+1)); 
+
+  // the same blocks, starting at the same outputs, as filterOut 
+  for (; stream_out < last; stream_out += step) 
+  {
+    for (int t = 0; t < L; t++) 
+    {
+      long j = stream_out + offset + t; 
+      block[t] = j < 0 ? stream_start_val : j >= stream_in ? end_val : stream_x[j - stream_first]; 
+    }
+
+    convolveBlock(L, block, spectrum); 
+    stream_y.insert(stream_y.end(), block, block + std::min<long>(step, stream_in - stream_out)); 
+  }
+}
+
+
+size_t FFTtools::FIRFilter::process(size_t n, const double * x, double * out) 
+{
+  if (!n) return 0; 
+
+  int M = coeffs.size(); 
+  long offset = delay - M/2; 
+
+  if (!stream_in) 
+  {
+    stream_x.clear(); 
+    stream_y.clear(); 
+    stream_y_read = 0; 
+    stream_first = 0; 
+    stream_start_val = extend ? x[0] : 0; 
+  }
+
+  stream_x.insert(stream_x.end(), x, x + n); 
+  stream_in += n; 
+
+  size_t nout = 0; 
+  if (chosenMethod() == DIRECT) 
+  {
+    // output i needs the inputs up to i + offset + M - 1 
+    long ready = std::min(stream_in, stream_in - offset - M + 1); 
+    for (; stream_out < ready; stream_out++) 
+    {
+      out[nout++] = streamSample(stream_out, 0); 
+    }
+  }
+  else
+  {
+    // the block starting at output i needs the inputs up to i + offset + L - 1, and gives step outputs 
+    int L = blockLength(); 
+    int step = L - M + 1; 
+    long need = std::max<long>(step, offset + L); 
+    if (stream_out + need <= stream_in) streamBlocks(stream_in - need + 1, 0); 
+
+    // hand out at most n, so out only needs room for n 
+    nout = std::min(n, stream_y.size() - stream_y_read); 
+    if (nout) memcpy(out, &stream_y[stream_y_read], nout * sizeof(double)); 
+    stream_y_read += nout; 
+
+    // move what's left to the front once it's all that's left, or once most of stream_y has been read 
+    if (stream_y_read == stream_y.size()) 
+    {
+      stream_y.clear(); 
+      stream_y_read = 0; 
+    }
+    else if (stream_y_read > stream_y.size() / 2) 
+    {
+      stream_y.erase(stream_y.begin(), stream_y.begin() + stream_y_read); 
+      stream_y_read = 0; 
+    }
+  }
+
+  // forget the inputs no later output needs (but keep the last one, for extending past the end). 
+  // Shifting them down costs as much as what's kept, so only do it once that's less than what's dropped 
+  long keep = std::min(stream_out + offset, stream_in - 1); 
+  if (keep > stream_first && keep - stream_first >= stream_in - keep) 
+  {
+    stream_x.erase(stream_x.begin(), stream_x.begin() + (keep - stream_first)); 
+    stream_first = keep; 
+  }
+
+  return nout; 
+}
+
+
+size_t FFTtools::FIRFilter::flush(double * out) 
+{
+  size_t nout = 0; 
+  if (stream_in) 
+  {
+    double end_val = extend ? stream_x.back() : 0; 
+    if (chosenMethod() == DIRECT) 
+    {
+      for (; stream_out < stream_in; stream_out++) 
+      {
+        out[nout++] = streamSample(stream_out, end_val); 
+      }
+    }
+    else
+    {
+      streamBlocks(stream_in, end_val); 
+      nout = stream_y.size() - stream_y_read; 
+      if (nout) memcpy(out, &stream_y[stream_y_read], nout * sizeof(double)); 
+    }
+  }
+
+  reset(); 
+  return nout; 
+}
+
+
+size_t FFTtools::FIRFilter::latency() const
+{
+  int M = coeffs.size(); 
+  int offset = delay - M/2; 
+
+  // the last input the first output (of a block, for OVERLAP_SAVE) needs 
+  int last = offset + M - 1; 
+  if (chosenMethod() == OVERLAP_SAVE) 
+  {
+    int L = blockLength(); 
+    last = std::max(offset + L, L - M + 1) - 1; 
+  }
+  return last > 0 ? last : 0; 
+}
+
+
 std::complex<double> FFTtools::FIRFilter::transfer(std::complex<double> z) const
 {
+  // out[j] = sum_i coeffs[i] * x[j + i + delay - size/2] 
   std::complex<double> ans = 0; 
   for( size_t i = 0; i < coeffs.size(); i++) 
   {
-    int exp = int(coeffs.size()/2) - int(i) - delay; 
+    int exp = int(i) + delay - int(coeffs.size()/2); 
     ans += pow(z,exp) * coeffs[i]; 
   }
 
@@ -530,29 +1246,364 @@ static void doIIRFilter(int n, const double * x, double * y, int na, const doubl
 }
 
 
+/* doIIRFilter on interleaved channels, with each lane computed in the same order. 
+ * If x0 and y0 are given, they're the (constant) inputs and outputs before the start, otherwise those are zero. */ 
+template <typename V> 
+static LANES_INLINE void iirLanes(int n, const double * x, double * y, int na, const double * A, int nb, const double * B, const double * x0, const double * y0)
+{
+  const int w = sizeof(V) / sizeof(double); 
+  const int nv = filter_lanes / w; 
+  int nc = TMath::Max(na,nb); 
+  V v, yj[nv]; 
+  for (int j = 0; j < n; j++) 
+  {
+      double a0 =A[0];
+      UNROLL_LANES
+      for (int h = 0; h < nv; h++) yj[h] = V(); 
+
+      for (int k = 0; k < nc; k++) 
+      {
+        if (j - k < 0 && !x0) break; 
+
+        if (k < nb)
+        {
+          const double * xk = j - k >= 0 ? x + (j-k)*filter_lanes : x0; 
+          UNROLL_LANES
+          for (int h = 0; h < nv; h++) 
+          {
+            memcpy(&v, xk + h*w, sizeof(v)); 
+            yj[h] += v * B[k] ; 
+          }
+        }
+
+        if (k > 0 && k < na) 
+        {
+          const double * yk = j - k >= 0 ? y + (j-k)*filter_lanes : y0; 
+          UNROLL_LANES
+          for (int h = 0; h < nv; h++) 
+          {
+            memcpy(&v, yk + h*w, sizeof(v)); 
+            yj[h] -= v *A[k]; 
+          }
+        }
+      }
+
+      UNROLL_LANES
+      for (int h = 0; h < nv; h++) 
+      {
+        yj[h] /= a0;
+        memcpy(y + j*filter_lanes + h*w, &yj[h], sizeof(v)); 
+      }
+  }
+}
+
+#ifdef FFTTOOLS_SIMD_DISPATCH
+__attribute__((target("avx512f")))
+static void iirLanesAVX512(int n, const double * x, double * y, int na, const double * A, int nb, const double * B, const double * x0, const double * y0)
+{
+  iirLanes<Lanes64>(n, x, y, na, A, nb, B, x0, y0); 
+}
+
+__attribute__((target("avx2")))
+static void iirLanesAVX2(int n, const double * x, double * y, int na, const double * A, int nb, const double * B, const double * x0, const double * y0)
+{
+  iirLanes<Lanes32>(n, x, y, na, A, nb, B, x0, y0); 
+}
+#endif
+
+static void doIIRFilterLanes(int n, const double * x, double * y, int na, const double * A, int nb, const double * B, const double * x0 = 0, const double * y0 = 0)
+{
+#ifdef FFTTOOLS_SIMD_DISPATCH
+  switch (FFTtools::simdWidth())
+  {
+    case 64: iirLanesAVX512(n, x, y, na, A, nb, B, x0, y0); break; 
+    case 32: iirLanesAVX2(n, x, y, na, A, nb, B, x0, y0); break; 
+    default: iirLanes<Lanes16>(n, x, y, na, A, nb, B, x0, y0); 
+  }
+#else
+  iirLanes<double>(n, x, y, na, A, nb, B, x0, y0); 
+#endif
+}
+
+
 void FFTtools::IIRFilter::filterOut(size_t n, const double* x, double * out) const
 {
   doIIRFilter(n, x, out, acoeffs.size(), &acoeffs[0],bcoeffs.size(), &bcoeffs[0]); 
 }
 
+size_t FFTtools::IIRFilter::process(size_t n, const double * x, double * y) 
+{
+  int na = acoeffs.size(); 
+  int nb = bcoeffs.size(); 
+  int nc = TMath::Max(na,nb); 
+  const double * A = &acoeffs[0]; 
+  const double * B = &bcoeffs[0]; 
+
+  if (!stream_n) 
+  {
+    stream_x.assign(nc, 0); 
+    stream_y.assign(nc, 0); 
+  }
+
+  // exactly as doIIRFilter, except that samples before this block come from the history 
+  for (int j = 0; j < (int) n; j++) 
+  {
+      double a0 =A[0];
+      y[j] = 0; 
+      for (int k = 0; k < nc; k++) 
+      {
+        if (stream_n + j - k < 0) break; 
+
+        if (k < nb)
+        {
+          y[j] += (k <= j ? x[j-k] : stream_x[k-j-1]) * B[k] ; 
+        }
+
+        if (k > 0 && k < na) 
+        {
+          y[j] -= (k <= j ? y[j-k] : stream_y[k-j-1]) *A[k]; 
+        }
+      }
+      y[j] /= a0;
+  }
+
+  // shift the history (most recent first). Going backwards, nothing is overwritten before it's read 
+  for (int m = nc-1; m >= 0; m--) 
+  {
+    stream_x[m] = m < (int) n ? x[n-1-m] : stream_x[m-n]; 
+    stream_y[m] = m < (int) n ? y[n-1-m] : stream_y[m-n]; 
+  }
+
+  stream_n += n; 
+  return n; 
+}
+
+
+/* A cascade of second-order sections (transposed direct form II). state has two per section. Works in place. */ 
+static void doSOSFilter(int n, const double * x, double * y, int nsec, const double * sos, double * state)
+{
+  for (int j = 0; j < n; j++) 
+  {
+    double v = x[j]; 
+    for (int s = 0; s < nsec; s++) 
+    {
+      const double * c = sos + 5*s; 
+      double * z = state + 2*s; 
+      double out = c[0] * v + z[0]; 
+      z[0] = c[1] * v - c[3] * out + z[1]; 
+      z[1] = c[2] * v - c[4] * out; 
+      v = out; 
+    }
+    y[j] = v; 
+  }
+}
+
+
+void FFTtools::IIRFilter::filterOutChannels(size_t nchan, size_t n, const double * const * in, double * const * out, bool steady) const
+{
+  if (!n || !nchan) return; 
+
+  std::vector<double> x(n * filter_lanes); 
+  std::vector<double> y(n * filter_lanes); 
+
+  // in steady state, the output is the input times the DC gain 
+  double sum_a = 0, sum_b = 0; 
+  for (size_t i = 0; i < acoeffs.size(); i++) sum_a += acoeffs[i]; 
+  for (size_t i = 0; i < bcoeffs.size(); i++) sum_b += bcoeffs[i]; 
+  double dc_gain = sum_a ? sum_b / sum_a : 0; 
+  double y0[filter_lanes]; 
+
+  for (size_t first = 0; first < nchan; first += filter_lanes) 
+  {
+    int nlanes = nchan - first < (size_t) filter_lanes ? nchan - first : filter_lanes; 
+    interleave(n, in, first, nlanes, &x[0]); 
+    for (int l = 0; l < filter_lanes; l++) y0[l] = x[l] * dc_gain; 
+    doIIRFilterLanes(n, &x[0], &y[0], acoeffs.size(), &acoeffs[0], bcoeffs.size(), &bcoeffs[0], steady ? &x[0] : 0, steady ? y0 : 0); 
+    deinterleave(n, &y[0], first, nlanes, out); 
+  }
+}
+
+
 std::complex<double> FFTtools::IIRFilter::transfer(std::complex<double> z) const
 {
   std::complex<double> num = bcoeffs[0]; 
   for( size_t i = 1; i < bcoeffs.size(); i++) 
   {
-    num += pow(z,-i) * bcoeffs[i]; 
+    num += pow(z,-int(i)) * bcoeffs[i]; 
   }
 
   std::complex<double> denom = acoeffs[0]; 
   for( size_t i = 1; i < acoeffs.size(); i++) 
   {
-    denom += pow(z,-i) * acoeffs[i]; 
+    denom += pow(z,-int(i)) * acoeffs[i]; 
   }
 
   return num/denom; 
 }
 
 
+/* doSOSFilter on interleaved channels (state is interleaved too). Works in place. 
+ * This goes through the whole record one section at a time, which is the same
+ * arithmetic, but keeps each section's state in registers. */ 
+template <typename V> 
+static LANES_INLINE void sosLanes(int n, const double * x, double * y, int nsec, const double * sos, double * state)
+{
+  const int w = sizeof(V) / sizeof(double); 
+  const int nv = filter_lanes / w; 
+  V v, z0[nv], z1[nv]; 
+  for (int s = 0; s < nsec; s++) 
+  {
+    const double * c = sos + 5*s; 
+    double * z = state + 2*s*filter_lanes; 
+    const double * in = s ? y : x; 
+
+    UNROLL_LANES
+    for (int h = 0; h < nv; h++) 
+    {
+      memcpy(&z0[h], z + h*w, sizeof(v)); 
+      memcpy(&z1[h], z + filter_lanes + h*w, sizeof(v)); 
+    }
+
+    for (int j = 0; j < n; j++) 
+    {
+      UNROLL_LANES
+      for (int h = 0; h < nv; h++) 
+      {
+        memcpy(&v, in + j*filter_lanes + h*w, sizeof(v)); 
+        V out = v * c[0] + z0[h]; 
+        z0[h] = v * c[1] - out * c[3] + z1[h]; 
+        z1[h] = v * c[2] - out * c[4]; 
+        memcpy(y + j*filter_lanes + h*w, &out, sizeof(v)); 
+      }
+    }
+
+    UNROLL_LANES
+    for (int h = 0; h < nv; h++) 
+    {
+      memcpy(z + h*w, &z0[h], sizeof(v)); 
+      memcpy(z + filter_lanes + h*w, &z1[h], sizeof(v)); 
+    }
+  }
+}
+
+#ifdef FFTTOOLS_SIMD_DISPATCH
+__attribute__((target("avx512f")))
+static void sosLanesAVX512(int n, const double * x, double * y, int nsec, const double * sos, double * state)
+{
+  sosLanes<Lanes64>(n, x, y, nsec, sos, state); 
+}
+
+__attribute__((target("avx2")))
+static void sosLanesAVX2(int n, const double * x, double * y, int nsec, const double * sos, double * state)
+{
+  sosLanes<Lanes32>(n, x, y, nsec, sos, state); 
+}
+#endif
+
+static void doSOSFilterLanes(int n, const double * x, double * y, int nsec, const double * sos, double * state)
+{
+#ifdef FFTTOOLS_SIMD_DISPATCH
+  switch (FFTtools::simdWidth())
+  {
+    case 64: sosLanesAVX512(n, x, y, nsec, sos, state); break; 
+    case 32: sosLanesAVX2(n, x, y, nsec, sos, state); break; 
+    default: sosLanes<Lanes16>(n, x, y, nsec, sos, state); 
+  }
+#else
+  sosLanes<double>(n, x, y, nsec, sos, state); 
+#endif
+}
+
+
+void FFTtools::TransformedZPKFilter::filterOut(size_t n, const double* x, double * out) const
+{
+  if (method == DIRECT_FORM) 
+  {
+    IIRFilter::filterOut(n,x,out); 
+    return; 
+  }
+
+  std::vector<double> state(2*nSections(),0); 
+  doSOSFilter(n, x, out, nSections(), &sections[0], &state[0]); 
+}
+
+size_t FFTtools::TransformedZPKFilter::process(size_t n, const double* x, double * out) 
+{
+  if (method == DIRECT_FORM) 
+  {
+    return IIRFilter::process(n,x,out); 
+  }
+
+  if (section_state.size() != 2*nSections()) section_state.assign(2*nSections(),0); 
+  doSOSFilter(n, x, out, nSections(), &sections[0], &section_state[0]); 
+  return n; 
+}
+
+/* The (interleaved) section states of a cascade that has only ever seen the inputs x0 */ 
+static void sosSteadyState(int nsec, const double * sos, const double * x0, double * state) 
+{
+  for (int l = 0; l < filter_lanes; l++) 
+  {
+    double v = x0[l]; 
+    for (int s = 0; s < nsec; s++) 
+    {
+      const double * c = sos + 5*s; 
+      double out = v * (c[0] + c[1] + c[2]) / (1 + c[3] + c[4]); 
+      state[2*s*filter_lanes + l] = out - c[0] * v; 
+      state[(2*s+1)*filter_lanes + l] = c[2] * v - c[4] * out; 
+      v = out; 
+    }
+  }
+}
+
+void FFTtools::TransformedZPKFilter::filterOutChannels(size_t nchan, size_t n, const double * const * in, double * const * out, bool steady) const
+{
+  if (method == DIRECT_FORM) 
+  {
+    IIRFilter::filterOutChannels(nchan,n,in,out,steady); 
+    return; 
+  }
+
+  if (!n || !nchan) return; 
+
+  std::vector<double> x(n * filter_lanes); 
+  std::vector<double> state(2 * nSections() * filter_lanes); 
+
+  for (size_t first = 0; first < nchan; first += filter_lanes) 
+  {
+    int nlanes = nchan - first < (size_t) filter_lanes ? nchan - first : filter_lanes; 
+    interleave(n, in, first, nlanes, &x[0]); 
+    if (steady) sosSteadyState(nSections(), &sections[0], &x[0], &state[0]); 
+    else std::fill(state.begin(), state.end(), 0.); 
+    doSOSFilterLanes(n, &x[0], &x[0], nSections(), &sections[0], &state[0]); 
+    deinterleave(n, &x[0], first, nlanes, out); 
+  }
+}
+
+void FFTtools::TransformedZPKFilter::reset() 
+{
+  IIRFilter::reset(); 
+  section_state.assign(2*nSections(),0); 
+}
+
+std::complex<double> FFTtools::TransformedZPKFilter::transfer(std::complex<double> z) const
+{
+  if (method == DIRECT_FORM) 
+  {
+    return IIRFilter::transfer(z); 
+  }
+
+  std::complex<double> zinv = 1./z; 
+  std::complex<double> answer(1,0); 
+  for (size_t s = 0; s < nSections(); s++) 
+  {
+    const double * c = &sections[5*s]; 
+    answer *= (c[0] + zinv * (c[1] + zinv * c[2])) / (1. + zinv * (c[3] + zinv * c[4])); 
+  }
+  return answer; 
+}
+
+
 FFTtools::RCFilter::RCFilter(FilterTopology type, double w, double dw)
 {
   order = 1; 
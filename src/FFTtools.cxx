@@ -1,4 +1,5 @@
 #include "FFTtools.h"
+#include "Workspace.h"
 
 #include <fftw3.h>
 #include "FFTWindow.h"
@@ -6,6 +7,9 @@
 #include <assert.h>
 #include "TF1.h" 
 #include <algorithm>
+#include <climits>
+#include <set>
+#include <time.h>
 
 #ifndef __APPLE__
 #define SINCOS sincos 
@@ -137,396 +141,1561 @@ TGraph *FFTtools::getInterpolatedGraphFreqDom(TGraph *grIn, Double_t deltaT)
  *   a while, and while FFTW3 will "remember" plans it already figured out, its
  *   hash function for storing them is needlesly slow (it does an md5sum of
  *   some properties of the transform, which is slow, partially, at least on
- *   Linux, because glibc sincos is so slow... but I digress)  
+ *   Linux, because glibc sincos is so slow... but I digress)
  *
  *   So the solution here is to use a std::map to store the FFtW3 goodies. This
- *   will use a tree structure, ensuring O(logN) lookup. 
+ *   will use a tree structure, ensuring O(logN) lookup.
  *
  *   But because arrays you pass are not necessarily going to be aligned
  *   properly for SIMD, we allocate memory here and will copy data in and out
  *   of the arrays. This might seem like it's slower, and it might be in some
- *   cases, but this is what we do. 
+ *   cases, but this is what we do.
  *
  *   If FFTTOOLS_ALLOCATE_CONTIGUOUS is true, the input and output arrays will
  *   be (almost) contiguous, which theoretically might improve cache locality,
- *   but I haven't done any rigorous profiling. 
+ *   but I haven't done any rigorous profiling.
  *
- *   Finally, you might notice a bunch of threading-related crap littering the
- *   code.  This is because the FFTW3 planning and the static arrays are not
- *   thread-safe.  There are two threading models implemented, both
- *   experimental until such time as someone decides they're not (and
- *   therefore, neither enabled by default). 
+ *   There are two levels of caching:
+ *
+ *    - cached_plans is shared by everybody and holds the forward and backward
+ *      plans for each length. FFTW3 planning is not thread-safe, so this is
+ *      only ever touched while holding the planner lock. Executing a plan is
+ *      thread-safe, so once a plan exists anybody may use it.
  *
- *   The current strategy for thread safety is to lock the planning stage and
- *   then allocate different arrays for each thread. The FFT's are then
- *   executed using the new-array variants of  fft_execute. It would be nice to
- *   just use TSD for this and just be able to mark the maps as thread_local,
- *   but that is not well implemented enough in compilers yet (afaik?) and I'm
- *   not sure if it works with OpenMP or not (but maybe it does?). 
+ *    - thread_cache holds, for each thread, a copy of the plan pointers and
+ *      the scratch arrays for each length that thread has seen. Only the
+ *      owning thread ever looks at it, so in the steady state (i.e. once a
+ *      thread has seen a length once) no lock is ever taken. FFTs are
+ *      executed using the new-array variants of fftw_execute with the
+ *      per-thread arrays.
  *
+ *   Finally, you might notice a bunch of threading-related crap littering the
+ *   code. There are two threading models implemented, both experimental until
+ *   such time as someone decides they're not (and therefore, neither enabled
+ *   by default). They only differ in which lock protects the planner.
  *
  *   FFTTOOLS_THREAD_SAFE adds the necessary machinery to use ROOT's built-in
  *   threading facilities (i.e. pthreads on Unix, and the Windows thread
  *   thingie on on Windows).
  *
- *   FFTTOOLS_USE_OMP uses the OpenMP macros, which are somewhat easier to use. 
+ *   FFTTOOLS_USE_OMP uses the OpenMP locks, which are somewhat easier to use.
  *
  *   Trying to use both will crash and burn. don't
  *
+ *   How hard the planner tries is set by setPlanRigor (FFTW_MEASURE by
+ *   default, or FFTW_PATIENT if FFTW_USE_PATIENT is defined). warmPlans can
+ *   be used to fill cached_plans up front so that nothing is planned while
+ *   doing real work.
+ *
+ *   Left alone, both levels grow with every new length seen. Each plan in the
+ *   shared tables counts how many thread caches use it, so plans nobody uses
+ *   can be destroyed, and thread caches can evict their least recently used
+ *   lengths (see setFFTCacheLimits and releaseCaches).
  *
- *   There is one fairly big drawback to the way things are done; the per-thread arrys
- *   are never deleted. As long as you reuse threads instead of spawning countless
- *   numbers of them, this should be ok. In the future, maybe I'll properly use 
- *   thread_local and shit to make it work, but I don't feel like it's right to make
- *   people use a C++11 compiler until at least when people stop using Fortran77 
+ *   Each thread also keeps counters for each length it has seen (how often it
+ *   transformed it, and optionally for how long) in thread_stats. These are
+ *   only ever written by the owning thread; getFFTStats collects them all.
+ *
+ *   In either threaded mode, thread_cache is thread_local, so the per-thread
+ *   arrays are freed when the thread exits. This means that a C++11 compiler
+ *   is needed for the threaded modes (which ROOT 6 requires anyway).
+ *
+ *   Separately from all of that, if FFTTOOLS_FFTW_THREADS is defined (and
+ *   we link against fftw3_threads), setFFTWThreads makes very long
+ *   transforms use FFTW's own threads. Those plans live in
+ *   cached_threaded_plans, keyed by length and thread count, so changing the
+ *   thread count never throws a plan away. Since the thread count can change
+ *   after a thread has cached a plan, each cache entry remembers which
+ *   threads_generation it was made in and is refreshed if that is stale.
  *
  *******************************************************************************/
 
 
-/** This caches both forward and backwards plans **/
-static std::map<int, std::pair<fftw_plan, fftw_plan> > cached_plans; //this caches both plans for a given length
-
-
-/* error if you try to compile with both */ 
+/* error if you try to compile with both */
 #ifdef FFTTOOLS_THREAD_SAFE
 #ifdef FFTTOOLS_USE_OMP
- Sorry, you cannot compile using both FFTTOOLS_THREAD_SAFE and FFTTOOLS_USE_OMP. 
-#endif 
+ Sorry, you cannot compile using both FFTTOOLS_THREAD_SAFE and FFTTOOLS_USE_OMP.
+#endif
 #endif
 
 
 /** ROOT thread stuff **/
 #ifdef FFTTOOLS_THREAD_SAFE
 #define USE_PER_THREAD_MEMORY
-#include "TMutex.h" 
-#include "TThread.h" 
-static TMutex plan_mutex; 
-#define GET_TID() TThread::SelfId()
-#endif 
+#include "TMutex.h"
+static TMutex plan_mutex;
+#endif
 
 
-/** OpenMP stuff **/ 
+/** OpenMP stuff **/
 #ifdef FFTTOOLS_USE_OMP
 #define USE_PER_THREAD_MEMORY
 #include "omp.h"
-#define GET_TID() omp_get_thread_num() 
+static struct OmpPlanLock
+{
+  OmpPlanLock() { omp_init_lock(&lock); }
+  ~OmpPlanLock() { omp_destroy_lock(&lock); }
+  omp_lock_t lock;
+} omp_plan_lock;
 #endif
 
 
-#ifdef  USE_PER_THREAD_MEMORY
-/*define memory for each thread, this will use the thread-id as an index 
- *
- *  For OMP, the thread numbers increase sequentially, so I use a vector to 
- *  increase lookup speed. For pthreads, the thread number is an opaque handle,
- *  so I use a map instead 
- * */
+#ifdef USE_PER_THREAD_MEMORY
+#if __cplusplus < 201103L
+#error "FFTTOOLS_THREAD_SAFE and FFTTOOLS_USE_OMP need a C++11 compiler (for thread_local)"
+#endif
+#include <atomic>
+#define FFTTOOLS_THREAD_LOCAL thread_local
+#define FFTTOOLS_SETTING(T) std::atomic<T>  // for settings that may be changed while other threads are using them
+#else
+#define FFTTOOLS_THREAD_LOCAL
+#define FFTTOOLS_SETTING(T) T
+#endif
 
+
+/** Scoped lock around the FFTW3 planner and the shared plan table. Does nothing if not built thread-safe. */
+class PlannerLock
+{
+  public:
+    PlannerLock()
+    {
+#ifdef FFTTOOLS_THREAD_SAFE
+      plan_mutex.Lock();
+#endif
+#ifdef FFTTOOLS_USE_OMP
+      omp_set_lock(&omp_plan_lock.lock);
+#endif
+    }
+
+    ~PlannerLock()
+    {
+#ifdef FFTTOOLS_THREAD_SAFE
+      plan_mutex.UnLock();
+#endif
 #ifdef FFTTOOLS_USE_OMP
-static  std::map<int, std::vector<double *> > cached_xs;
-static  std::map<int, std::vector<fftw_complex *> > cached_Xs; 
+      omp_unset_lock(&omp_plan_lock.lock);
+#endif
+    }
+};
+
+
+/** Plans shared by all threads, with how many thread caches are using them
+ * (plans nobody uses may be destroyed, see setFFTCacheLimits and
+ * releaseCaches) and when they were last handed out or given back. Only
+ * touch with the PlannerLock held! */
+template <typename T>
+struct SharedPlan
+{
+  SharedPlan(const T & p) : plans(p), users(0), last_used(0) {; }
+  T plans;
+  int users;
+  unsigned long last_used;
+};
+
+typedef std::pair<fftw_plan, fftw_plan> PlanPair;
+typedef SharedPlan<PlanPair> SharedPlanPair;
+
+static unsigned long plan_clock = 0;
+
+template <typename T> static const T & acquirePlan(SharedPlan<T> & shared)
+{
+  shared.users++;
+  shared.last_used = ++plan_clock;
+  return shared.plans;
+}
+
+template <typename T> static void releasePlan(SharedPlan<T> * shared)
+{
+  shared->users--;
+  shared->last_used = ++plan_clock;
+}
+
+/** Limits set with setFFTCacheLimits. max_thread_bytes = 0 and max_idle_plans < 0 mean no limit */
+static FFTTOOLS_SETTING(size_t) max_thread_bytes(0);
+static FFTTOOLS_SETTING(int) max_idle_plans(-1);
+
+static void trimPlans(size_t keep); // destroys all but keep of the plans nobody uses. Defined once all the tables are.
+
+static void trimIdlePlans()
+{
+  int keep = max_idle_plans;
+  if (keep >= 0) trimPlans(keep);
+}
+
+
+/** This caches both forward and backwards plans. Only touch with the PlannerLock held! **/
+static std::map<int, SharedPlanPair> cached_plans; //this caches both plans for a given length
+
+
+/** Planner rigor. The default can be changed at runtime with setPlanRigor,
+ * optionally only for a range of lengths. Later ranges take precedence over
+ * earlier ones. Only touch with the PlannerLock held! */
+struct PlanRigorRange
+{
+  int min_length;
+  int max_length;
+  FFTtools::FFTPlanRigor rigor;
+};
+
+#ifdef FFTW_USE_PATIENT
+static FFTtools::FFTPlanRigor default_rigor = FFTtools::PLAN_PATIENT;
+#else
+static FFTtools::FFTPlanRigor default_rigor = FFTtools::PLAN_MEASURE;
+#endif
+static std::vector<PlanRigorRange> rigor_ranges;
+
+static unsigned plannerFlags(int len)
+{
+  FFTtools::FFTPlanRigor rigor = default_rigor;
+  for (int i = int(rigor_ranges.size())-1; i >= 0; i--)
+  {
+    if (len >= rigor_ranges[i].min_length && len <= rigor_ranges[i].max_length)
+    {
+      rigor = rigor_ranges[i].rigor;
+      break;
+    }
+  }
+
+  switch (rigor)
+  {
+    case FFTtools::PLAN_ESTIMATE: return FFTW_ESTIMATE;
+    case FFTtools::PLAN_PATIENT: return FFTW_PATIENT;
+    case FFTtools::PLAN_EXHAUSTIVE: return FFTW_EXHAUSTIVE;
+    case FFTtools::PLAN_MEASURE:
+    default: return FFTW_MEASURE;
+  }
+}
+
+/** Statistics (see getFFTStats). **/
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/* The counters are added to by their own thread, but getFFTStats may read
+ * them, and resetFFTStats zero them, from another, so in the threaded modes
+ * they are (relaxed) atomics. The updates are read-modify-writes, so a reset
+ * can't be undone by an add that started before it. (A compare-exchange loop,
+ * since there's no fetch_add for double before C++20. With one thread adding,
+ * it almost never goes round twice.) */
+#ifdef USE_PER_THREAD_MEMORY
+template <typename T> class StatValue
+{
+  public:
+    StatValue() : v(0) {; }
+    void add(T x)
+    {
+      T old = v.load(std::memory_order_relaxed);
+      while (!v.compare_exchange_weak(old, old + x, std::memory_order_relaxed)) {; }
+    }
+    void sub(T x)
+    {
+      T old = v.load(std::memory_order_relaxed);
+      while (!v.compare_exchange_weak(old, old - x, std::memory_order_relaxed)) {; }
+    }
+    T get() const { return v.load(std::memory_order_relaxed); }
+    void reset() { v.store(0, std::memory_order_relaxed); }
+  private:
+    std::atomic<T> v;
+};
+#else
+template <typename T> class StatValue
+{
+  public:
+    StatValue() : v(0) {; }
+    void add(T x) { v += x; }
+    void sub(T x) { v -= x; }
+    T get() const { return v; }
+    void reset() { v = 0; }
+  private:
+    T v;
+};
+#endif
+
+static FFTTOOLS_SETTING(bool) fft_timing(false);
+
+struct DirectionCounters
+{
+  StatValue<unsigned long> n;
+  StatValue<double> time;
+};
+
+struct LengthCounters
+{
+  StatValue<unsigned long> misses;
+  DirectionCounters forward;
+  DirectionCounters backward;
+};
+
+typedef std::pair<int,bool> StatsKey; // (length, single precision)
+
+class ThreadStats;
+
+/** These are only touched with the PlannerLock held! */
+static std::set<ThreadStats*> stats_registry; // every live ThreadStats
+static std::map<StatsKey, FFTtools::FFTLengthStats> retired_stats; // what's left of threads that exited
+static std::map<StatsKey, double> plan_times;
+
+/** One per thread, registered in stats_registry. The maps are only modified with the PlannerLock held. */
+class ThreadStats
+{
+  public:
+    ThreadStats()
+    {
+      PlannerLock lock;
+      stats_registry.insert(this);
+    }
+
+    ~ThreadStats()
+    {
+      PlannerLock lock;
+      for (int prec = 0; prec < 2; prec++)
+      {
+        for (std::map<int,LengthCounters*>::iterator it = lengths[prec].begin(); it != lengths[prec].end(); it++)
+        {
+          FFTtools::FFTLengthStats & st = retired_stats[StatsKey(it->first, prec)];
+          st.misses += it->second->misses.get();
+          st.n_forward += it->second->forward.n.get();
+          st.n_backward += it->second->backward.n.get();
+          st.forward_time += it->second->forward.time.get();
+          st.backward_time += it->second->backward.time.get();
+          delete it->second;
+        }
+      }
+      stats_registry.erase(this);
+    }
+
+    /** Counters for this length, made if necessary. Only call with the PlannerLock held! */
+    LengthCounters * counters(int len, bool single_precision)
+    {
+      LengthCounters * & c = lengths[single_precision][len];
+      if (!c) c = new LengthCounters;
+      return c;
+    }
+
+    std::map<int, LengthCounters*> lengths[2]; // indexed by single_precision
+    StatValue<size_t> buffer_bytes;
+};
+
+static FFTTOOLS_THREAD_LOCAL ThreadStats thread_stats;
+
+/** Returns the time to pass to stopTimer, if timing */
+static inline double startTimer()
+{
+  return fft_timing ? now() : -1;
+}
+
+static inline void stopTimer(DirectionCounters & c, double t0)
+{
+  c.n.add(1);
+  if (t0 >= 0) c.time.add(now() - t0);
+}
+
+
+#ifdef FFTTOOLS_FFTW_THREADS
+#include <atomic>  // (even if not USE_PER_THREAD_MEMORY)
+/** FFTW threads settings. Only touch with the PlannerLock held (except threads_generation, which is bumped whenever they change) */
+static bool fftw_threads_initialized = false;
+static int fftw_nthreads = 1;
+static int fftw_threads_min_length = INT_MAX;
+static std::atomic<int> threads_generation(0);
+
+/** This caches the multithreaded plans, keyed by (length, number of threads). Only touch with the PlannerLock held! **/
+static std::map<std::pair<int,int>, SharedPlanPair> cached_threaded_plans;
+
+static SharedPlanPair & sharedThreadedPlans(int len, double * x, fftw_complex * X)
+{
+  std::pair<int,int> key(len, fftw_nthreads);
+  std::map<std::pair<int,int>,SharedPlanPair>::iterator it = cached_threaded_plans.find(key);
+
+  if (it == cached_threaded_plans.end())
+  {
+    unsigned flags = plannerFlags(len);
+    std::pair<fftw_plan,fftw_plan> plans;
+    double t0 = now();
+    fftw_plan_with_nthreads(fftw_nthreads);
+    plans.first = fftw_plan_dft_r2c_1d(len,x, X, flags | FFTW_PRESERVE_INPUT);
+    plans.second = fftw_plan_dft_c2r_1d(len,X, x, flags);
+    fftw_plan_with_nthreads(1); // everything else stays single-threaded
+    plan_times[StatsKey(len,false)] += now() - t0;
+    it = cached_threaded_plans.insert(std::make_pair(key, SharedPlanPair(plans))).first;
+    it->second.last_used = ++plan_clock;
+  }
+
+  return it->second;
+}
+#endif
+
+/** Finds (or makes, using x and X to plan on) the shared plans for this length. Only call with the PlannerLock held! */
+static SharedPlanPair & sharedPlans(int len, double * x, fftw_complex * X)
+{
+#ifdef FFTTOOLS_FFTW_THREADS
+  if (fftw_nthreads > 1 && len >= fftw_threads_min_length) return sharedThreadedPlans(len, x, X);
+#endif
+
+  std::map<int,SharedPlanPair>::iterator it = cached_plans.find(len);
+
+  if (it == cached_plans.end())
+  {
+    //create plans
+    unsigned flags = plannerFlags(len);
+    std::pair<fftw_plan,fftw_plan> plans;
+    double t0 = now();
+    plans.first = fftw_plan_dft_r2c_1d(len,x, X, flags | FFTW_PRESERVE_INPUT);
+    plans.second = fftw_plan_dft_c2r_1d(len,X, x, flags);
+    plan_times[StatsKey(len,false)] += now() - t0;
+    it = cached_plans.insert(std::make_pair(len, SharedPlanPair(plans))).first;
+    it->second.last_used = ++plan_clock;
+  }
+
+  return it->second;
+}
+
+
+/** What each thread keeps for each length */
+struct FFTCacheEntry
+{
+  fftw_plan forward;
+  fftw_plan backward;
+  double * x;  // real scratch array (len)
+  fftw_complex * X; // complex scratch array (len/2+1)
+  LengthCounters * counters; // this thread's statistics for this length
+  SharedPlanPair * shared; // where forward and backward came from
+  unsigned long last_used; // for evicting the least recently used length
+#ifdef FFTTOOLS_FFTW_THREADS
+  int generation; // threads_generation when the plans were fetched
+#endif
+};
+
+static size_t entryBytes(int len) { return sizeof(double) * len + sizeof(fftw_complex) * (len/2+1); }
+
+
+/** Identifies a batched (fftw_plan_many) plan. See doFFTBatch / doInvFFTBatch */
+struct BatchPlanKey
+{
+  int length;
+  int nbatch;
+  int in_dist;
+  int out_dist;
+  bool forward;
+  bool aligned;
+
+  bool operator<(const BatchPlanKey & other) const
+  {
+    if (length != other.length) return length < other.length;
+    if (nbatch != other.nbatch) return nbatch < other.nbatch;
+    if (in_dist != other.in_dist) return in_dist < other.in_dist;
+    if (out_dist != other.out_dist) return out_dist < other.out_dist;
+    if (forward != other.forward) return forward < other.forward;
+    return aligned < other.aligned;
+  }
+};
+
+/** This caches the batched plans. Only touch with the PlannerLock held! **/
+static std::map<BatchPlanKey, SharedPlan<fftw_plan> > cached_batch_plans;
+
+
+/** The per-thread cache. Nobody but the owning thread ever looks at this, so no locking is needed here. */
+class PerThreadFFTCache
+{
+  public:
+    PerThreadFFTCache() : last_len(-1), last(0), clock(0), bytes(0) {; }
+
+    ~PerThreadFFTCache() { clear(); }
+
+    /** Frees all the arrays and gives back all the plans */
+    void release()
+    {
+      thread_stats.buffer_bytes.sub(bytes);
+      clear();
+    }
+
+    /** Get the entry for this length, making it (and maybe planning) if we haven't seen it */
+    inline const FFTCacheEntry & get(int len)
+    {
+#ifdef FFTTOOLS_FFTW_THREADS
+      int generation = threads_generation.load(std::memory_order_relaxed);
+
+      if (len == last_len && last->generation == generation) return *last;
+
+      if (last) last->last_used = ++clock;
+      std::map<int,FFTCacheEntry>::iterator it = entries.find(len);
+      last = it != entries.end() ? &(it->second) : add(len);
+      if (last->generation != generation) refresh(last, len, generation);
+#else
+      //most of the time, it's the same length as last time
+      if (len == last_len) return *last;
+
+      if (last) last->last_used = ++clock;
+      std::map<int,FFTCacheEntry>::iterator it = entries.find(len);
+      last = it != entries.end() ? &(it->second) : add(len);
+#endif
+      last_len = len;
+      return *last;
+    }
+
+    /** Get the batched plan for this geometry, making it if nobody has made it yet */
+    inline fftw_plan getBatch(const BatchPlanKey & key)
+    {
+      std::map<BatchPlanKey,BatchEntry>::iterator it = batch_plans.find(key);
+      if (it == batch_plans.end()) return addBatch(key);
+      it->second.last_used = ++clock;
+      return it->second.shared->plans;
+    }
+
+  private:
+    FFTCacheEntry * add(int len);
+    fftw_plan addBatch(const BatchPlanKey & key);
+    fftw_plan getSharedBatch(const BatchPlanKey & key);
+#ifdef FFTTOOLS_FFTW_THREADS
+    void refresh(FFTCacheEntry * entry, int len, int generation);
+#endif
+    void evict(int keep);
+    void evictBatches(const BatchPlanKey * keep);
+    void freeArrays(FFTCacheEntry & entry);
+    void clear();
+
+    struct BatchEntry
+    {
+      SharedPlan<fftw_plan> * shared;
+      unsigned long last_used; // for evicting the least recently used geometry
+    };
+
+    std::map<int, FFTCacheEntry> entries;
+    std::map<BatchPlanKey, BatchEntry> batch_plans;
+    int last_len;
+    FFTCacheEntry * last;
+    unsigned long clock;
+    size_t bytes;
+};
+
+static FFTTOOLS_THREAD_LOCAL PerThreadFFTCache thread_cache;
+
+
+FFTCacheEntry * PerThreadFFTCache::add(int len)
+{
+  /*
+     We haven't seen this length in this thread. Allocate memory for it, and
+     check whether we've encountered a request to do an FFT of this length
+     before. If we haven't then we need a new plan!
+  */
+
+  FFTCacheEntry entry;
+
+#ifdef FFTTOOLS_ALLOCATE_CONTIGUOUS
+  /* Allocate contiguous memory for both the real and complex arrays
+   *
+   *  For proper alignment, we ought to pad sizeof(double) * len to whatever the largest SIMD alignment is.
+   *  Currently that's sizeof(double) * 4, but in the future it might be sizeof(double) * 8;
+   **/
+
+  void * mem = fftw_malloc(sizeof(double) * (len + len % 8) +  (1 + len/2) * sizeof(fftw_complex));
+  entry.x = (double*) mem;  //pointer to real array
+  entry.X = (fftw_complex*) (entry.x + len + (len % 8));  //pointer to complex array
 #else
-static  std::map<int, std::map<long,double *> > cached_xs;
-static  std::map<int, std::map<long,fftw_complex *> > cached_Xs; 
+  entry.x = fftw_alloc_real(len);
+  entry.X = fftw_alloc_complex(len/2+1);
+#endif
+
+#ifdef FFTTOOLS_FFTW_THREADS
+  entry.generation = threads_generation.load();
+#endif
+
+  // constructing this thread's stats takes the PlannerLock, so make sure that's done before taking it here
+  ThreadStats & stats = thread_stats;
+
+  {
+    PlannerLock lock;
+    entry.shared = &sharedPlans(len, entry.x, entry.X);
+    const PlanPair & plans = acquirePlan(*entry.shared);
+    entry.forward = plans.first;
+    entry.backward = plans.second;
+    entry.counters = stats.counters(len, false);
+  }
+
+  entry.last_used = ++clock;
+  entry.counters->misses.add(1);
+  bytes += entryBytes(len);
+  thread_stats.buffer_bytes.add(entryBytes(len));
+
+  FFTCacheEntry * added = &(entries[len] = entry);
+  if (max_thread_bytes) evict(len);
+  return added;
+}
+
+
+/** Frees the arrays of an entry (but doesn't give back its plans) */
+void PerThreadFFTCache::freeArrays(FFTCacheEntry & entry)
+{
+  fftw_free(entry.x);
+#ifndef FFTTOOLS_ALLOCATE_CONTIGUOUS
+  fftw_free(entry.X);
+#endif
+}
+
+
+/** Drops the least recently used lengths until this cache is under max_thread_bytes. Never drops keep or the last used length, since somebody might be using them. */
+void PerThreadFFTCache::evict(int keep)
+{
+  while (bytes > max_thread_bytes)
+  {
+    std::map<int,FFTCacheEntry>::iterator lru = entries.end();
+    for (std::map<int,FFTCacheEntry>::iterator it = entries.begin(); it != entries.end(); it++)
+    {
+      if (it->first == keep || &(it->second) == last) continue;
+      if (lru == entries.end() || it->second.last_used < lru->second.last_used) lru = it;
+    }
+
+    if (lru == entries.end()) return;
+
+    {
+      PlannerLock lock;
+      releasePlan(lru->second.shared);
+      trimIdlePlans();
+    }
+
+    freeArrays(lru->second);
+    bytes -= entryBytes(lru->first);
+    thread_stats.buffer_bytes.sub(entryBytes(lru->first));
+    entries.erase(lru);
+  }
+
+  evictBatches(0);
+}
+
+
+/** Gives back the least recently used batched plans until there are no more of them than lengths (but always allows two). Never drops keep. */
+void PerThreadFFTCache::evictBatches(const BatchPlanKey * keep)
+{
+  size_t max_batches = entries.size() > 2 ? entries.size() : 2;
+
+  while (batch_plans.size() > max_batches)
+  {
+    std::map<BatchPlanKey,BatchEntry>::iterator lru = batch_plans.end();
+    for (std::map<BatchPlanKey,BatchEntry>::iterator it = batch_plans.begin(); it != batch_plans.end(); it++)
+    {
+      if (keep && !(it->first < *keep) && !(*keep < it->first)) continue;
+      if (lru == batch_plans.end() || it->second.last_used < lru->second.last_used) lru = it;
+    }
+
+    if (lru == batch_plans.end()) return;
+
+    {
+      PlannerLock lock;
+      releasePlan(lru->second.shared);
+      trimIdlePlans();
+    }
+
+    batch_plans.erase(lru);
+  }
+}
+
+
+void PerThreadFFTCache::clear()
+{
+  {
+    PlannerLock lock;
+    for (std::map<int,FFTCacheEntry>::iterator it = entries.begin(); it != entries.end(); it++)
+    {
+      releasePlan(it->second.shared);
+    }
+    for (std::map<BatchPlanKey,BatchEntry>::iterator it = batch_plans.begin(); it != batch_plans.end(); it++)
+    {
+      releasePlan(it->second.shared);
+    }
+    trimIdlePlans();
+  }
+
+  for (std::map<int,FFTCacheEntry>::iterator it = entries.begin(); it != entries.end(); it++)
+  {
+    freeArrays(it->second);
+  }
+
+  entries.clear();
+  batch_plans.clear();
+  last_len = -1;
+  last = 0;
+  bytes = 0;
+}
+
+
+#ifdef FFTTOOLS_FFTW_THREADS
+/** The FFTW threads settings changed since this entry got its plans, so get them again (the arrays are kept) */
+void PerThreadFFTCache::refresh(FFTCacheEntry * entry, int len, int generation)
+{
+  PlannerLock lock;
+  releasePlan(entry->shared);
+  entry->shared = &sharedPlans(len, entry->x, entry->X);
+  const PlanPair & plans = acquirePlan(*entry->shared);
+  entry->forward = plans.first;
+  entry->backward = plans.second;
+  entry->generation = generation;
+}
 #endif
 
-#else
-static std::map<int, double*> cached_xs;
-static std::map<int, fftw_complex*> cached_Xs;
-#endif
 
-static fftw_plan getPlan(int len, bool forward = true)
+/** Execute the plans of a cache entry, counting (and, if enabled, timing) them. */
+static inline void execute(const FFTCacheEntry & e, double * in, fftw_complex * out)
+{
+  double t0 = startTimer();
+  fftw_execute_dft_r2c(e.forward, in, out);
+  stopTimer(e.counters->forward, t0);
+}
+
+static inline void execute(const FFTCacheEntry & e, fftw_complex * in, double * out)
+{
+  double t0 = startTimer();
+  fftw_execute_dft_c2r(e.backward, in, out);
+  stopTimer(e.counters->backward, t0);
+}
+
+
+fftw_plan PerThreadFFTCache::addBatch(const BatchPlanKey & key)
+{
+  fftw_plan plan = getSharedBatch(key);
+  if (max_thread_bytes) evictBatches(&key);
+  return plan;
+}
+
+
+fftw_plan PerThreadFFTCache::getSharedBatch(const BatchPlanKey & key)
+{
+  PlannerLock lock;
+
+  std::map<BatchPlanKey, SharedPlan<fftw_plan> >::iterator it = cached_batch_plans.find(key);
+
+  if (it == cached_batch_plans.end())
+  {
+    /* Planning (with anything but FFTW_ESTIMATE) scribbles over the arrays, so we plan on temporaries of the right shape. */
+    int n = key.length;
+    int real_dist = key.forward ? key.in_dist : key.out_dist;
+    int complex_dist = key.forward ? key.out_dist : key.in_dist;
+    double * x = fftw_alloc_real((key.nbatch-1) * real_dist + n);
+    fftw_complex * X = fftw_alloc_complex((key.nbatch-1) * complex_dist + n/2+1);
+
+    unsigned flags = plannerFlags(n);
+    if (!key.aligned) flags |= FFTW_UNALIGNED;
+
+    fftw_plan plan = key.forward ?
+      fftw_plan_many_dft_r2c(1, &n, key.nbatch, x, 0, 1, key.in_dist, X, 0, 1, key.out_dist, flags | FFTW_PRESERVE_INPUT) :
+      fftw_plan_many_dft_c2r(1, &n, key.nbatch, X, 0, 1, key.in_dist, x, 0, 1, key.out_dist, flags);
+
+    fftw_free(x);
+    fftw_free(X);
+
+    it = cached_batch_plans.insert(std::make_pair(key, SharedPlan<fftw_plan>(plan))).first;
+  }
+
+  BatchEntry & entry = batch_plans[key];
+  entry.shared = &(it->second);
+  entry.last_used = ++clock;
+  return acquirePlan(it->second);
+}
+
+
+void FFTtools::doFFT(int length, const double * in, FFTWComplex * out)
+{
+  execute(thread_cache.get(length), (double*) in, (fftw_complex*) out);
+}
+
+
+
+
+
+
+void FFTtools::doInvFFTNoClobber(int length, const FFTWComplex * in, double * out)
+{
+  const FFTCacheEntry & cache = thread_cache.get(length);
+
+  /* copy the input to our (properly-aligned) scratch array, since c2r clobbers its input */
+#if ( __clang__major__ >3 || (__clang_major__==3 && __clang_minor__ >=6)  || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7) || (__GNUC__ > 4))
+  FFTWComplex * ain = (FFTWComplex*) __builtin_assume_aligned(in,32);
+#else
+  FFTWComplex * ain = (FFTWComplex*) in;
+#endif
+  memcpy(cache.X, ain, (length/2+1) * sizeof(FFTWComplex));
+  execute(cache, cache.X, out);
+
+#if ( __clang__major__ >3 || (__clang_major__==3 && __clang_minor__ >=6)  || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7) || (__GNUC__ > 4))
+  double * aout = (double*) __builtin_assume_aligned(out,32);
+#else
+  double * aout = (double*) out;
+#endif
+
+
+  for (int i = 0; i < length; i++)
+  {
+    aout[i] /= length;
+  }
+}
+
+
+void FFTtools::doInvFFTClobber(int length, FFTWComplex * in, double * out)
+{
+  execute(thread_cache.get(length), (fftw_complex*) in, out);
+
+#if ( __clang__major__ >3 || (__clang_major__==3 && __clang_minor__ >=6)  || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7) || (__GNUC__ > 4))
+  double * aout = (double*) __builtin_assume_aligned(out,32);
+#else
+  double * aout = (double*) out;
+#endif
+
+  for (int i = 0; i < length; i++)
+  {
+    aout[i] /= length;
+  }
+}
+
+
+FFTWComplex *FFTtools::doFFT(int length, double *theInput) {
+  //Here is what the sillyFFT program should be doing;
+
+  const int numFreqs= (length/2)+1;
+  const FFTCacheEntry & cache = thread_cache.get(length);
+
+  FFTWComplex *myOutput = new FFTWComplex [numFreqs];
+
+  memcpy(cache.x, theInput, sizeof(double)*length);
+  execute(cache, cache.x, cache.X);
+  memcpy(myOutput, cache.X, sizeof(fftw_complex)*numFreqs);
+
+  return myOutput;
+}
+
+
+
+double *FFTtools::doInvFFT(int length, FFTWComplex *theInput) {
+  // This is what sillyFFT should be doing
+  //    //Takes account of normailisation
+  // Although note that fftw_plan_dft_c2r_1d assumes that the frequency array is only the positive half, so it gets scaled by sqrt(2) to account for symmetry
+
+  const FFTCacheEntry & cache = thread_cache.get(length);
+
+  double *theOutput = new double [length];
+
+  memcpy(cache.X, theInput, sizeof(fftw_complex) * (length/2 + 1));
+  execute(cache, cache.X, cache.x);
+
+  /* Normalization needed on the inverse transform */
+  double * mem_x = cache.x;
+  for(int i=0; i<length; i++){
+    mem_x[i]/=length;
+  }
+
+  // Copy output array
+  memcpy(theOutput, mem_x, sizeof(double)*length);
+  return theOutput;
+}
+
+
+void FFTtools::doFFTBatch(int length, int nbatch, const double * in, FFTWComplex * out, int in_dist, int out_dist)
+{
+  if (length <= 0 || nbatch <= 0) return;
+  if (!in_dist) in_dist = length;
+  if (!out_dist) out_dist = length/2+1;
+
+  if (in_dist < length || out_dist < length/2+1)
+  {
+    std::cerr << "Warning! " << __PRETTY_FUNCTION__ << ": waveforms would overlap (length=" << length << ", in_dist=" << in_dist << ", out_dist=" << out_dist << "). Not doing anything." << std::endl;
+    return;
+  }
+
+  BatchPlanKey key;
+  key.length = length;
+  key.nbatch = nbatch;
+  key.in_dist = in_dist;
+  key.out_dist = out_dist;
+  key.forward = true;
+  key.aligned = !fftw_alignment_of((double*) in) && !fftw_alignment_of((double*) out);
+
+  fftw_execute_dft_r2c(thread_cache.getBatch(key), (double*) in, (fftw_complex*) out);
+}
+
+
+void FFTtools::doInvFFTBatch(int length, int nbatch, FFTWComplex * in, double * out, int in_dist, int out_dist)
+{
+  if (length <= 0 || nbatch <= 0) return;
+  if (!in_dist) in_dist = length/2+1;
+  if (!out_dist) out_dist = length;
+
+  if (in_dist < length/2+1 || out_dist < length)
+  {
+    std::cerr << "Warning! " << __PRETTY_FUNCTION__ << ": waveforms would overlap (length=" << length << ", in_dist=" << in_dist << ", out_dist=" << out_dist << "). Not doing anything." << std::endl;
+    return;
+  }
+
+  BatchPlanKey key;
+  key.length = length;
+  key.nbatch = nbatch;
+  key.in_dist = in_dist;
+  key.out_dist = out_dist;
+  key.forward = false;
+  key.aligned = !fftw_alignment_of((double*) in) && !fftw_alignment_of(out);
+
+  fftw_execute_dft_c2r(thread_cache.getBatch(key), (fftw_complex*) in, out);
+
+  /* Normalization needed on the inverse transform */
+  for (int j = 0; j < nbatch; j++)
+  {
+    double * y = out + j * out_dist;
+    for (int i = 0; i < length; i++)
+    {
+      y[i] /= length;
+    }
+  }
+}
+
+
+/* Helpers for doing things without allocating. These are used by the
+ * functions further down that take an output TGraph. */
+
+/** FFT into this thread's scratch array for this length. nin samples of the
+ * input are placed starting at offset, the rest is zero. The result is only
+ * valid until the next transform of this length in this thread, but may be
+ * modified and then transformed back with scratchInvFFT. */
+static FFTWComplex * scratchFFT(int length, const double * in, int nin, int offset = 0)
+{
+  const FFTCacheEntry & cache = thread_cache.get(length);
+
+  if (nin == length && offset == 0)
+  {
+    memcpy(cache.x, in, sizeof(double) * length);
+  }
+  else
+  {
+    memset(cache.x, 0, sizeof(double) * length);
+    memcpy(cache.x + offset, in, sizeof(double) * nin);
+  }
+
+  execute(cache, cache.x, cache.X);
+  return (FFTWComplex*) cache.X;
+}
+
+/** Normalized inverse FFT of the scratch spectrum for this length (i.e. what scratchFFT returned), into the scratch real array, which is returned. */
+static double * scratchInvFFT(int length)
+{
+  const FFTCacheEntry & cache = thread_cache.get(length);
+  execute(cache, cache.X, cache.x);
+
+  for (int i = 0; i < length; i++)
+  {
+    cache.x[i] /= length;
+  }
+
+  return cache.x;
+}
+
+
+/** A few per-thread aligned arrays that grow as needed, for when the FFT scratch arrays aren't enough. */
+class PerThreadScratch
+{
+  public:
+    enum { NSLOTS = 4 };
+
+    PerThreadScratch()
+    {
+      for (int i = 0; i < NSLOTS; i++) { mem[i] = 0; sizes[i] = 0; }
+    }
+
+    ~PerThreadScratch() { release(); }
+
+    void release()
+    {
+      for (int i = 0; i < NSLOTS; i++)
+      {
+        fftw_free(mem[i]);
+        mem[i] = 0;
+        sizes[i] = 0;
+      }
+    }
+
+    /** Returns at least n (uninitialized) doubles for this slot, valid until this slot is asked for again */
+    double * get(int slot, size_t n)
+    {
+      if (n > sizes[slot])
+      {
+        fftw_free(mem[slot]);
+        mem[slot] = fftw_alloc_real(n);
+        sizes[slot] = n;
+      }
+      return mem[slot];
+    }
+
+  private:
+    double * mem[NSLOTS];
+    size_t sizes[NSLOTS];
+};
+
+static FFTTOOLS_THREAD_LOCAL PerThreadScratch thread_scratch;
+
+
+/** Use out (resized if necessary) if it's non-zero, or else a new TGraph of size n */
+static TGraph * outputGraph(TGraph * out, int n)
+{
+  if (out)
+  {
+    if (out->GetN() != n) out->Set(n);
+  }
+  else
+  {
+    out = new TGraph(n);
+  }
+  return out;
+}
+
+
+
+/* Single precision versions. These work just like the double precision
+ * ones, but with fftwf plans, which live in their own tables. */
+
+/** This caches both forward and backwards single-precision plans. Only touch with the PlannerLock held! **/
+typedef std::pair<fftwf_plan, fftwf_plan> PlanPairF;
+typedef SharedPlan<PlanPairF> SharedPlanPairF;
+static std::map<int, SharedPlanPairF> cached_plans_f;
+
+/** Finds (or makes, using x and X to plan on) the shared single-precision plans for this length. Only call with the PlannerLock held! */
+static SharedPlanPairF & sharedPlansF(int len, float * x, fftwf_complex * X)
+{
+  std::map<int,SharedPlanPairF>::iterator it = cached_plans_f.find(len);
+
+  if (it == cached_plans_f.end())
+  {
+    unsigned flags = plannerFlags(len);
+    std::pair<fftwf_plan,fftwf_plan> plans;
+    double t0 = now();
+    plans.first = fftwf_plan_dft_r2c_1d(len,x, X, flags | FFTW_PRESERVE_INPUT);
+    plans.second = fftwf_plan_dft_c2r_1d(len,X, x, flags);
+    plan_times[StatsKey(len,true)] += now() - t0;
+    it = cached_plans_f.insert(std::make_pair(len, SharedPlanPairF(plans))).first;
+    it->second.last_used = ++plan_clock;
+  }
+
+  return it->second;
+}
+
+struct FFTCacheEntryF
+{
+  fftwf_plan forward;
+  fftwf_plan backward;
+  float * x;
+  fftwf_complex * X;
+  LengthCounters * counters;
+  SharedPlanPairF * shared;
+  unsigned long last_used;
+};
+
+static size_t entryBytesF(int len) { return sizeof(float) * len + sizeof(fftwf_complex) * (len/2+1); }
+
+class PerThreadFFTCacheF
+{
+  public:
+    PerThreadFFTCacheF() : last_len(-1), last(0), clock(0), bytes(0) {; }
+
+    ~PerThreadFFTCacheF() { clear(); }
+
+    void release()
+    {
+      thread_stats.buffer_bytes.sub(bytes);
+      clear();
+    }
+
+    inline const FFTCacheEntryF & get(int len)
+    {
+      if (len == last_len) return *last;
+
+      if (last) last->last_used = ++clock;
+      std::map<int,FFTCacheEntryF>::iterator it = entries.find(len);
+      last = it != entries.end() ? &(it->second) : add(len);
+      last_len = len;
+      return *last;
+    }
+
+  private:
+    FFTCacheEntryF * add(int len);
+    void evict(int keep);
+    void clear();
+    std::map<int, FFTCacheEntryF> entries;
+    int last_len;
+    FFTCacheEntryF * last;
+    unsigned long clock;
+    size_t bytes;
+};
+
+static FFTTOOLS_THREAD_LOCAL PerThreadFFTCacheF thread_cache_f;
+
+
+FFTCacheEntryF * PerThreadFFTCacheF::add(int len)
+{
+  FFTCacheEntryF entry;
+  entry.x = fftwf_alloc_real(len);
+  entry.X = fftwf_alloc_complex(len/2+1);
+
+  // (not inside the PlannerLock, see PerThreadFFTCache::add)
+  ThreadStats & stats = thread_stats;
+
+  {
+    PlannerLock lock;
+    entry.shared = &sharedPlansF(len, entry.x, entry.X);
+    const PlanPairF & plans = acquirePlan(*entry.shared);
+    entry.forward = plans.first;
+    entry.backward = plans.second;
+    entry.counters = stats.counters(len, true);
+  }
+
+  entry.last_used = ++clock;
+  entry.counters->misses.add(1);
+  bytes += entryBytesF(len);
+  thread_stats.buffer_bytes.add(entryBytesF(len));
+
+  FFTCacheEntryF * added = &(entries[len] = entry);
+  if (max_thread_bytes) evict(len);
+  return added;
+}
+
+
+/* as for PerThreadFFTCache */
+void PerThreadFFTCacheF::evict(int keep)
+{
+  while (bytes > max_thread_bytes)
+  {
+    std::map<int,FFTCacheEntryF>::iterator lru = entries.end();
+    for (std::map<int,FFTCacheEntryF>::iterator it = entries.begin(); it != entries.end(); it++)
+    {
+      if (it->first == keep || &(it->second) == last) continue;
+      if (lru == entries.end() || it->second.last_used < lru->second.last_used) lru = it;
+    }
+
+    if (lru == entries.end()) return;
+
+    {
+      PlannerLock lock;
+      releasePlan(lru->second.shared);
+      trimIdlePlans();
+    }
+
+    fftwf_free(lru->second.x);
+    fftwf_free(lru->second.X);
+    bytes -= entryBytesF(lru->first);
+    thread_stats.buffer_bytes.sub(entryBytesF(lru->first));
+    entries.erase(lru);
+  }
+}
+
+
+void PerThreadFFTCacheF::clear()
+{
+  {
+    PlannerLock lock;
+    for (std::map<int,FFTCacheEntryF>::iterator it = entries.begin(); it != entries.end(); it++)
+    {
+      releasePlan(it->second.shared);
+    }
+    trimIdlePlans();
+  }
+
+  for (std::map<int,FFTCacheEntryF>::iterator it = entries.begin(); it != entries.end(); it++)
+  {
+    fftwf_free(it->second.x);
+    fftwf_free(it->second.X);
+  }
+
+  entries.clear();
+  last_len = -1;
+  last = 0;
+  bytes = 0;
+}
+
+
+static void destroyPlans(PlanPair & plans)
+{
+  fftw_destroy_plan(plans.first);
+  fftw_destroy_plan(plans.second);
+}
+
+static void destroyPlans(PlanPairF & plans)
+{
+  fftwf_destroy_plan(plans.first);
+  fftwf_destroy_plan(plans.second);
+}
+
+static void destroyPlans(fftw_plan & plan)
+{
+  fftw_destroy_plan(plan);
+}
+
+template <typename Key, typename T>
+static void idleStamps(const std::map<Key, SharedPlan<T> > & table, std::vector<unsigned long> & stamps)
+{
+  for (typename std::map<Key, SharedPlan<T> >::const_iterator it = table.begin(); it != table.end(); it++)
+  {
+    if (!it->second.users) stamps.push_back(it->second.last_used);
+  }
+}
+
+template <typename Key, typename T>
+static void destroyIdle(std::map<Key, SharedPlan<T> > & table, unsigned long cutoff)
+{
+  typename std::map<Key, SharedPlan<T> >::iterator it = table.begin();
+  while (it != table.end())
+  {
+    if (!it->second.users && it->second.last_used <= cutoff)
+    {
+      destroyPlans(it->second.plans);
+      table.erase(it++);
+    }
+    else
+    {
+      it++;
+    }
+  }
+}
+
+/** Only call with the PlannerLock held! */
+static void trimPlans(size_t keep)
+{
+  /* Every plan has a different last_used, so find the one that keep of them are newer than */
+  std::vector<unsigned long> stamps;
+  idleStamps(cached_plans, stamps);
+  idleStamps(cached_plans_f, stamps);
+  idleStamps(cached_batch_plans, stamps);
+#ifdef FFTTOOLS_FFTW_THREADS
+  idleStamps(cached_threaded_plans, stamps);
+#endif
+
+  if (stamps.size() <= keep) return;
+
+  std::nth_element(stamps.begin(), stamps.begin() + (stamps.size() - keep - 1), stamps.end());
+  unsigned long cutoff = stamps[stamps.size() - keep - 1];
+
+  destroyIdle(cached_plans, cutoff);
+  destroyIdle(cached_plans_f, cutoff);
+  destroyIdle(cached_batch_plans, cutoff);
+#ifdef FFTTOOLS_FFTW_THREADS
+  destroyIdle(cached_threaded_plans, cutoff);
+#endif
+}
+
+
+static inline void execute(const FFTCacheEntryF & e, float * in, fftwf_complex * out)
+{
+  double t0 = startTimer();
+  fftwf_execute_dft_r2c(e.forward, in, out);
+  stopTimer(e.counters->forward, t0);
+}
+
+static inline void execute(const FFTCacheEntryF & e, fftwf_complex * in, float * out)
+{
+  double t0 = startTimer();
+  fftwf_execute_dft_c2r(e.backward, in, out);
+  stopTimer(e.counters->backward, t0);
+}
+
+
+void FFTtools::doFFT(int length, const float * in, std::complex<float> * out)
+{
+  execute(thread_cache_f.get(length), (float*) in, (fftwf_complex*) out);
+}
+
+
+void FFTtools::doInvFFTClobber(int length, std::complex<float> * in, float * out)
+{
+  execute(thread_cache_f.get(length), (fftwf_complex*) in, out);
+
+  for (int i = 0; i < length; i++)
+  {
+    out[i] /= length;
+  }
+}
+
+
+void FFTtools::doInvFFTNoClobber(int length, const std::complex<float> * in, float * out)
+{
+  const FFTCacheEntryF & cache = thread_cache_f.get(length);
+
+  memcpy(cache.X, in, (length/2+1) * sizeof(fftwf_complex));
+  execute(cache, cache.X, out);
+
+  for (int i = 0; i < length; i++)
+  {
+    out[i] /= length;
+  }
+}
+
+
+std::complex<float> * FFTtools::doFFT(int length, const float * theInput)
+{
+  const int numFreqs= (length/2)+1;
+  const FFTCacheEntryF & cache = thread_cache_f.get(length);
+
+  std::complex<float> * myOutput = new std::complex<float>[numFreqs];
+
+  memcpy(cache.x, theInput, sizeof(float)*length);
+  execute(cache, cache.x, cache.X);
+  memcpy(myOutput, cache.X, sizeof(fftwf_complex)*numFreqs);
+
+  return myOutput;
+}
+
+
+float * FFTtools::doInvFFT(int length, const std::complex<float> * theInput)
 {
-  /* 
-     Function which checks whether we've encountered a request to do an FFT of this length before.
-     If we haven't then we need a new plan!
-  */
+  const FFTCacheEntryF & cache = thread_cache_f.get(length);
 
-#ifdef FFTOOLS_THREAD_SAFE
-  plan_mutex.Lock(); //root lock 
-#endif 
+  float * theOutput = new float[length];
 
+  memcpy(cache.X, theInput, sizeof(fftwf_complex) * (length/2 + 1));
+  execute(cache, cache.X, cache.x);
 
+  for (int i = 0; i < length; i++)
+  {
+    theOutput[i] = cache.x[i] / length;
+  }
 
-  std::map<int,std::pair<fftw_plan, fftw_plan> >::iterator it = cached_plans.find(len);
+  return theOutput;
+}
 
 
-  bool must_plan = it == cached_plans.end(); 
-  bool must_allocate = must_plan; 
 
-#ifdef USE_PER_THREAD_MEMORY
-  unsigned long tid = GET_TID(); 
+void FFTtools::setPlanRigor(FFTPlanRigor rigor, int min_length, int max_length)
+{
+  PlannerLock lock;
 
-#ifdef FFTTOOLS_USE_OMP
-  must_allocate = must_allocate || cached_xs[len].size() <= tid || cached_xs[len][tid] == 0 ; 
-#else
-  must_allocate = must_allocate || cached_xs[len].count(tid) == 0 || cached_xs[len][tid] == 0 ; 
-#endif
+  if (min_length <= 0 && max_length <= 0)
+  {
+    default_rigor = rigor;
+    rigor_ranges.clear();
+    return;
+  }
+
+  PlanRigorRange range;
+  range.min_length = min_length;
+  range.max_length = max_length > 0 ? max_length : INT_MAX;
+  range.rigor = rigor;
+  rigor_ranges.push_back(range);
+}
 
-#endif 
 
-  double * mem_x = 0; 
-  fftw_complex * mem_X = 0; 
+void FFTtools::setFFTWThreads(int nthreads, int min_length)
+{
+#ifdef FFTTOOLS_FFTW_THREADS
+  PlannerLock lock;
 
-  if(must_allocate)
+  if (nthreads > 1 && !fftw_threads_initialized)
   {
-#ifdef FFTTOOLS_ALLOCATE_CONTIGUOUS
-    /* Allocate contiguous memory for both the real and complex arrays 
-     *
-     *  For proper alignment, we ought to pad sizeof(double) * len to whatever the largest SIMD alignment is. 
-     *  Currently that's sizeof(double) * 4, but in the future it might be sizeof(double) * 8; 
-     **/ 
- 
-    void * mem = fftw_malloc(sizeof(double) * (len + len % 8) +  (1 + len/2) * sizeof(fftw_complex)); 
-    mem_x = (double*) mem;  //pointer to real array 
-    mem_X = (fftw_complex*) (mem_x + len + (len % 8));  //pointer to complex array
+    if (!fftw_init_threads())
+    {
+      std::cerr << "Warning! " << __PRETTY_FUNCTION__ << ": fftw_init_threads failed. Staying single-threaded." << std::endl;
+      return;
+    }
+    fftw_threads_initialized = true;
+  }
 
-//    printf ("%lu %lu\n", ((size_t)mem_x) % 32, ((size_t)mem_X) % 32);  // check that aligned
+  fftw_nthreads = nthreads > 1 ? nthreads : 1;
+  fftw_threads_min_length = min_length > 0 ? min_length : 1;
+  threads_generation++;
 #else
-    mem_x= fftw_alloc_real(len); 
-    mem_X= fftw_alloc_complex(len/2+1); 
+  if (nthreads > 1)
+  {
+    std::cerr << "Warning! " << __PRETTY_FUNCTION__ << ": compiled without FFTTOOLS_FFTW_THREADS, so FFTW threads are not available." << std::endl;
+  }
+  (void) min_length;
 #endif
+}
 
-#ifdef USE_PER_THREAD_MEMORY
 
+void FFTtools::setFFTTiming(bool enable)
+{
+  fft_timing = enable;
+}
 
-#ifdef FFTTOOLS_USE_OMP
-    if (must_plan)
+
+FFTtools::FFTStats FFTtools::getFFTStats()
+{
+  PlannerLock lock;
+
+  std::map<StatsKey, FFTLengthStats> all = retired_stats;
+  FFTStats stats;
+  stats.total_buffer_bytes = 0;
+
+  for (std::set<ThreadStats*>::iterator ts = stats_registry.begin(); ts != stats_registry.end(); ts++)
+  {
+    for (int prec = 0; prec < 2; prec++)
     {
-      cached_xs[len] = std::vector<double*>(tid+1,0); 
-      cached_Xs[len] = std::vector<fftw_complex*>(tid+1,0); 
+      for (std::map<int,LengthCounters*>::iterator it = (*ts)->lengths[prec].begin(); it != (*ts)->lengths[prec].end(); it++)
+      {
+        FFTLengthStats & st = all[StatsKey(it->first, prec)];
+        st.misses += it->second->misses.get();
+        st.n_forward += it->second->forward.n.get();
+        st.n_backward += it->second->backward.n.get();
+        st.forward_time += it->second->forward.time.get();
+        st.backward_time += it->second->backward.time.get();
+      }
     }
 
-    if (cached_xs[len].size() <= tid)
+    size_t bytes = (*ts)->buffer_bytes.get();
+    if (bytes)
     {
-      cached_xs[len].resize(tid+1,0); 
-      cached_Xs[len].resize(tid+1,0); 
+      stats.thread_buffer_bytes.push_back(bytes);
+      stats.total_buffer_bytes += bytes;
     }
-
-#endif
-
-    cached_xs[len][tid] = mem_x; 
-    cached_Xs[len][tid] = mem_X; 
-
-//    printf("FFTtools:: Allocated memory for thread %lu, length %d\n", tid, len); 
-#else
-    cached_xs[len] = mem_x;  //insert into maps 
-    cached_Xs[len] = mem_X; 
-#endif
-
   }
-   
 
-  if (must_plan)
+  for (std::map<StatsKey,double>::iterator it = plan_times.begin(); it != plan_times.end(); it++)
   {
-
-    //create plans
-    std::pair<fftw_plan,fftw_plan> plans; 
-#ifdef FFTW_USE_PATIENT
-    plans.first = fftw_plan_dft_r2c_1d(len,mem_x, mem_X, FFTW_PATIENT | FFTW_PRESERVE_INPUT);
-    plans.second = fftw_plan_dft_c2r_1d(len,mem_X, mem_x, FFTW_PATIENT); 
-#else
-    plans.first = fftw_plan_dft_r2c_1d(len,mem_x, mem_X, FFTW_MEASURE | FFTW_PRESERVE_INPUT);
-    plans.second = fftw_plan_dft_c2r_1d(len,mem_X, mem_x, FFTW_MEASURE); 
-#endif
-    cached_plans[len] = plans; 
+    all[it->first].plan_time += it->second;
   }
 
-#ifdef FFTOOLS_THREAD_SAFE
-    plan_mutex.UnLock(); 
-#endif 
+  for (std::map<StatsKey,FFTLengthStats>::iterator it = all.begin(); it != all.end(); it++)
+  {
+    FFTLengthStats st = it->second;
+    st.length = it->first.first;
+    st.single_precision = it->first.second;
+    unsigned long n = st.n_forward + st.n_backward;
+    st.hits = n > st.misses ? n - st.misses : 0;
+    stats.lengths.push_back(st);
+  }
 
- if (!must_plan) 
- {
-   return forward ? (*it).second.first : (*it).second.second; 
- }
- else
- {
-   return forward ? cached_plans[len].first : cached_plans[len].second; 
- }
-  
+  return stats;
 }
 
 
-void FFTtools::doFFT(int length, const double * in, FFTWComplex * out)
+void FFTtools::resetFFTStats()
 {
+  PlannerLock lock;
 
-  fftw_plan plan;
-#ifdef FFTTOOLS_USE_OMP
-#pragma omp critical (fft_tools) 
+  for (std::set<ThreadStats*>::iterator ts = stats_registry.begin(); ts != stats_registry.end(); ts++)
   {
-    plan = getPlan(length,true); 
+    for (int prec = 0; prec < 2; prec++)
+    {
+      for (std::map<int,LengthCounters*>::iterator it = (*ts)->lengths[prec].begin(); it != (*ts)->lengths[prec].end(); it++)
+      {
+        it->second->misses.reset();
+        it->second->forward.n.reset();
+        it->second->forward.time.reset();
+        it->second->backward.n.reset();
+        it->second->backward.time.reset();
+      }
+    }
   }
-#else
-  plan = getPlan(length,true); 
-#endif
 
-  fftw_execute_dft_r2c(plan, (double*) in, (fftw_complex*) out);
+  retired_stats.clear();
+  plan_times.clear();
 }
 
 
+void FFTtools::setFFTCacheLimits(size_t max_bytes_per_thread, int max_unused_plans)
+{
+  max_thread_bytes = max_bytes_per_thread;
+  max_idle_plans = max_unused_plans;
 
+  PlannerLock lock;
+  trimIdlePlans();
+}
 
 
-
-void FFTtools::doInvFFTNoClobber(int length, const FFTWComplex * in, double * out)
+void FFTtools::releaseCaches()
 {
-  fftw_plan plan;
-#ifdef FFTTOOLS_USE_OMP
-#pragma omp critical (fft_tools) 
-  {
-    plan = getPlan(length,false); 
-  }
-#else
-  plan = getPlan(length,false); 
-#endif
+  thread_cache.release();
+  thread_cache_f.release();
+  thread_scratch.release();
 
-  fftw_complex new_in[length/2+1] __attribute__((aligned(32)));
+  PlannerLock lock;
+  trimPlans(0);
+}
 
-#if ( __clang__major__ >3 || (__clang_major__==3 && __clang_minor__ >=6)  || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7) || (__GNUC__ > 4))
-  FFTWComplex * ain = (FFTWComplex*) __builtin_assume_aligned(in,32);
-#else
-  FFTWComplex * ain = (FFTWComplex*) in;
-#endif
-  memcpy(new_in, ain, (length/2+1) * sizeof(FFTWComplex)); 
-  fftw_execute_dft_c2r(plan,new_in, out);
 
-#if ( __clang__major__ >3 || (__clang_major__==3 && __clang_minor__ >=6)  || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7) || (__GNUC__ > 4))
-  double * aout = (double*) __builtin_assume_aligned(out,32);   
-#else
-  double * aout = (double*) out;
-#endif  
+/** Makes the shared plans for each length, without giving any thread a copy. */
+static void makePlans(int n, const int * lengths, bool single_precision, const char * wisdom_file)
+{
+  for (int i = 0; i < n; i++)
+  {
+    int len = lengths[i];
+    if (len <= 0) continue;
+
+    /* Planning may scribble over the arrays, so give it some of its own. These have the same alignment as the thread buffers. */
+    double * x = fftw_alloc_real(len);
+    fftw_complex * X = fftw_alloc_complex(len/2+1);
+    {
+      PlannerLock lock;
+      sharedPlans(len, x, X);
+    }
+    fftw_free(x);
+    fftw_free(X);
 
+    if (single_precision)
+    {
+      float * xf = fftwf_alloc_real(len);
+      fftwf_complex * Xf = fftwf_alloc_complex(len/2+1);
+      {
+        PlannerLock lock;
+        sharedPlansF(len, xf, Xf);
+      }
+      fftwf_free(xf);
+      fftwf_free(Xf);
+    }
+  }
 
-  for (int i = 0; i < length; i++) 
   {
-    aout[i] /= length; 
+    PlannerLock lock;
+    trimIdlePlans();
   }
+
+  if (wisdom_file) FFTtools::saveWisdom(wisdom_file);
 }
 
 
-void FFTtools::doInvFFTClobber(int length, FFTWComplex * in, double * out)
+#ifdef USE_PER_THREAD_MEMORY
+#include <thread>
+/* Joins on destruction, so a program that exits while planning doesn't std::terminate */
+static struct WarmThread
 {
-  fftw_plan plan;
-#ifdef FFTTOOLS_USE_OMP
-#pragma omp critical (fft_tools) 
-  {
-    plan = getPlan(length,false); 
-  }
-#else
-  plan = getPlan(length,false); 
+  ~WarmThread() { if (thread.joinable()) thread.join(); }
+  std::thread thread;
+} warm_thread;
 #endif
 
 
-#if ( __clang__major__ >3 || (__clang_major__==3 && __clang_minor__ >=6)  || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7) || (__GNUC__ > 4))
-  fftw_execute_dft_c2r(plan, (fftw_complex*) in, out);
+void FFTtools::warmPlans(const int * lengths, int n, bool background, const char * wisdom_file, bool single_precision)
+{
+  waitForWarmPlans();
+  if (n <= 0) return;
 
-  double * aout = (double*) __builtin_assume_aligned(out,32);   
-#else
-  double * aout = (double*) out;
-#endif  
-  
-  for (int i = 0; i < length; i++) 
+  /* Anything we already know will make planning faster */
+  if (wisdom_file && !gSystem->AccessPathName(wisdom_file))
   {
-    aout[i] /= length; 
+    loadWisdom(wisdom_file);
   }
-}
 
-
-FFTWComplex *FFTtools::doFFT(int length, double *theInput) {
-  //Here is what the sillyFFT program should be doing;    
-
-  const int numFreqs= (length/2)+1;
-#ifdef FFTTOOLS_USE_OMP
-  fftw_plan plan; 
-  fftw_complex * mem_X; 
-  double * mem_x; 
-  unsigned long tid = GET_TID();
-#pragma omp critical (fft_tools)
+#ifdef USE_PER_THREAD_MEMORY
+  if (background)
   {
-   plan = getPlan(length, true); 
-   mem_X = cached_Xs[length][tid]; 
-   mem_x = cached_xs[length][tid]; 
+    std::vector<int> copy(lengths, lengths + n);
+    std::string file = wisdom_file ? wisdom_file : "";
+    warm_thread.thread = std::thread([copy, file, single_precision]()
+    {
+      makePlans(copy.size(), &copy[0], single_precision, file.size() ? file.c_str() : 0);
+    });
+    return;
   }
 #else
-  fftw_plan plan = getPlan(length, true); 
-
-#if FFTTOOLS_THREAD_SAFE 
-  unsigned long tid = GET_TID();
-  plan_mutex.Lock(); 
-  fftw_complex * mem_X = cached_Xs[length][tid]; 
-  double * mem_x = cached_xs[length][tid]; 
-  plan_mutex.UnLock(); 
-#endif
-
-#endif
-
-  FFTWComplex *myOutput = new FFTWComplex [numFreqs];
-
-#ifdef USE_PER_THREAD_MEMORY
-//  printf("%x\n", (size_t) mem_x); 
-  memcpy(mem_x, theInput, sizeof(double)*length);
-  fftw_execute_dft_r2c(plan, mem_x, mem_X);
-  memcpy(myOutput, mem_X, sizeof(fftw_complex)*numFreqs);
-#else
-  memcpy(cached_xs[length], theInput, sizeof(double)*length);
-  fftw_execute(plan);
-  memcpy(myOutput, cached_Xs[length], sizeof(fftw_complex)*numFreqs);
+  if (background)
+  {
+    std::cerr << "Warning! " << __PRETTY_FUNCTION__ << ": planning in the background needs FFTTOOLS_THREAD_SAFE or FFTTOOLS_USE_OMP. Planning now instead." << std::endl;
+  }
 #endif
 
-  return myOutput;
+  makePlans(n, lengths, single_precision, wisdom_file);
 }
 
 
-
-double *FFTtools::doInvFFT(int length, FFTWComplex *theInput) {
-  // This is what sillyFFT should be doing
-  //    //Takes account of normailisation 
-  // Although note that fftw_plan_dft_c2r_1d assumes that the frequency array is only the positive half, so it gets scaled by sqrt(2) to account for symmetry
-
-
-#ifdef FFTTOOLS_USE_OMP
-  fftw_complex * mem_X; 
-  double * mem_x; 
-  fftw_plan plan; 
-  unsigned long tid = GET_TID(); 
-#pragma omp critical (fft_tools)
-  {
-   plan = getPlan(length, false); 
-   mem_X = cached_Xs[length][tid]; 
-   mem_x = cached_xs[length][tid]; 
-  }
-#else 
-  fftw_plan  plan = getPlan(length, false); 
-
-#if FFTTOOLS_THREAD_SAFE
-  plan_mutex.Lock(); 
-  unsigned long tid = GET_TID();
-  fftw_complex * mem_X = cached_Xs[length][tid]; 
-  double *mem_x = cached_xs[length][tid]; 
-  plan_mutex.UnLock(); 
-#endif
-
-#endif
- 
-  double *theOutput = new double [length];
-
+void FFTtools::waitForWarmPlans()
+{
 #ifdef USE_PER_THREAD_MEMORY
-  memcpy(mem_X, theInput, sizeof(fftw_complex) * (length/2 + 1)); 
-  fftw_execute_dft_c2r(plan, mem_X, mem_x);
-#else
-  memcpy (cached_Xs[length], theInput, sizeof(fftw_complex) * (length/2 +1)); 
-  fftw_execute(plan);
-  double * mem_x = cached_xs[length]; 
+  if (warm_thread.thread.joinable()) warm_thread.thread.join();
 #endif
-
-  /* Normalization needed on the inverse transform */
-  for(int i=0; i<length; i++){
-    mem_x[i]/=length;
-  }
-
-  // Copy output array
-  memcpy(theOutput, mem_x, sizeof(double)*length);
-  return theOutput;
 }
 
 
@@ -566,6 +1735,83 @@ Double_t *FFTtools::combineValuesUsingFFTs(Int_t numArrays, Double_t **thePtrPtr
 }
 
 
+Double_t *FFTtools::combineValuesUsingFFTs(Int_t numArrays, Double_t **thePtrPtr, Int_t eachLength, Workspace & ws) {
+    int fftLength=(eachLength/2)+1;
+    double * x = ws.allocDouble(eachLength);
+    FFTWComplex **theFFTs = (FFTWComplex**) ws.alloc(numArrays * sizeof(FFTWComplex*));
+    for(int i=0;i<numArrays;i++) {
+	theFFTs[i]=ws.allocComplex(fftLength);
+	memcpy(x, thePtrPtr[i], eachLength * sizeof(double));
+	doFFT(eachLength,x,theFFTs[i]);
+    }
+
+    //the first FFT becomes the combined one
+    FFTWComplex *combinedFFT = theFFTs[0];
+    for(int i=0;i<fftLength;i++) {
+	double tempAbs0=getAbs(theFFTs[0][i]);
+	double tempTotAbs=tempAbs0;
+	for(int arNum=1;arNum<numArrays;arNum++) {
+	    tempTotAbs+=getAbs(theFFTs[arNum][i]);
+	}
+
+	combinedFFT[i].re=theFFTs[0][i].re*(tempTotAbs/(tempAbs0*double(numArrays)));
+	combinedFFT[i].im=theFFTs[0][i].im*(tempTotAbs/(tempAbs0*double(numArrays)));
+    }
+
+    doInvFFTClobber(eachLength,combinedFFT,x);
+    return x;
+}
+
+
+TGraph *FFTtools::getInterpolatedGraphFreqDom(TGraph *grIn, Double_t deltaT, Workspace & ws, TGraph * out)
+{
+  Int_t numIn=grIn->GetN();
+  Double_t *tIn=grIn->GetX();
+  Double_t oldDt=tIn[1]-tIn[0];
+  if(deltaT>oldDt) {
+    TGraph *grInt = getInterpolatedGraph(grIn,deltaT);
+    if (!out) return grInt;
+    outputGraph(out,grInt->GetN());
+    memcpy(out->GetX(), grInt->GetX(), grInt->GetN() * sizeof(double));
+    memcpy(out->GetY(), grInt->GetY(), grInt->GetN() * sizeof(double));
+    delete grInt;
+    return out;
+  }
+
+  Int_t fftLength=(numIn/2)+1;
+  Int_t newFFTLength=(oldDt/deltaT)*fftLength;
+  Int_t numPoints=(newFFTLength-1)*2;
+  Double_t scaleFactor=Double_t(numPoints)/Double_t(numIn);
+
+  //the input copy is reused for the output, so make it big enough for both
+  double * x = ws.allocDouble(std::max(numIn,numPoints));
+  FFTWComplex *thePaddedFft = ws.allocComplex(std::max(fftLength,newFFTLength));
+  memcpy(x, grIn->GetY(), numIn * sizeof(double));
+  doFFT(numIn,x,thePaddedFft);
+
+  for(int i=0;i<newFFTLength;i++) {
+    if(i<fftLength) {
+      thePaddedFft[i]*=FFTWComplex(scaleFactor,0);
+    }
+    else {
+      thePaddedFft[i].re=0;
+      thePaddedFft[i].im=0;
+    }
+  }
+
+  doInvFFTClobber(numPoints,thePaddedFft,x);
+
+  TGraph *grInt = outputGraph(out,numPoints);
+  Double_t *newTimes = grInt->GetX();
+  memcpy(grInt->GetY(), x, numPoints * sizeof(double));
+  for(Int_t i=0;i<numPoints;i++) {
+    newTimes[i]=tIn[0]+deltaT*(i-1);
+  }
+
+  return grInt;
+}
+
+
 TGraph *FFTtools::combineGraphsUsingFFTs(Int_t numGraphs, TGraph **grPtr,double *theWeights) {
 
     double totalWeight=0;
@@ -705,7 +1951,75 @@ TGraph *FFTtools::getNormalisedCorrelationGraphTimeDomain(TGraph *gr1, TGraph *g
   return grCor;
 }
 
-TGraph *FFTtools::getNormalisedCorrelationGraph(TGraph *gr1, TGraph *gr2, Int_t *zeroOffset) {
+TGraph *FFTtools::getNormalisedCorrelationGraphFFT(TGraph *gr1, TGraph *gr2,  Int_t *zeroOffset, Int_t useDtRange, Double_t dtMin, Double_t dtMax, TGraph *out) {
+  //Same definition (and assumptions) as getNormalisedCorrelationGraphTimeDomain, but the sums are done by FFT
+  int length=gr1->GetN();
+  Double_t *y1=gr1->GetY();
+  int length2=gr2->GetN();
+  if(length2<length) length=length2;
+  Double_t *y2=gr2->GetY();
+  Double_t denom=gr1->GetRMS(2)*gr2->GetRMS(2);
+
+  Double_t *x1=gr1->GetX();
+  Double_t *x2=gr2->GetX();
+
+  double deltaT=x1[1]-x1[0];
+  double waveOffset=x1[0]-x2[0];
+
+  int N=2*length-1;
+
+  if(zeroOffset) {
+    *zeroOffset=N/2;
+    (*zeroOffset)+=Int_t(waveOffset/deltaT);
+  }
+
+  int minDtIndex=0;
+  int maxDtIndex=N-1;
+  if(useDtRange) {
+    minDtIndex=TMath::Floor((dtMin-waveOffset)/deltaT)+(N/2);
+    if(minDtIndex<0) minDtIndex=0;
+    maxDtIndex=TMath::Ceil((dtMax-waveOffset)/deltaT)+(N/2);
+    if(maxDtIndex<0) maxDtIndex=0;
+  }
+
+  //zero-padded to at least N, so the correlation doesn't wrap around
+  int Nfft=nextFastLength(N);
+  int newLength=(Nfft/2)+1;
+  FFTWComplex *theFFT1 = (FFTWComplex*) thread_scratch.get(0, 2*newLength);
+  memcpy(theFFT1, scratchFFT(Nfft,y1,length), newLength*sizeof(FFTWComplex));
+  FFTWComplex *theFFT2 = scratchFFT(Nfft,y2,length);
+  for(int i=0;i<newLength;i++) {
+    double reFFT1=theFFT1[i].re;
+    double imFFT1=theFFT1[i].im;
+    double reFFT2=theFFT2[i].re;
+    double imFFT2=theFFT2[i].im;
+
+    theFFT2[i].re=reFFT1*reFFT2+imFFT1*imFFT2;
+    theFFT2[i].im=imFFT1*reFFT2-reFFT1*imFFT2;
+  }
+  //corVals[d] is the sum of y1[j+d]*y2[j], over the length-|d| overlapping samples
+  double *corVals=scratchInvFFT(Nfft);
+
+  TGraph *grCor = outputGraph(out,(maxDtIndex-minDtIndex)+1);
+  double *xVals = grCor->GetX();
+  double *yVals = grCor->GetY();
+  for(int i=minDtIndex;i<=maxDtIndex;i++) {
+    int dtIndex=(i-minDtIndex);
+    int lag=i-(N/2);
+    xVals[dtIndex]=(lag*deltaT)+waveOffset;
+    if(i<N) {
+      int numSamples=length-abs(lag);
+      yVals[dtIndex]=corVals[(lag+Nfft)%Nfft]/(denom*sqrt(numSamples));
+    }
+    else {
+      yVals[dtIndex]=0;
+    }
+  }
+
+  return grCor;
+}
+
+TGraph *FFTtools::getNormalisedCorrelationGraph(TGraph *gr1, TGraph *gr2, Int_t *zeroOffset, TGraph *out) {
   //Will also assume these graphs are zero meaned... may fix this assumption
    //Now we'll extend this up to a power of 2
   int length=gr1->GetN();
@@ -721,7 +2035,7 @@ TGraph *FFTtools::getNormalisedCorrelationGraph(TGraph *gr1, TGraph *gr2, Int_t
   //Will really assume that N's are equal for now
   int firstRealSamp=1+(N-2*length)/2;
   int lastRealSamp=firstRealSamp+2*(length-1);
-  TGraph *grCor = getCorrelationGraph(gr1,gr2,zeroOffset);
+  TGraph *grCor = getCorrelationGraph(gr1,gr2,zeroOffset,out);
   Double_t *corVal=grCor->GetY();
   Double_t norm1=0;
   Double_t norm2=0;
@@ -744,13 +2058,44 @@ TGraph *FFTtools::getNormalisedCorrelationGraph(TGraph *gr1, TGraph *gr2, Int_t
     }
   }
 
-  return grCor;
+  return grCor;
+}
+
+
+
+
+static FFTTOOLS_SETTING(bool) pad_to_fast_length(false);
+
+void FFTtools::setPadToFastLength(bool enable)
+{
+  pad_to_fast_length = enable;
+}
+
+
+int FFTtools::nextFastLength(int n)
+{
+  if (n <= 1) return 1;
+
+  /* try every 3^b 5^c 7^d below the best so far, doubling it up to n */
+  long long best = 0;
+  for (long long p7 = 1; !best || p7 < best; p7 *= 7)
+  {
+    for (long long p75 = p7; !best || p75 < best; p75 *= 5)
+    {
+      for (long long p753 = p75; !best || p753 < best; p753 *= 3)
+      {
+        long long m = p753;
+        while (m < n) m *= 2;
+        if (!best || m < best) best = m;
+      }
+    }
+  }
+
+  return int(best);
 }
 
 
-
-
-TGraph *FFTtools::getCorrelationGraph(TGraph *gr1, TGraph *gr2, Int_t *zeroOffset) {
+TGraph *FFTtools::getCorrelationGraph(TGraph *gr1, TGraph *gr2, Int_t *zeroOffset, TGraph *out) {
    //Now we'll extend this up to a power of 2
     int length=gr1->GetN();
     int length2=gr2->GetN();
@@ -759,12 +2104,15 @@ TGraph *FFTtools::getCorrelationGraph(TGraph *gr1, TGraph *gr2, Int_t *zeroOffse
     if(N<length2)
        N=int(TMath::Power(2,int(TMath::Log2(length2))+2));
 
+    //The output always has N points, but if padding to fast lengths, the
+    //transform is only as long as it needs to be to not wrap around
+    int Nfft=N;
+    if(pad_to_fast_length)
+       Nfft=std::min(N,2*nextFastLength(std::max(length,length2)));
+
     //Will really assume that N's are equal for now
-    int firstRealSamp=(N-length)/2;
+    int firstRealSamp=(Nfft-length)/2;
 
-    double *oldY1 = new double [N];
-    double *oldY2 = new double [N];
-    
     double x,y;
     Double_t x2,y2;
     gr1->GetPoint(1,x2,y2);
@@ -774,29 +2122,6 @@ TGraph *FFTtools::getCorrelationGraph(TGraph *gr1, TGraph *gr2, Int_t *zeroOffse
 
     gr2->GetPoint(0,x2,y2);
     double waveOffset=firstX-x2;
-    
-
-    //    gr1->GetPoint(N/2,x2,y2);
-    //    double offset=x-x2;
-    //    std::cout << length << "\t" << length2 << "\n";
-
-    for(int i=0;i<N;i++) {
-       
-       if(i<firstRealSamp || i>=firstRealSamp+length)
-	  y=0;
-       else {
-	  gr1->GetPoint(i-firstRealSamp,x,y);
-       }
-       oldY1[i]=y;
-	  
-       if(i<firstRealSamp || i>=firstRealSamp+length2)
-	  y=0;
-       else {
-	  gr2->GetPoint(i-firstRealSamp,x,y);
-       }
-       oldY2[i]=y;
-              
-    }
 
 
     //    offset+=waveOffset;
@@ -805,30 +2130,51 @@ TGraph *FFTtools::getCorrelationGraph(TGraph *gr1, TGraph *gr2, Int_t *zeroOffse
        (*zeroOffset)+=Int_t(waveOffset/deltaT);
     }
 
-    double *xVals = new double [N];
-    double *yVals = new double [N];
-    double *corVals=getCorrelation(N,oldY1,oldY2);
-    for(int i=0;i<N;i++) {
-       if(i<N/2) {
+    //Both waveforms are zero-padded, starting at firstRealSamp
+    int newLength=(Nfft/2)+1;
+    FFTWComplex *theFFT1 = (FFTWComplex*) thread_scratch.get(0, 2*newLength);
+    memcpy(theFFT1, scratchFFT(Nfft,gr1->GetY(),length,firstRealSamp), newLength*sizeof(FFTWComplex));
+    FFTWComplex *theFFT2 = scratchFFT(Nfft,gr2->GetY(),std::min(length2,Nfft-firstRealSamp),firstRealSamp);
+
+    //as in getCorrelation (normalised for N, so padding doesn't change the scale)
+    int no2=N>>1;
+    for(int i=0;i<newLength;i++) {
+	double reFFT1=theFFT1[i].re;
+	double imFFT1=theFFT1[i].im;
+	double reFFT2=theFFT2[i].re;
+	double imFFT2=theFFT2[i].im;
+
+	theFFT2[i].re=(reFFT1*reFFT2+imFFT1*imFFT2)/double(no2/2);
+	theFFT2[i].im=(imFFT1*reFFT2-reFFT1*imFFT2)/double(no2/2);
+    }
+    double *corVals=scratchInvFFT(Nfft);
+
+    TGraph *grCor = outputGraph(out,N);
+    double *xVals = grCor->GetX();
+    double *yVals = grCor->GetY();
+    if(Nfft==N) {
+      for(int i=0;i<N;i++) {
+	if(i<N/2) {
 	  //Positive
 	  xVals[i+(N/2)]=(i*deltaT)+waveOffset;
 	  yVals[i+(N/2)]=corVals[i];
-       }
-       else {
+	}
+	else {
 	  //Negative
 	  xVals[i-(N/2)]=((i-N)*deltaT)+waveOffset;
 	  yVals[i-(N/2)]=corVals[i];	  
-       }
+	}
+      }
+    }
+    else {
+      //Same lags as above. The ones the shorter transform doesn't have are zero anyway
+      for(int j=0;j<N;j++) {
+	int lag=j-(N/2);
+	xVals[j]=(lag*deltaT)+waveOffset;
+	yVals[j]=(lag>=-Nfft/2 && lag<Nfft/2) ? corVals[(lag+Nfft)%Nfft] : 0;
+      }
     }
 
-
-    TGraph *grCor = new TGraph(N,xVals,yVals);
-    delete [] oldY1;
-    delete [] oldY2;
-    delete [] xVals;
-    delete [] yVals;
-    delete [] corVals;
-    
     return grCor;
 }
 
@@ -848,22 +2194,320 @@ TGraph *FFTtools::getInterpolatedCorrelationGraph(TGraph *grIn1, TGraph *grIn2,
   return grCor;
 }
 
+
+/* The cross spectrum that getCorrelationGraph inverts (always at its full,
+ * power of 2, length N), left in thread_scratch slot 0. */
+static FFTWComplex * crossSpectrum(TGraph *gr1, TGraph *gr2, int & N, double & deltaT, double & waveOffset)
+{
+    int length=gr1->GetN();
+    int length2=gr2->GetN();
+
+    N=int(TMath::Power(2,int(TMath::Log2(length))+2));
+    if(N<length2)
+       N=int(TMath::Power(2,int(TMath::Log2(length2))+2));
+
+    int firstRealSamp=(N-length)/2;
+
+    double x,y;
+    Double_t x2,y2;
+    gr1->GetPoint(1,x2,y2);
+    gr1->GetPoint(0,x,y);
+    deltaT=x2-x;
+    double firstX=x;
+
+    gr2->GetPoint(0,x2,y2);
+    waveOffset=firstX-x2;
+
+    int newLength=(N/2)+1;
+    FFTWComplex *theFFT1 = (FFTWComplex*) thread_scratch.get(0, 2*newLength);
+    memcpy(theFFT1, scratchFFT(N,gr1->GetY(),length,firstRealSamp), newLength*sizeof(FFTWComplex));
+    FFTWComplex *theFFT2 = scratchFFT(N,gr2->GetY(),std::min(length2,N-firstRealSamp),firstRealSamp);
+
+    int no2=N>>1;
+    for(int i=0;i<newLength;i++) {
+	double reFFT1=theFFT1[i].re;
+	double imFFT1=theFFT1[i].im;
+	double reFFT2=theFFT2[i].re;
+	double imFFT2=theFFT2[i].im;
+
+	theFFT1[i].re=(reFFT1*reFFT2+imFFT1*imFFT2)/double(no2/2);
+	theFFT1[i].im=(imFFT1*reFFT2-reFFT1*imFFT2)/double(no2/2);
+    }
+
+    return theFFT1;
+}
+
+
+/* Inverse FFT of the length N cross spectrum X, zero-padded to N*upsample (so the
+ * correlation is band-limited interpolated) and scaled to match the
+ * length N inverse. Returns this thread's scratch real array of N*upsample. */
+static double * upsampledInverse(int N, const FFTWComplex * X, int upsample)
+{
+    int M=N*upsample;
+    const FFTCacheEntry & cache = thread_cache.get(M);
+    FFTWComplex *Y = (FFTWComplex*) cache.X;
+    memcpy(Y, X, (N/2+1)*sizeof(FFTWComplex));
+    memset(Y+N/2+1, 0, (M/2-N/2)*sizeof(FFTWComplex));
+
+    //the Nyquist bin is really half positive and half negative frequency
+    if(upsample>1) {
+      Y[N/2].re/=2;
+      Y[N/2].im/=2;
+    }
+
+    double *corVals=scratchInvFFT(M);
+    for(int i=0;i<M;i++) {
+      corVals[i]*=upsample;
+    }
+    return corVals;
+}
+
+
+TGraph *FFTtools::getUpsampledCorrelationGraph(TGraph *gr1, TGraph *gr2, Int_t upsample, Int_t *zeroOffset, TGraph *out)
+{
+    if(upsample<1) upsample=1;
+
+    int N;
+    double deltaT, waveOffset;
+    FFTWComplex *X = crossSpectrum(gr1,gr2,N,deltaT,waveOffset);
+
+    int M=N*upsample;
+    double fineDeltaT=deltaT/upsample;
+    if(zeroOffset) {
+       *zeroOffset=M/2;
+       (*zeroOffset)+=Int_t(waveOffset/fineDeltaT);
+    }
+
+    double *corVals=upsampledInverse(N,X,upsample);
+
+    TGraph *grCor = outputGraph(out,M);
+    double *xVals = grCor->GetX();
+    double *yVals = grCor->GetY();
+    for(int j=0;j<M;j++) {
+      int lag=j-(M/2);
+      xVals[j]=(lag*fineDeltaT)+waveOffset;
+      yVals[j]=corVals[(lag+M)%M];
+    }
+
+    return grCor;
+}
+
+
+/* The band-limited correlation at fractional lag tau (in samples) from its length N cross spectrum X. */
+static double correlationAtLag(int N, const FFTWComplex * X, double tau)
+{
+    std::complex<double> step = std::polar(1.,2*TMath::Pi()*tau/N);
+    std::complex<double> phase = step;
+    double sum = X[0].re;
+    for(int k=1;k<N/2;k++) {
+      sum += 2*(X[k].re*phase.real() - X[k].im*phase.imag());
+      phase *= step;
+    }
+    sum += X[N/2].re*cos(TMath::Pi()*tau);
+    return sum/N;
+}
+
+
+Double_t FFTtools::getCorrelationDelay(TGraph *gr1, TGraph *gr2, Int_t upsample, Int_t window, bool absolute, Double_t *peak)
+{
+    if(upsample<1) upsample=1;
+
+    int N;
+    double deltaT, waveOffset;
+    FFTWComplex *X = crossSpectrum(gr1,gr2,N,deltaT,waveOffset);
+
+    //with a window, find the peak on the plain correlation and refine only around it, otherwise upsample everything
+    int coarse=window>0 ? 1 : upsample;
+    int M=N*coarse;
+    double *corVals=upsampledInverse(N,X,coarse);
+
+    int imax=0;
+    double vmax=absolute ? fabs(corVals[0]) : corVals[0];
+    for(int i=1;i<M;i++) {
+      double v=absolute ? fabs(corVals[i]) : corVals[i];
+      if(v>vmax) {
+	vmax=v;
+	imax=i;
+      }
+    }
+
+    //on a grid of spacing 1/upsample samples, the values around the peak
+    double lag=(imax<M/2 ? imax : imax-M)/double(coarse);
+    double before, after;
+    if(coarse==1 && upsample>1) {
+      //evaluate only the window around the coarse peak, at upsample times the resolution
+      int nfine=window*upsample;
+      double best=vmax;
+      double best_tau=lag;
+      double centre=lag;
+      for(int j=-nfine;j<=nfine;j++) {
+	if(!j) continue;
+	double tau=centre+double(j)/upsample;
+	double v=correlationAtLag(N,X,tau);
+	if(absolute) v=fabs(v);
+	if(v>best) {
+	  best=v;
+	  best_tau=tau;
+	}
+      }
+      lag=best_tau;
+      vmax=best;
+      before=correlationAtLag(N,X,lag-1./upsample);
+      after=correlationAtLag(N,X,lag+1./upsample);
+      if(absolute) {
+	before=fabs(before);
+	after=fabs(after);
+      }
+    }
+    else {
+      before=corVals[(imax+M-1)%M];
+      after=corVals[(imax+1)%M];
+      if(absolute) {
+	before=fabs(before);
+	after=fabs(after);
+      }
+    }
+
+    //parabola through the three points around the peak
+    double denom=before-2*vmax+after;
+    double shift=denom<0 ? 0.5*(before-after)/denom : 0;
+    if(peak) *peak=vmax-0.25*(before-after)*shift;
+
+    return (lag+shift/upsample)*deltaT+waveOffset;
+}
+
+/* Finds the (up to) k highest local maxima of the circular correlation
+ * corVals (of length L, lag l at index (l+L)%L) with lags in [lo,hi],
+ * highest first. Neighbours outside [lo,hi] don't count, unless that's
+ * the whole circle. */
+static int topPeaks(int L, const double * corVals, int lo, int hi, int k, FFTtools::CorrelationPeak * peaks)
+{
+  if (hi - lo + 1 > L) hi = lo + L - 1;
+  bool whole = hi - lo + 1 == L;
+
+  int npeaks = 0;
+  for (int lag = lo; lag <= hi; lag++)
+  {
+    double v = corVals[(lag+L)%L];
+    double before = corVals[(lag-1+L)%L];
+    double after = corVals[(lag+1+L)%L];
+
+    //a flat top counts at its first sample, like getPeakBin
+    if ((lag > lo || whole) && before >= v) continue;
+    if ((lag < hi || whole) && after > v) continue;
+
+    //insert in order
+    if (npeaks == k && v <= peaks[k-1].value) continue;
+    int j = npeaks < k ? npeaks++ : k-1;
+    for (; j > 0 && peaks[j-1].value < v; j--)
+    {
+      peaks[j] = peaks[j-1];
+    }
+
+    //parabola through the three points around the peak
+    double denom = before - 2*v + after;
+    double shift = denom < 0 ? 0.5*(before-after)/denom : 0;
+    if (shift > 0.5 || shift < -0.5) shift = 0; //only happens at the edges of the range
+    peaks[j].lag = lag;
+    peaks[j].value = v;
+    peaks[j].position = lag + shift;
+  }
+
+  //completely flat, so just take the first sample, like getPeakBin would
+  if (!npeaks && hi >= lo)
+  {
+    peaks[0].lag = lo;
+    peaks[0].value = corVals[(lo+L)%L];
+    peaks[0].position = lo;
+    npeaks = 1;
+  }
+
+  return npeaks;
+}
+
+
+int FFTtools::getCorrelationPeaks(int length, const FFTWComplex * A, const FFTWComplex * B, int k, CorrelationPeak * peaks, int lagMin, int lagMax)
+{
+  if (k < 1) return 0;
+
+  int newLength = (length/2)+1;
+  const FFTCacheEntry & cache = thread_cache.get(length);
+  FFTWComplex * X = (FFTWComplex*) cache.X;
+  for (int i = 0; i < newLength; i++)
+  {
+    double reFFT1=A[i].re;
+    double imFFT1=A[i].im;
+    double reFFT2=B[i].re;
+    double imFFT2=B[i].im;
+
+    X[i].re=reFFT1*reFFT2+imFFT1*imFFT2;
+    X[i].im=imFFT1*reFFT2-reFFT1*imFFT2;
+  }
+  double * corVals = scratchInvFFT(length);
+
+  int lo = std::max(lagMin, -(length/2));
+  int hi = std::min(lagMax, length - length/2 - 1);
+  return topPeaks(length, corVals, lo, hi, k, peaks);
+}
+
+
+int FFTtools::getCorrelationPeaks(TGraph * gr1, TGraph * gr2, int k, CorrelationPeak * peaks, int lagMin, int lagMax)
+{
+  if (k < 1) return 0;
+
+  int N;
+  double deltaT, waveOffset;
+  FFTWComplex * X = crossSpectrum(gr1,gr2,N,deltaT,waveOffset);
+  const FFTCacheEntry & cache = thread_cache.get(N);
+  memcpy(cache.X, X, (N/2+1)*sizeof(FFTWComplex));
+  double * corVals = scratchInvFFT(N);
+
+  int lo = std::max(lagMin, -(N/2));
+  int hi = std::min(lagMax, N/2 - 1);
+  return topPeaks(N, corVals, lo, hi, k, peaks);
+}
+
 double *FFTtools::getCorrelation(int length,float *oldY1, float *oldY2) 
 {
-    double *newY1 = new double [length];
-    double *newY2 = new double [length];
+    float *theCorrF = new float [length];
+    getCorrelation(length, oldY1, oldY2, theCorrF);
+
+    double *theCorr = new double [length];
     for(int i=0;i<length;i++) {
-	newY1[i]=(double)oldY1[i];
-	newY2[i]=(double)oldY2[i];
+	theCorr[i]=theCorrF[i];
     }
-
-    double *theCorr=getCorrelation(length,newY1,newY2);
-    delete [] newY1;
-    delete [] newY2;
+    delete [] theCorrF;
     return theCorr;
 }
 
 
+void FFTtools::getCorrelation(int length, const float *oldY1, const float *oldY2, float * out)
+{
+    int newLength=(length/2)+1;
+
+    // the first spectrum (and the output) use the cache's buffers, and the second this thread's scratch (a complex<float> is the size of a double)
+    const FFTCacheEntryF & cache = thread_cache_f.get(length);
+    std::complex<float> * theFFT1 = (std::complex<float> *) cache.X;
+    std::complex<float> * theFFT2 = (std::complex<float> *) thread_scratch.get(0, newLength);
+
+    memcpy(cache.x, oldY1, length * sizeof(float));
+    execute(cache, cache.x, cache.X);
+    memcpy(cache.x, oldY2, length * sizeof(float));
+    execute(cache, cache.x, (fftwf_complex*) theFFT2);
+
+    int no2=length>>1;
+    float scale = 1.f/float(no2/2);
+    for(int i=0;i<newLength;i++) {
+	theFFT1[i] *= std::conj(theFFT2[i]) * scale;
+    }
+
+    execute(cache, cache.X, cache.x);
+    for (int i = 0; i < length; i++) {
+	out[i] = cache.x[i] / length;
+    }
+}
+
+
 double *FFTtools::getCorrelation(int length,double *oldY1, double *oldY2) 
 {
 
@@ -898,6 +2542,35 @@ double *FFTtools::getCorrelation(int length,double *oldY1, double *oldY2)
 }
 
 
+double *FFTtools::getCorrelation(int length, const double *oldY1, const double *oldY2, Workspace & ws)
+{
+    int newLength=(length/2)+1;
+    double *theOutput=ws.allocDouble(length);
+    FFTWComplex *theFFT1=ws.allocComplex(newLength);
+    FFTWComplex *theFFT2=ws.allocComplex(newLength);
+
+    //the aligned doFFT needs aligned input, so go through the output array
+    memcpy(theOutput, oldY1, length * sizeof(double));
+    doFFT(length,theOutput,theFFT1);
+    memcpy(theOutput, oldY2, length * sizeof(double));
+    doFFT(length,theOutput,theFFT2);
+
+    int no2=length>>1;
+    for(int i=0;i<newLength;i++) {
+	double reFFT1=theFFT1[i].re;
+	double imFFT1=theFFT1[i].im;
+	double reFFT2=theFFT2[i].re;
+	double imFFT2=theFFT2[i].im;
+
+	theFFT1[i].re=(reFFT1*reFFT2+imFFT1*imFFT2)/double(no2/2);
+	theFFT1[i].im=(imFFT1*reFFT2-reFFT1*imFFT2)/double(no2/2);
+    }
+
+    doInvFFTClobber(length,theFFT1,theOutput);
+    return theOutput;
+}
+
+
 double *FFTtools::getCorrelation(TGraph *gr1, TGraph *gr2,int firstIndex,int lastIndex) {
     int tempLength=gr1->GetN();
     if(firstIndex<0 || lastIndex>tempLength) return 0;
@@ -932,46 +2605,55 @@ TGraph *FFTtools::makeInverseInverseSpectrum(TGraph *grWave) {
 
 }
 
-TGraph *FFTtools::getHilbertTransform(TGraph *grWave)
+/* Hilbert transform of y into this thread's scratch array (see scratchInvFFT) */
+static double * hilbertScratch(int length, const double * y)
 {
-  double *oldY = grWave->GetY();
-  double *oldX = grWave->GetX();
-  //    double deltaT=oldX[1]-oldX[0];
-  int length=grWave->GetN();
-  FFTWComplex *theFFT=doFFT(length,oldY);  
+  FFTWComplex *theFFT=scratchFFT(length,y,length);
   int newLength=(length/2)+1;
   for(int i=0;i<newLength;i++) {
     double tempIm=theFFT[i].im;
     theFFT[i].im=theFFT[i].re;
     theFFT[i].re=-1*tempIm;
   }
-  double *hilbert = doInvFFT(length,theFFT);
-  
-  TGraph *grHilbert = new TGraph(length,oldX,hilbert);
-  delete [] hilbert;
-  delete [] theFFT;
+  return scratchInvFFT(length);
+}
+
+void FFTtools::getHilbertTransform(int length, const double *y, double *out)
+{
+  memcpy(out, hilbertScratch(length,y), length*sizeof(double));
+}
+
+TGraph *FFTtools::getHilbertTransform(TGraph *grWave, TGraph *out)
+{
+  double *oldY = grWave->GetY();
+  double *oldX = grWave->GetX();
+  int length=grWave->GetN();
+  double *hilbert = hilbertScratch(length,oldY);
+
+  TGraph *grHilbert = outputGraph(out,length);
+  if (grHilbert != grWave) memcpy(grHilbert->GetX(), oldX, length*sizeof(double));
+  memcpy(grHilbert->GetY(), hilbert, length*sizeof(double));
 
   return grHilbert;
 }
 
 
-TGraph *FFTtools::getHilbertEnvelope(TGraph *grWave)
+void FFTtools::getHilbertEnvelope(int length, const double *realY, double *out)
+{
+  double *hilY = hilbertScratch(length,realY);
+  for(int i=0;i<length;i++) {
+    out[i]=TMath::Sqrt(realY[i]*realY[i] + hilY[i]*hilY[i]);
+  }
+}
+
+TGraph *FFTtools::getHilbertEnvelope(TGraph *grWave, TGraph *out)
 {
-  //  cout << "Here" << endl;
   double *realY = grWave->GetY();
   double *x = grWave->GetX();
-  TGraph *grHilbert = FFTtools::getHilbertTransform(grWave);
-  double *hilY=grHilbert->GetY();
   int length=grWave->GetN();
-  Double_t *envY= new Double_t[length];
-  for(int i=0;i<length;i++) {
-
-    envY[i]=TMath::Sqrt(realY[i]*realY[i] + hilY[i]*hilY[i]);
-    //    cout << i << "\t" << envY[i] << endl;
-  }
-  TGraph *grEnvelope = new TGraph(length,x,envY);
-  delete [] envY;
-  delete grHilbert;
+  TGraph *grEnvelope = outputGraph(out,length);
+  if (grEnvelope != grWave) memcpy(grEnvelope->GetX(), x, length*sizeof(double));
+  getHilbertEnvelope(length, realY, grEnvelope->GetY());
   return grEnvelope;
 }
 
@@ -1008,137 +2690,145 @@ TGraph *FFTtools::getBoxCar(TGraph *grWave, Int_t halfWidth)
   
 }
 
-TGraph *FFTtools::makePowerSpectrumVoltsSecondsBartlett(TGraph *grWave) {
-  Double_t *oldY=grWave->GetY();
-  Double_t *t = grWave->GetX();
-  Int_t numPoints = grWave->GetN();
-  Double_t *newY = new Double_t [numPoints];
-  for(int i=0;i<numPoints;i++) {
-    newY[i]=oldY[i]*bartlettWindow(i,numPoints);
-  }
-  TGraph *grNew = new TGraph(numPoints,t,newY);
-  delete [] newY;
-  return makePowerSpectrumVoltsSeconds(grNew);
-}
-
+/* Power spectrum in V^2 s / MHz (or dB of that) of y (nin samples at offset, in a zero-padded array of length samples) */
+static TGraph * powerSpectrumVoltsSeconds(int length, const double * y, int nin, int offset, double deltaT, bool dB, TGraph * out)
+{
+    FFTWComplex *theFFT=scratchFFT(length,y,nin,offset);
 
-TGraph *FFTtools::makePowerSpectrum(TGraph *grWave) {
+    int newLength=(length/2)+1;
 
-    double *oldY = grWave->GetY();
-    double *oldX = grWave->GetX();
-    double deltaT=oldX[1]-oldX[0];
-    int length=grWave->GetN();
-    FFTWComplex *theFFT=doFFT(length,oldY);
+    TGraph *grPower = outputGraph(out,newLength);
+    double *newY = grPower->GetY();
+    double *newX = grPower->GetX();
 
-    int newLength=(length/2)+1;
-    double *newY = new double [newLength];
-    double *newX = new double [newLength];
+    //    double fMax = 1/(2*deltaT);  // In Hz
+    double deltaF=1/(deltaT*length); //Hz
+    deltaF*=1e-6; //MHz
 
-    //    double fMax = 1/(2*deltaT);  // In GHz
-    double deltaF=1/(deltaT*length);
 
     double tempF=0;
     for(int i=0;i<newLength;i++) {
-       float power=pow(getAbs(theFFT[i]),2);
+      if (dB) {
+       double logpower;
+       double power=pow(FFTtools::getAbs(theFFT[i]),2);
 	if(i>0 && i<newLength-1) power*=2; //account for symmetry
-	power/=length;
-	//	if (power>0 ) power=10*TMath::Log10(power);
-	//	else power=-100; //no reason
-	newX[i]=tempF;
+	power*=deltaT/(length); //For time-integral squared amplitude
+	power/=deltaF;//Just to normalise bin-widths
+
+	if (power>0 ){
+	  logpower=10*TMath::Log10(power);
+	}
+	else{
+          logpower=-1000; //no reason
+	}
+	newY[i]=logpower;
+      }
+      else {
+      float power=pow(FFTtools::getAbs(theFFT[i]),2);
+      	if(i>0 && i<newLength-1) power*=2; //account for symmetry
+	power*=deltaT/(length); //For time-integral squared amplitude
+	power/=deltaF;//Just to normalise bin-widths
+	//Ends up the same as dt^2, need to integrate the power (multiply by df)
+	//to get a meaningful number out.
 	newY[i]=power;
+      }
+
+	newX[i]=tempF;
 	tempF+=deltaF;
     }
 
-
-
-    TGraph *grPower = new TGraph(newLength,newX,newY);
-    delete [] theFFT;
-    delete [] newY;
-    delete [] newX;
     return grPower;
-
 }
 
+TGraph *FFTtools::makePowerSpectrumVoltsSecondsBartlett(TGraph *grWave, TGraph *out) {
+  Double_t *oldY=grWave->GetY();
+  Double_t *t = grWave->GetX();
+  Int_t numPoints = grWave->GetN();
+  Double_t *newY = thread_scratch.get(0,numPoints);
+  for(int i=0;i<numPoints;i++) {
+    newY[i]=oldY[i]*bartlettWindow(i,numPoints);
+  }
+  return powerSpectrumVoltsSeconds(numPoints,newY,numPoints,0,t[1]-t[0],false,out);
+}
 
 
-TGraph *FFTtools::makePowerSpectrumPeriodogram(TGraph *grWave) {
+TGraph *FFTtools::makePowerSpectrum(TGraph *grWave, TGraph *out) {
 
     double *oldY = grWave->GetY();
     double *oldX = grWave->GetX();
     double deltaT=oldX[1]-oldX[0];
     int length=grWave->GetN();
-    FFTWComplex *theFFT=doFFT(length,oldY);
-    
-    int newLength=(length/2)+1;
+    FFTWComplex *theFFT=scratchFFT(length,oldY,length);
 
-    double *newY = new double [newLength];
-    double *newX = new double [newLength];
+    int newLength=(length/2)+1;
+    TGraph *grPower = outputGraph(out,newLength);
+    double *newY = grPower->GetY();
+    double *newX = grPower->GetX();
 
-    //    double fMax = 1/(2*deltaT);  // In Hz
+    //    double fMax = 1/(2*deltaT);  // In GHz
     double deltaF=1/(deltaT*length);
 
     double tempF=0;
     for(int i=0;i<newLength;i++) {
        float power=pow(getAbs(theFFT[i]),2);
 	if(i>0 && i<newLength-1) power*=2; //account for symmetry
-	power/=double(length*length);
+	power/=length;
 	//	if (power>0 ) power=10*TMath::Log10(power);
 	//	else power=-100; //no reason
 	newX[i]=tempF;
 	newY[i]=power;
 	tempF+=deltaF;
     }
-
-    TGraph *grPower = new TGraph(newLength,newX,newY);
-    delete [] theFFT;
-    delete [] newY;
-    delete [] newX;
     return grPower;
 
 }
 
-TGraph *FFTtools::makePowerSpectrumVoltsSeconds(TGraph *grWave) {
+
+
+TGraph *FFTtools::makePowerSpectrumPeriodogram(TGraph *grWave, TGraph *out) {
 
     double *oldY = grWave->GetY();
     double *oldX = grWave->GetX();
     double deltaT=oldX[1]-oldX[0];
     int length=grWave->GetN();
-    FFTWComplex *theFFT=doFFT(length,oldY);
-
+    FFTWComplex *theFFT=scratchFFT(length,oldY,length);
+    
     int newLength=(length/2)+1;
 
-    double *newY = new double [newLength];
-    double *newX = new double [newLength];
+    TGraph *grPower = outputGraph(out,newLength);
 
-    //    double fMax = 1/(2*deltaT);  // In Hz
-    double deltaF=1/(deltaT*length); //Hz
-    deltaF*=1e-6; //MHz
+    double *newY = grPower->GetY();
+
+    double *newX = grPower->GetX();
 
+    //    double fMax = 1/(2*deltaT);  // In Hz
+    double deltaF=1/(deltaT*length);
 
     double tempF=0;
     for(int i=0;i<newLength;i++) {
-      float power=pow(getAbs(theFFT[i]),2);
-      	if(i>0 && i<newLength-1) power*=2; //account for symmetry
-	power*=deltaT/(length); //For time-integral squared amplitude
-	power/=deltaF;//Just to normalise bin-widths
-	//Ends up the same as dt^2, need to integrate the power (multiply by df)
-	//to get a meaningful number out.
-
+       float power=pow(getAbs(theFFT[i]),2);
+	if(i>0 && i<newLength-1) power*=2; //account for symmetry
+	power/=double(length*length);
+	//	if (power>0 ) power=10*TMath::Log10(power);
+	//	else power=-100; //no reason
 	newX[i]=tempF;
 	newY[i]=power;
 	tempF+=deltaF;
     }
+    return grPower;
 
+}
 
-    TGraph *grPower = new TGraph(newLength,newX,newY);
-    delete [] theFFT;
-    delete [] newY;
-    delete [] newX;
-    return grPower;
+TGraph *FFTtools::makePowerSpectrumVoltsSeconds(TGraph *grWave, TGraph *out) {
 
+    double *oldY = grWave->GetY();
+    double *oldX = grWave->GetX();
+    double deltaT=oldX[1]-oldX[0];
+    int length=grWave->GetN();
+    return powerSpectrumVoltsSeconds(length,oldY,length,0,deltaT,false,out);
 }
 
-TGraph *FFTtools::makePowerSpectrumMilliVoltsNanoSeconds(TGraph *grWave) {
+TGraph *FFTtools::makePowerSpectrumMilliVoltsNanoSeconds(TGraph *grWave, TGraph *out) {
 
 //   double *oldY = grWave->GetY(); //in millivolts
 //   double *oldX = grWave->GetX(); //in nanoseconds
@@ -1194,12 +2884,15 @@ TGraph *FFTtools::makePowerSpectrumMilliVoltsNanoSeconds(TGraph *grWave) {
   double *oldX = grWave->GetX();
   double deltaT=oldX[1]-oldX[0];
   int length=grWave->GetN();
-  FFTWComplex *theFFT=doFFT(length,oldY);
+  FFTWComplex *theFFT=scratchFFT(length,oldY,length);
   
   int newLength=(length/2)+1;
   
-  double *newY = new double [newLength];
-  double *newX = new double [newLength];
+  TGraph *grPower = outputGraph(out,newLength);
+  
+  double *newY = grPower->GetY();
+  
+  double *newX = grPower->GetX();
   
   //    double fMax = 1/(2*deltaT);  // In Hz
   double deltaF=1/(deltaT*length); //Hz
@@ -1222,28 +2915,26 @@ TGraph *FFTtools::makePowerSpectrumMilliVoltsNanoSeconds(TGraph *grWave) {
     newY[i]=power;
     tempF+=deltaF;
   }
-
-  TGraph *grPower = new TGraph(newLength,newX,newY);
-  delete [] theFFT;
-  delete [] newY;
-  delete [] newX;
   return grPower;
 
 }
 
 
-TGraph *FFTtools::makePowerSpectrumMilliVoltsNanoSecondsdB(TGraph *grWave)
+TGraph *FFTtools::makePowerSpectrumMilliVoltsNanoSecondsdB(TGraph *grWave, TGraph *out)
 {
     double *oldY = grWave->GetY();
     double *oldX = grWave->GetX();
     double deltaT=oldX[1]-oldX[0];
     int length=grWave->GetN();
-    FFTWComplex *theFFT=doFFT(length,oldY);
+    FFTWComplex *theFFT=scratchFFT(length,oldY,length);
 
     int newLength=(length/2)+1;
 
-    double *newY = new double [newLength];
-    double *newX = new double [newLength];
+    TGraph *grPower = outputGraph(out,newLength);
+
+    double *newY = grPower->GetY();
+
+    double *newX = grPower->GetX();
 
     //    double fMax = 1/(2*deltaT);  // In Hz
     double deltaF=1/(deltaT*length); //Hz
@@ -1266,96 +2957,49 @@ TGraph *FFTtools::makePowerSpectrumMilliVoltsNanoSecondsdB(TGraph *grWave)
 	newY[i]=power;
 	tempF+=deltaF;
     }
-
-
-    TGraph *grPower = new TGraph(newLength,newX,newY);
-    delete [] theFFT;
-    delete [] newY;
-    delete [] newX;
     return grPower;
 
 
 }
 
-TGraph *FFTtools::makePowerSpectrumVoltsSecondsdB(TGraph *grWave) {
+TGraph *FFTtools::makePowerSpectrumVoltsSecondsdB(TGraph *grWave, TGraph *out) {
 
     double *oldY = grWave->GetY();
     double *oldX = grWave->GetX();
     double deltaT=oldX[1]-oldX[0];
     int length=grWave->GetN();
-    FFTWComplex *theFFT=doFFT(length,oldY);
-
-    int newLength=(length/2)+1;
-
-    double *newY = new double [newLength];
-    double *newX = new double [newLength];
-
-    //    double fMax = 1/(2*deltaT);  // In Hz
-    double deltaF=1/(deltaT*length); //Hz
-    deltaF*=1e-6; //MHz
-
-
-    double tempF=0;
-    for(int i=0;i<newLength;i++) {
-       double logpower;
-       double power=pow(getAbs(theFFT[i]),2);
-	if(i>0 && i<newLength-1) power*=2; //account for symmetry
-	power*=deltaT/(length); //For time-integral squared amplitude
-	power/=deltaF;//Just to normalise bin-widths
-	//Ends up the same as dt^2, need to integrate the power (multiply by df)
-	//to get a meaningful number out.	
-	
-	if (power>0 ){
-	  logpower=10*TMath::Log10(power);
-	}
-	else{
-          logpower=-1000; //no reason
-	}	
-
-	newX[i]=tempF;
-	newY[i]=logpower;
-	tempF+=deltaF;
-    }
-
-
-    TGraph *grPower = new TGraph(newLength,newX,newY);
-    delete [] theFFT;
-    delete [] newY;
-    delete [] newX;
-    return grPower;
-
-
+    return powerSpectrumVoltsSeconds(length,oldY,length,0,deltaT,true,out);
 }
 
-TGraph *FFTtools::makePowerSpectrumVoltsSecondsPadded(TGraph *grWave, Int_t padFactor) {
+TGraph *FFTtools::makePowerSpectrumVoltsSecondsPadded(TGraph *grWave, Int_t padFactor, TGraph *out) {
 
-   TGraph *grPad=padWave(grWave,padFactor);
-   TGraph *grPower=makePowerSpectrumVoltsSeconds(grPad);
-   delete grPad;
-   return grPower;
+   //same padding as padWave
+   int realLength = grWave->GetN();
+   double deltaT = grWave->GetX()[1]-grWave->GetX()[0];
+   return powerSpectrumVoltsSeconds(realLength*padFactor,grWave->GetY(),realLength,(realLength*(padFactor-1))/2,deltaT,false,out);
    
 }
 
 
-TGraph *FFTtools::makePowerSpectrumVoltsSecondsPaddeddB(TGraph *grWave, Int_t padFactor) {
-   TGraph *grPad=padWave(grWave,padFactor);
-   TGraph *grPower=makePowerSpectrumVoltsSecondsdB(grPad);
-   delete grPad;
-   return grPower;
+TGraph *FFTtools::makePowerSpectrumVoltsSecondsPaddeddB(TGraph *grWave, Int_t padFactor, TGraph *out) {
+   int realLength = grWave->GetN();
+   double deltaT = grWave->GetX()[1]-grWave->GetX()[0];
+   return powerSpectrumVoltsSeconds(realLength*padFactor,grWave->GetY(),realLength,(realLength*(padFactor-1))/2,deltaT,true,out);
 }
 
 
-TGraph *FFTtools::makeRawPowerSpectrum(TGraph *grWave) {
+TGraph *FFTtools::makeRawPowerSpectrum(TGraph *grWave, TGraph *out) {
 
     double *oldY = grWave->GetY();
     double *oldX = grWave->GetX();
     double deltaT=oldX[1]-oldX[0];
     int length=grWave->GetN();
-    FFTWComplex *theFFT=doFFT(length,oldY);
+    FFTWComplex *theFFT=scratchFFT(length,oldY,length);
 
     int newLength=(length/2)+1;
-    double *newY = new double [newLength];
-    double *newX = new double [newLength];
+    TGraph *grPower = outputGraph(out,newLength);
+    double *newY = grPower->GetY();
+    double *newX = grPower->GetX();
 
     double deltaF=1/(deltaT*length);
     //    double fMax = 1/(2*deltaT);  // In GHz
@@ -1368,12 +3012,6 @@ TGraph *FFTtools::makeRawPowerSpectrum(TGraph *grWave) {
       newY[i]=power;
       tempF+=deltaF;
     }
-
-
-    TGraph *grPower = new TGraph(newLength,newX,newY);
-    delete [] theFFT;
-    delete [] newY;
-    delete [] newX;
     return grPower;
 
 }
@@ -1891,14 +3529,14 @@ TGraph *FFTtools::getDerivative(TGraph *grIn)
 
 }
 
-TGraph *FFTtools::simplePassBandFilter(TGraph *grWave, Double_t minFreq, Double_t maxFreq)
+TGraph *FFTtools::simplePassBandFilter(TGraph *grWave, Double_t minFreq, Double_t maxFreq, TGraph *out)
 {
 
     double *oldY = grWave->GetY();
     double *oldX = grWave->GetX();
     double deltaT=oldX[1]-oldX[0];
     int length=grWave->GetN();
-    FFTWComplex *theFFT=doFFT(length,oldY);
+    FFTWComplex *theFFT=scratchFFT(length,oldY,length);
 
     int newLength=(length/2)+1;
 
@@ -1918,24 +3556,24 @@ TGraph *FFTtools::simplePassBandFilter(TGraph *grWave, Double_t minFreq, Double_
       tempF+=deltaF;
     }
 
-    double *filteredVals = doInvFFT(length,theFFT);
+    double *filteredVals = scratchInvFFT(length);
 
 
-    TGraph *grFiltered = new TGraph(length,oldX,filteredVals);
-    delete [] theFFT;
-    delete [] filteredVals;
+    TGraph *grFiltered = outputGraph(out,length);
+    if (grFiltered != grWave) memcpy(grFiltered->GetX(), oldX, length*sizeof(double));
+    memcpy(grFiltered->GetY(), filteredVals, length*sizeof(double));
     return grFiltered;
 
 }
 
-TGraph *FFTtools::simpleNotchFilter(TGraph *grWave, Double_t minFreq, Double_t maxFreq)
+TGraph *FFTtools::simpleNotchFilter(TGraph *grWave, Double_t minFreq, Double_t maxFreq, TGraph *out)
 {
 
     double *oldY = grWave->GetY();
     double *oldX = grWave->GetX();
     double deltaT=oldX[1]-oldX[0];
     int length=grWave->GetN();
-    FFTWComplex *theFFT=doFFT(length,oldY);
+    FFTWComplex *theFFT=scratchFFT(length,oldY,length);
 
     int newLength=(length/2)+1;
 
@@ -1955,12 +3593,12 @@ TGraph *FFTtools::simpleNotchFilter(TGraph *grWave, Double_t minFreq, Double_t m
       tempF+=deltaF;
     }
 
-    double *filteredVals = doInvFFT(length,theFFT);
+    double *filteredVals = scratchInvFFT(length);
 
 
-    TGraph *grFiltered = new TGraph(length,oldX,filteredVals);
-    delete [] theFFT;
-    delete [] filteredVals;
+    TGraph *grFiltered = outputGraph(out,length);
+    if (grFiltered != grWave) memcpy(grFiltered->GetX(), oldX, length*sizeof(double));
+    memcpy(grFiltered->GetY(), filteredVals, length*sizeof(double));
     return grFiltered;
 
 }
@@ -1991,14 +3629,14 @@ TGraph *FFTtools::cropWave(TGraph *grWave, Double_t minTime, Double_t maxTime)
 }
 
 
-TGraph *FFTtools::multipleSimpleNotchFilters(TGraph *grWave, Int_t numNotches, Double_t minFreq[], Double_t maxFreq[])
+TGraph *FFTtools::multipleSimpleNotchFilters(TGraph *grWave, Int_t numNotches, Double_t minFreq[], Double_t maxFreq[], TGraph *out)
 {
 
     double *oldY = grWave->GetY();
     double *oldX = grWave->GetX();
     double deltaT=oldX[1]-oldX[0];
     int length=grWave->GetN();
-    FFTWComplex *theFFT=doFFT(length,oldY);
+    FFTWComplex *theFFT=scratchFFT(length,oldY,length);
 
     int newLength=(length/2)+1;
 
@@ -2021,12 +3659,12 @@ TGraph *FFTtools::multipleSimpleNotchFilters(TGraph *grWave, Int_t numNotches, D
       tempF+=deltaF;
     }
 
-    double *filteredVals = doInvFFT(length,theFFT);
+    double *filteredVals = scratchInvFFT(length);
 
 
-    TGraph *grFiltered = new TGraph(length,oldX,filteredVals);
-    delete [] theFFT;
-    delete [] filteredVals;
+    TGraph *grFiltered = outputGraph(out,length);
+    if (grFiltered != grWave) memcpy(grFiltered->GetX(), oldX, length*sizeof(double));
+    memcpy(grFiltered->GetY(), filteredVals, length*sizeof(double));
     return grFiltered;
 
 
@@ -2300,9 +3938,26 @@ TGraph *FFTtools::getConvolution(TGraph *grA, TGraph *grB)
     //    std::cout << i << "\t" << indA << "\t" << indB <<  "\t" << A[i] << "\t" << B[i] << "\n";
   }
   
-  Int_t numFreqs=(numPoints/2)+1;
-  FFTWComplex *fftA=doFFT(numPoints,A);
-  FFTWComplex *fftB=doFFT(numPoints,B);
+  //If the length isn't fast and padding to a fast length is on, zero-pad to one long enough that
+  //nothing wraps around, then wrap the (linear) result around by hand so it's the same circular convolution
+  Int_t numFFT=numPoints;
+  if(pad_to_fast_length && nextFastLength(numPoints)!=numPoints) {
+    numFFT=nextFastLength(2*numPoints-1);
+  }
+  if(numFFT!=numPoints) {
+    Double_t *padA = new Double_t[numFFT]();
+    Double_t *padB = new Double_t[numFFT]();
+    memcpy(padA,A,numPoints*sizeof(Double_t));
+    memcpy(padB,B,numPoints*sizeof(Double_t));
+    delete [] A;
+    delete [] B;
+    A=padA;
+    B=padB;
+  }
+
+  Int_t numFreqs=(numFFT/2)+1;
+  FFTWComplex *fftA=doFFT(numFFT,A);
+  FFTWComplex *fftB=doFFT(numFFT,B);
   // FFTWComplex *fftAB= new FFTWComplex [numFreqs];
   Double_t freq=0;
   Double_t deltaF=1./(numPoints*deltaT);
@@ -2325,8 +3980,13 @@ TGraph *FFTtools::getConvolution(TGraph *grA, TGraph *grB)
   }
   
   // Double_t *AB=doInvFFT(numPoints,fftAB);
-  Double_t *AB=doInvFFT(numPoints,fftA);  
+  Double_t *AB=doInvFFT(numFFT,fftA);  
   Double_t *newAB = new Double_t[numPoints];
+  if(numFFT!=numPoints) {
+    for(int i=0;i+numPoints<2*numPoints-1;i++) {
+      AB[i]+=AB[i+numPoints];
+    }
+  }
   for(int i=0;i<numPoints;i++) {
     if(i<numPoints/2) {
       newAB[i]=AB[(numPoints/2)+i];
@@ -2440,12 +4100,9 @@ TGraph *FFTtools::correlateAndAverage(Int_t numGraphs, TGraph **grPtrPtr)
     TGraph *grB = grPtrPtr[graphNum];
     if(grB->GetN()<numPoints)
       numPoints=grB->GetN();
-    TGraph *grCorAB = FFTtools::getCorrelationGraph(grA,grB);
-
-    Int_t peakBin = FFTtools::getPeakBin(grCorAB);
-    //    Double_t *deltaTVals=grCorAB->GetX();
-    //    cout << peakBin << "\t" << grCorAB->GetN() << endl;
-    Int_t offset=peakBin-(grCorAB->GetN()/2);
+    CorrelationPeak peak;
+    FFTtools::getCorrelationPeaks(grA,grB,1,&peak);
+    Int_t offset=peak.lag;
     //    cout << deltaTVals[peakBin] << "\t" << safeTimeVals[offset] << endl;
  
     Double_t *aVolts = grA->GetY();
@@ -2467,7 +4124,6 @@ TGraph *FFTtools::correlateAndAverage(Int_t numGraphs, TGraph **grPtrPtr)
     TGraph *grComAB = new TGraph(numPoints,safeTimeVals,sumVolts);
 
     //    delete grB;
-    delete grCorAB;
     if(graphNum>1)
       delete grA;
     grA=grComAB;
@@ -2642,40 +4298,6 @@ void FFTtools::polySubtract(TGraph *g, int order)
 
 
 //___________________________________________//
-double * FFTtools::directConvolve(int N, const double * x, int M, const double *h,  double *y, int delay, DirectConvolveEdgeBehavior edge) 
-{
-
-
-  if (!y) y = new double[N]; 
-  double start_val = edge == ZEROES_OUTSIDE ? 0 : x[0]; 
-  double end_val = edge == ZEROES_OUTSIDE ? 0 : x[N-1]; 
-  for (int i = 0; i < N; i++) 
-  {
-    y[i] = 0; 
-    for (int j = delay-M/2; j < delay +(M+1)/2; j++) 
-    {
-      double X = 0;
-      if (i + j < 0) 
-      {
-        X = start_val ; 
-      }
-      else if ( i + j >= N) 
-      {
-        X = end_val; 
-      }
-      else 
-      {
-        X = x[i+j]; 
-      }
-
-      y[i] += X * h[delay + M/2+j]; 
-    }
-  }
-
-  return y; 
-}
-
-
 //___________________________________________//
 double FFTtools::randomRayleigh(double sigma, TRandom * rng)
 {
@@ -2789,6 +4411,62 @@ double FFTtools::evalEvenGraph(const TGraph * g, double t)
 
 
 
+//___________________________________________//
+float * FFTtools::FFTCorrelation(int length, const std::complex<float> * A, const std::complex<float> * B, std::complex<float> * work, int min_i, int max_i, int order)
+{
+
+  int fftlen = length/2 +1;
+  if (max_i <= 0 || max_i >= fftlen) max_i = fftlen-1;
+  if (min_i < 0) min_i = 0;
+
+  bool work_given = work;
+  if (!work)
+  {
+    work = new std::complex<float>[fftlen];
+  }
+
+  float rmsA = 0;
+  float rmsB = 0;
+  for(int i=0;i<fftlen;i++)
+  {
+    float weight = 1;
+
+    if (min_i > 0)
+    {
+      weight /= (1 + TMath::Power(double(min_i)/i,2*order));
+    }
+
+    if (max_i < fftlen - 1)
+    {
+      weight /=( 1 +TMath::Power(double(i)/max_i,2*order));
+    }
+
+    if (i > 0)  //don't add DC component to RMS!
+    {
+      rmsA += weight*std::norm(A[i]) * 2 / (float(length)*length);
+      rmsB += weight*std::norm(B[i]) * 2 / (float(length)*length);
+    }
+    work[i] = weight * A[i] * std::conj(B[i]) / float(length);
+  }
+
+  float *answer=FFTtools::doInvFFT(length,work);
+
+  float norm = (rmsA && rmsB) ? 1./(sqrt(rmsA*rmsB)) : 1;
+  for (int i = 0; i< length; i++)
+  {
+    answer[i] *=norm;
+  }
+
+  if (!work_given)
+  {
+    delete [] work;
+  }
+
+  return answer;
+
+}
+
+
 //___________________________________________//
 int FFTtools::saveWisdom(const char * file)
 {
@@ -2799,6 +4477,7 @@ int FFTtools::saveWisdom(const char * file)
   FILE* filePtr = fopen(file, "w");
   int retVal = 0;
   if(filePtr){
+    PlannerLock lock;
     fftw_export_wisdom_to_file(filePtr);
     retVal = 1;
     fclose(filePtr);
@@ -2822,6 +4501,7 @@ int FFTtools::loadWisdom(const char * file)
   FILE* filePtr = fopen(file, "r");
   int retVal = 0;
   if(filePtr){
+    PlannerLock lock;
     fftw_import_wisdom_from_file(filePtr);
     retVal = 1;
     fclose(filePtr);
@@ -2847,6 +4527,142 @@ int FFTtools::loadWisdom(const char * file)
 #endif
 
 
+#ifdef FFTTOOLS_SIMD_DISPATCH
+static int detectSimdWidth()
+{
+  __builtin_cpu_init(); // in case this is called from a static constructor, before libgcc's has run
+  return __builtin_cpu_supports("avx512f") ? 64 : __builtin_cpu_supports("avx2") ? 32 : 16;
+}
+#endif
+
+int FFTtools::simdWidth()
+{
+#ifdef FFTTOOLS_SIMD_DISPATCH
+  // detected once (thread-safely), since the kernels ask for every call
+  static const int width = detectSimdWidth();
+  return width;
+#else
+  return 0;
+#endif
+}
+
+
+/* The part of directConvolve where the kernel doesn't hang over either end of
+ * x: y[i] = sum_k h[k] * x[i+offset+k] for i in [first,last), with no checks, so it
+ * vectorizes (across outputs, so each one is summed in the same order as the
+ * edges are). With FFTTOOLS_SIMD_DISPATCH, that's done explicitly in the
+ * compiler's vector types, VB bytes of outputs at a time, instantiated for each
+ * instruction set's register width (gcc keeps wider vectors in memory). */
+#ifdef FFTTOOLS_SIMD_DISPATCH
+template <int VB, typename T>
+static inline __attribute__((always_inline)) int convolveInteriorVectors(int first, int last, const T * x, int offset, int M, const T * h, T * y)
+{
+  typedef T V __attribute__((vector_size(VB)));
+  const int n = VB / sizeof(T);
+  int i = first;
+  for (; i + n <= last; i += n)
+  {
+    V acc = V();
+    V vx;
+    for (int k = 0; k < M; k++)
+    {
+      memcpy(&vx, x + i + offset + k, sizeof(vx));
+      acc += vx * h[k];
+    }
+    memcpy(y + i, &acc, sizeof(acc));
+  }
+  return i;
+}
+
+template <typename T> __attribute__((target("avx512f")))
+static int convolveInteriorAVX512(int first, int last, const T * x, int offset, int M, const T * h, T * y)
+{
+  return convolveInteriorVectors<64>(first, last, x, offset, M, h, y);
+}
+
+template <typename T> __attribute__((target("avx2")))
+static int convolveInteriorAVX2(int first, int last, const T * x, int offset, int M, const T * h, T * y)
+{
+  return convolveInteriorVectors<32>(first, last, x, offset, M, h, y);
+}
+#endif
+
+template <typename T>
+static void convolveInterior(int first, int last, const T * x, int offset, int M, const T * h, T * y)
+{
+  int i = first;
+
+#ifdef FFTTOOLS_SIMD_DISPATCH
+  switch (FFTtools::simdWidth())
+  {
+    case 64: i = convolveInteriorAVX512(first, last, x, offset, M, h, y); break;
+    case 32: i = convolveInteriorAVX2(first, last, x, offset, M, h, y); break;
+    default: i = convolveInteriorVectors<16>(first, last, x, offset, M, h, y);
+  }
+#endif
+
+  for (; i < last; i++)
+  {
+    T sum = 0;
+    for (int k = 0; k < M; k++)
+    {
+      sum += x[i + offset + k] * h[k];
+    }
+    y[i] = sum;
+  }
+}
+
+
+template <typename T>
+static T * directConvolveImpl(int N, const T * x, int M, const T *h,  T *y, int delay, FFTtools::DirectConvolveEdgeBehavior edge)
+{
+  if (!y) y = new T[N];
+  T start_val = edge == FFTtools::ZEROES_OUTSIDE ? 0 : x[0];
+  T end_val = edge == FFTtools::ZEROES_OUTSIDE ? 0 : x[N-1];
+
+  // y[i] = sum_k h[k] * x[i + offset + k]
+  int offset = delay - M/2;
+
+  // outputs in [first, last) only need x that exists
+  int first = std::min(N, std::max(0, -offset));
+  int last = std::max(first, std::min(N, N - M + 1 - offset));
+
+  for (int i = 0; i < N; i++)
+  {
+    if (i == first)
+    {
+      i = last;
+      if (i == N) break;
+    }
+
+    T sum = 0;
+    for (int k = 0; k < M; k++)
+    {
+      int j = i + offset + k;
+      T X = j < 0 ? start_val : j >= N ? end_val : x[j];
+      sum += X * h[k];
+    }
+    y[i] = sum;
+  }
+
+  convolveInterior(first, last, x, offset, M, h, y);
+
+  return y;
+}
+
+
+double * FFTtools::directConvolve(int N, const double * x, int M, const double *h,  double *y, int delay, DirectConvolveEdgeBehavior edge)
+{
+  return directConvolveImpl(N, x, M, h, y, delay, edge);
+}
+
+
+float * FFTtools::directConvolve(int N, const float * x, int M, const float *h,  float *y, int delay, DirectConvolveEdgeBehavior edge)
+{
+  return directConvolveImpl(N, x, M, h, y, delay, edge);
+}
+
+
 
 void FFTtools::stokesParameters(int N, const double * __restrict x, const double *  __restrict xh,
                              const double *  __restrict y, const double *  __restrict yh, 
@@ -2937,6 +4753,150 @@ void FFTtools::stokesParameters(int N, const double * __restrict x, const double
 }
 
 
+/* sum of a[i]*b[i] */
+static double dotProduct(int n, const double * a, const double * b)
+{
+#ifdef ENABLE_VECTORIZE
+  int leftover = n % VEC_N;
+  int nit = n / VEC_N;
+
+  VEC va;
+  VEC vb;
+  VEC vsum = 0;
+  for (int i = 0; i < nit; i++)
+  {
+    va.load(a + VEC_N * i);
+    vb.load(b + VEC_N * i);
+    vsum += va * vb;
+  }
+
+  if (leftover)
+  {
+    va.load_partial(leftover, a + VEC_N * nit);
+    vb.load_partial(leftover, b + VEC_N * nit);
+    vsum += va * vb;
+  }
+
+  return horizontal_add(vsum);
+#else
+  //a few independent sums, so the compiler can vectorize / pipeline this
+  double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+  {
+    s0 += a[i] * b[i];
+    s1 += a[i+1] * b[i+1];
+    s2 += a[i+2] * b[i+2];
+    s3 += a[i+3] * b[i+3];
+  }
+  for (; i < n; i++)
+  {
+    s0 += a[i] * b[i];
+  }
+  return (s0 + s1) + (s2 + s3);
+#endif
+}
+
+
+double * FFTtools::getRestrictedCorrelation(int n1, const double * y1, int n2, const double * y2, int lagMin, int lagMax, double * out, CorrelationMethod method)
+{
+  if (lagMax < lagMin)
+  {
+    std::cerr << "Warning! " << __PRETTY_FUNCTION__ << ": lagMax (" << lagMax << ") < lagMin (" << lagMin << ")" << std::endl;
+    return 0;
+  }
+
+  int nlags = lagMax - lagMin + 1;
+  if (!out) out = new double[nlags];
+
+  //the number of products the direct sum needs, vs. (roughly) the work in the three transforms
+  int Nfft = nextFastLength(n1 + n2 - 1);
+  if (method == CORRELATION_AUTO)
+  {
+    double direct_cost = 0;
+    for (int lag = lagMin; lag <= lagMax; lag++)
+    {
+      int overlap = std::min(n2, n1 - lag) - std::max(0, -lag);
+      if (overlap > 0) direct_cost += overlap;
+    }
+    double fft_cost = 4. * Nfft * TMath::Log2(Nfft);
+    method = direct_cost < fft_cost ? CORRELATION_DIRECT : CORRELATION_FFT;
+  }
+
+  if (method == CORRELATION_DIRECT)
+  {
+    for (int lag = lagMin; lag <= lagMax; lag++)
+    {
+      int first = std::max(0, -lag);
+      int overlap = std::min(n2, n1 - lag) - first;
+      out[lag - lagMin] = overlap > 0 ? dotProduct(overlap, y1 + first + lag, y2 + first) : 0;
+    }
+    return out;
+  }
+
+  //zero-padded so nothing wraps around
+  int newLength = (Nfft/2)+1;
+  FFTWComplex *theFFT1 = (FFTWComplex*) thread_scratch.get(0, 2*newLength);
+  memcpy(theFFT1, scratchFFT(Nfft,y1,n1), newLength*sizeof(FFTWComplex));
+  FFTWComplex *theFFT2 = scratchFFT(Nfft,y2,n2);
+  for (int i = 0; i < newLength; i++)
+  {
+    double reFFT1=theFFT1[i].re;
+    double imFFT1=theFFT1[i].im;
+    double reFFT2=theFFT2[i].re;
+    double imFFT2=theFFT2[i].im;
+
+    theFFT2[i].re=reFFT1*reFFT2+imFFT1*imFFT2;
+    theFFT2[i].im=imFFT1*reFFT2-reFFT1*imFFT2;
+  }
+  double *corVals = scratchInvFFT(Nfft);
+
+  for (int lag = lagMin; lag <= lagMax; lag++)
+  {
+    out[lag - lagMin] = (lag > -n2 && lag < n1) ? corVals[(lag + Nfft) % Nfft] : 0;
+  }
+
+  return out;
+}
+
+
+TGraph * FFTtools::getRestrictedCorrelationGraph(TGraph * gr1, TGraph * gr2, int lagMin, int lagMax, TGraph * out, CorrelationMethod method)
+{
+  if (lagMax < lagMin)
+  {
+    std::cerr << "Warning! " << __PRETTY_FUNCTION__ << ": lagMax (" << lagMax << ") < lagMin (" << lagMin << ")" << std::endl;
+    return 0;
+  }
+
+  int length = gr1->GetN();
+  int length2 = gr2->GetN();
+
+  //same scale as getCorrelationGraph uses
+  int N=int(TMath::Power(2,int(TMath::Log2(length))+2));
+  if(N<length2)
+     N=int(TMath::Power(2,int(TMath::Log2(length2))+2));
+  int no2=N>>1;
+
+  double deltaT = gr1->GetX()[1] - gr1->GetX()[0];
+  double waveOffset = gr1->GetX()[0] - gr2->GetX()[0];
+
+  int nlags = lagMax - lagMin + 1;
+  TGraph * grCor = outputGraph(out, nlags);
+  double * xVals = grCor->GetX();
+  double * yVals = grCor->GetY();
+
+  getRestrictedCorrelation(length, gr1->GetY(), length2, gr2->GetY(), lagMin, lagMax, yVals, method);
+
+  for (int i = 0; i < nlags; i++)
+  {
+    xVals[i] = (lagMin + i) * deltaT + waveOffset;
+    yVals[i] /= double(no2/2);
+  }
+
+  return grCor;
+}
+
+
 void FFTtools::dftAtFreqAndMultiples(const TGraph * g, double f, int nmultiples, double * phase, double *amp, double * real, double * imag)
 {
 
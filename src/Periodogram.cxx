@@ -322,6 +322,57 @@ TGraph * FFTtools::welchPeriodogram(const TGraph * gin, int segment_size, double
 }
 
 
+float * FFTtools::welchPeriodogram(int N, const float * yin, int segment_size, double overlap_fraction, const FFTWindowType * window, bool truncate_extra, float * out)
+{
+
+  double window_vals[segment_size]; 
+  window->fill(segment_size, window_vals); 
+
+  double window_weight = 0; 
+  for (int i = 0; i < segment_size; i++) window_weight += window_vals[i] * window_vals[i] / segment_size; 
+
+  float y[segment_size] __attribute__((aligned(32))); 
+  std::complex<float> fft[segment_size/2+1] __attribute__((aligned(32))); 
+
+  float * power = out ? out : new float[segment_size/2+1]; 
+  memset(power, 0, (segment_size/2+1) * sizeof(float)); 
+
+  int index = 0; 
+  double nsegs = 0; 
+  while (truncate_extra ? index + segment_size < N : index < N)
+  {
+
+    for (int i = 0; i < segment_size; i++) 
+    {
+      y[i] = i + index < N ?  window_vals[i] * yin[i + index] : 0; 
+    }
+
+    doFFT(segment_size, y, fft);
+
+    power[0] += std::norm(fft[0])/segment_size; 
+    for (int j = 1; j < segment_size/2; j++)
+    {
+      power[j] += std::norm(fft[j]) *2 / segment_size; 
+    }
+    power[segment_size/2] += std::norm(fft[segment_size/2]) / segment_size; 
+
+    index += (1.-overlap_fraction) * segment_size; 
+    if (index + segment_size >= N)
+    {
+      nsegs += double(N -index) / segment_size; 
+    }
+    else
+    {
+      nsegs +=1; 
+    }
+  }
+
+  for (int i = 0; i <= segment_size/2; i++) power[i] /= nsegs * window_weight; 
+
+  return power; 
+}
+
+
 
 
 double * FFTtools::lombScarglePeriodogramSlow(int N, const double *x, const double *y, int nfreqs, const double * freqs, double * answer)
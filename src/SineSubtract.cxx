@@ -19,6 +19,7 @@
 #include "TMath.h"
 #include <set>
 #include "FFTtools.h"
+#include "Workspace.h"
 #include "TF1.h" 
 #include "TH2.h"
 
@@ -701,7 +702,7 @@ TGraph * FFTtools::SineSubtract::subtractCW(const TGraph * g, double dt)
   return gcopy; 
 }
 
-void FFTtools::SineSubtract::subtractCW(int ntraces, TGraph ** g, double dt, const double * w) 
+void FFTtools::SineSubtract::subtractCW(int ntraces, TGraph ** g, double dt, const double * w, Workspace * ws) 
 {
 
 
@@ -804,6 +805,17 @@ void FFTtools::SineSubtract::subtractCW(int ntraces, TGraph ** g, double dt, con
   }
 
 
+  /* The FFT arrays are the same size every iteration, so only get them once */ 
+  Workspace local_ws; 
+  if (!ws) ws = &local_ws; 
+  double * fft_in = 0; 
+  FFTWComplex * the_fft = 0; 
+  if (power_estimator == FFT) 
+  {
+    fft_in = ws->allocDouble(NuseMax); 
+    the_fft = ws->allocComplex(NuseMax/2+1); 
+  }
+
   while(true) 
   {
 
@@ -833,7 +845,8 @@ void FFTtools::SineSubtract::subtractCW(int ntraces, TGraph ** g, double dt, con
           ig->Set(NuseMax);  // ensure same length
         }
 
-        FFTWComplex * the_fft = FFTtools::doFFT(NuseMax, ig->GetY() + low); 
+        memcpy(fft_in, ig->GetY() + low, NuseMax * sizeof(double)); 
+        FFTtools::doFFT(NuseMax, fft_in, the_fft); 
 
         for (int i = 0; i < spectrum_N; i++)
         {
@@ -845,8 +858,6 @@ void FFTtools::SineSubtract::subtractCW(int ntraces, TGraph ** g, double dt, con
         }
 
 
-        delete [] the_fft; 
-
         if (dt > 0)
         {
           delete ig; 
@@ -0,0 +1,266 @@
+#include "SkyMap.h"
+#include "CorrelationEngine.h"
+#include <math.h>
+#include <string.h>
+#include <iostream>
+
+#ifdef FFTTOOLS_USE_OMP
+#include <omp.h>
+#endif
+
+#include "FFTtools.h"
+
+
+/* row[i] += c linearly interpolated at lo[i] + fr[i], for i in [0,n). With
+ * FFTTOOLS_SIMD_DISPATCH, the interpolation and sum are done in the
+ * compiler's vector types, instantiated for each instruction set's register
+ * width (the lookups are scattered, so they're still one at a time). */
+#ifdef FFTTOOLS_SIMD_DISPATCH
+typedef double Row16 __attribute__((vector_size(16)));
+typedef double Row32 __attribute__((vector_size(32)));
+typedef double Row64 __attribute__((vector_size(64)));
+
+template <typename V>
+static inline __attribute__((always_inline)) int addInterpolatedVectors(int n, const double * c, const int * lo, const float * fr, double * row)
+{
+  const int w = sizeof(V) / sizeof(double);
+  int i = 0;
+  for (; i + w <= n; i += w)
+  {
+    V below, above, t, r;
+    for (int m = 0; m < w; m++)
+    {
+      below[m] = c[lo[i+m]];
+      above[m] = c[lo[i+m]+1];
+      t[m] = fr[i+m];
+    }
+    memcpy(&r, row + i, sizeof(r));
+    r += below + t * (above - below);
+    memcpy(row + i, &r, sizeof(r));
+  }
+  return i;
+}
+
+__attribute__((target("avx512f")))
+static int addInterpolatedAVX512(int n, const double * c, const int * lo, const float * fr, double * row)
+{
+  return addInterpolatedVectors<Row64>(n, c, lo, fr, row);
+}
+
+__attribute__((target("avx2")))
+static int addInterpolatedAVX2(int n, const double * c, const int * lo, const float * fr, double * row)
+{
+  return addInterpolatedVectors<Row32>(n, c, lo, fr, row);
+}
+#endif
+
+static void addInterpolated(int n, const double * c, const int * lo, const float * fr, double * row)
+{
+  int i = 0;
+#ifdef FFTTOOLS_SIMD_DISPATCH
+  switch (FFTtools::simdWidth())
+  {
+    case 64: i = addInterpolatedAVX512(n, c, lo, fr, row); break;
+    case 32: i = addInterpolatedAVX2(n, c, lo, fr, row); break;
+    default: i = addInterpolatedVectors<Row16>(n, c, lo, fr, row);
+  }
+#endif
+  for (; i < n; i++)
+  {
+    double below = c[lo[i]];
+    double above = c[lo[i]+1];
+    row[i] += below + fr[i] * (above - below);
+  }
+}
+
+
+FFTtools::SkyMap::SkyMap(int np, double phi_min, double phi_max, int nt, double theta_min, double theta_max)
+  : nphi(np), ntheta(nt),
+    phi0(phi_min), dphi((phi_max - phi_min) / np),
+    theta0(theta_min), dtheta((theta_max - theta_min) / nt),
+    npairs(0), delay_fn(0), delay_data(0), table_length(0), map(np * nt), length(0)
+{
+}
+
+
+void FFTtools::SkyMap::setGeometry(int n, DelayFunction delay, void * data)
+{
+  npairs = n;
+  delay_fn = delay;
+  delay_data = data;
+
+  int ngrid = nphi * ntheta;
+  delays.resize(npairs * ngrid);
+  for (int p = 0; p < npairs; p++)
+  {
+    for (int itheta = 0; itheta < ntheta; itheta++)
+    {
+      for (int iphi = 0; iphi < nphi; iphi++)
+      {
+        delays[p * ngrid + itheta * nphi + iphi] = delay(p, getPhi(iphi), getTheta(itheta), data);
+      }
+    }
+  }
+
+  // the lookup table is made for the length of the first compute, and the
+  // correlations kept for zoom are for the old pairs
+  table_length = 0;
+  length = 0;
+}
+
+
+double FFTtools::SkyMap::interpolate(const double * corr, double d) const
+{
+  double fl = floor(d);
+  int i = ((int) fl) % length;
+  if (i < 0) i += length;
+  double f = d - fl;
+  return corr[i] + f * (corr[i+1] - corr[i]);
+}
+
+
+void FFTtools::SkyMap::compute(int len, const double * const * correlations)
+{
+  if (!npairs)
+  {
+    std::cerr << "Warning! " << __PRETTY_FUNCTION__ << ": no geometry set. Call setGeometry first." << std::endl;
+    return;
+  }
+
+  int ngrid = nphi * ntheta;
+  length = len;
+
+  // split each delay into the sample below it (wrapped) and the fraction past that
+  if (table_length != len)
+  {
+    lower.resize(npairs * ngrid);
+    frac.resize(npairs * ngrid);
+    for (int i = 0; i < npairs * ngrid; i++)
+    {
+      double fl = floor(delays[i]);
+      int j = ((int) fl) % len;
+      lower[i] = j < 0 ? j + len : j;
+      frac[i] = delays[i] - fl;
+    }
+    table_length = len;
+  }
+
+  // with the first sample repeated at the end, interpolating never has to wrap
+  padded.resize(npairs * (len+1));
+  for (int p = 0; p < npairs; p++)
+  {
+    memcpy(&padded[p * (len+1)], correlations[p], len * sizeof(double));
+    padded[p * (len+1) + len] = correlations[p][0];
+  }
+
+  double norm = 1. / npairs;
+
+#ifdef FFTTOOLS_USE_OMP
+#pragma omp parallel for
+#endif
+  for (int itheta = 0; itheta < ntheta; itheta++)
+  {
+    double * row = &map[itheta * nphi];
+    memset(row, 0, nphi * sizeof(double));
+
+    for (int p = 0; p < npairs; p++)
+    {
+      addInterpolated(nphi, &padded[p * (len+1)], &lower[p * ngrid + itheta * nphi], &frac[p * ngrid + itheta * nphi], row);
+    }
+
+    for (int iphi = 0; iphi < nphi; iphi++)
+    {
+      row[iphi] *= norm;
+    }
+  }
+}
+
+
+void FFTtools::SkyMap::compute(const CorrelationEngine & engine)
+{
+  if (engine.nPairs() != npairs)
+  {
+    std::cerr << "Warning! " << __PRETTY_FUNCTION__ << ": engine has " << engine.nPairs() << " pairs, but the geometry has " << npairs << std::endl;
+    return;
+  }
+
+  std::vector<const double *> correlations(npairs);
+  for (int p = 0; p < npairs; p++)
+  {
+    correlations[p] = engine.getCorrelation(p);
+  }
+
+  compute(engine.getLength(), &correlations[0]);
+}
+
+
+double FFTtools::SkyMap::getPeak(double * phi, double * theta, int * iphi, int * itheta) const
+{
+  int best = 0;
+  for (int i = 1; i < nphi * ntheta; i++)
+  {
+    if (map[i] > map[best]) best = i;
+  }
+
+  if (iphi) *iphi = best % nphi;
+  if (itheta) *itheta = best / nphi;
+  if (phi) *phi = getPhi(best % nphi);
+  if (theta) *theta = getTheta(best / nphi);
+  return map[best];
+}
+
+
+double FFTtools::SkyMap::zoom(int nfine_phi, int nfine_theta, double * phi, double * theta, int nzooms)
+{
+  if (!length)
+  {
+    std::cerr << "Warning! " << __PRETTY_FUNCTION__ << ": nothing computed yet." << std::endl;
+    return 0;
+  }
+
+  double best_phi, best_theta;
+  double best_val = getPeak(&best_phi, &best_theta);
+
+  // half-widths of the region to look in
+  double wphi = dphi;
+  double wtheta = dtheta;
+
+  for (int z = 0; z < nzooms; z++)
+  {
+    double step_phi = 2 * wphi / nfine_phi;
+    double step_theta = 2 * wtheta / nfine_theta;
+    double centre_phi = best_phi;
+    double centre_theta = best_theta;
+
+    for (int itheta = 0; itheta < nfine_theta; itheta++)
+    {
+      double th = centre_theta - wtheta + (itheta + 0.5) * step_theta;
+      for (int iphi = 0; iphi < nfine_phi; iphi++)
+      {
+        double ph = centre_phi - wphi + (iphi + 0.5) * step_phi;
+
+        double sum = 0;
+        for (int p = 0; p < npairs; p++)
+        {
+          sum += interpolate(&padded[p * (length+1)], delay_fn(p, ph, th, delay_data));
+        }
+        sum /= npairs;
+
+        if (sum > best_val)
+        {
+          best_val = sum;
+          best_phi = ph;
+          best_theta = th;
+        }
+      }
+    }
+
+    // next time, look within a fine bin of this
+    wphi = step_phi;
+    wtheta = step_theta;
+  }
+
+  if (phi) *phi = best_phi;
+  if (theta) *theta = best_theta;
+  return best_val;
+}
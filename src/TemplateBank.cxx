@@ -0,0 +1,127 @@
+#include "TemplateBank.h"
+#include "FFTtools.h"
+#include "FFTWComplex.h"
+#include <string.h>
+#include <math.h>
+#include <iostream>
+
+
+FFTtools::TemplateBank::TemplateBank(int len, int nbatch)
+  : length(len), nfreq(len/2+1), batch(nbatch > 0 ? nbatch : 1), ntemplates(0)
+{
+  input = ws.allocDouble(length);
+  input_fft = ws.allocComplex(nfreq);
+  products = ws.allocComplex(nfreq * batch);
+  corrs = ws.allocDouble(length * batch);
+}
+
+
+double FFTtools::TemplateBank::loadInput(int n, const double * y)
+{
+  if (n > length)
+  {
+    std::cerr << "Warning! " << __PRETTY_FUNCTION__ << ": " << n << " samples given, but the bank has length " << length << ". Truncating." << std::endl;
+    n = length;
+  }
+
+  memcpy(input, y, n * sizeof(double));
+  if (n < length) memset(input + n, 0, (length - n) * sizeof(double));
+
+  double sum2 = 0;
+  for (int i = 0; i < n; i++)
+  {
+    sum2 += input[i] * input[i];
+  }
+
+  return sqrt(sum2);
+}
+
+
+int FFTtools::TemplateBank::addTemplate(int n, const double * y)
+{
+  double norm = loadInput(n, y);
+  if (!norm)
+  {
+    std::cerr << "Warning! " << __PRETTY_FUNCTION__ << ": template is all zeroes. Not adding." << std::endl;
+    return -1;
+  }
+
+  FFTtools::doFFT(length, input, input_fft);
+
+  // store conj(T) / |t|, so matching is just a product
+  spectra.resize((ntemplates+1) * nfreq);
+  FFTWComplex * T = &spectra[ntemplates * nfreq];
+  for (int i = 0; i < nfreq; i++)
+  {
+    T[i].re = input_fft[i].re / norm;
+    T[i].im = -input_fft[i].im / norm;
+  }
+
+  return ntemplates++;
+}
+
+
+FFTtools::TemplateMatch FFTtools::TemplateBank::match(int n, const double * y, bool absolute, double * scores, int * lags)
+{
+  TemplateMatch best;
+  if (!ntemplates) return best;
+
+  double norm = loadInput(n, y);
+  if (!norm)
+  {
+    if (scores) memset(scores, 0, ntemplates * sizeof(double));
+    if (lags) memset(lags, 0, ntemplates * sizeof(int));
+    return best;
+  }
+
+  FFTtools::doFFT(length, input, input_fft);
+
+  double best_val = -1;
+  for (int first = 0; first < ntemplates; first += batch)
+  {
+    int nthis = ntemplates - first < batch ? ntemplates - first : batch;
+
+    for (int j = 0; j < nthis; j++)
+    {
+      const FFTWComplex * T = &spectra[(first + j) * nfreq];
+      FFTWComplex * P = products + j * nfreq;
+      for (int i = 0; i < nfreq; i++)
+      {
+        P[i].re = (input_fft[i].re * T[i].re - input_fft[i].im * T[i].im) / norm;
+        P[i].im = (input_fft[i].re * T[i].im + input_fft[i].im * T[i].re) / norm;
+      }
+    }
+
+    FFTtools::doInvFFTBatch(length, nthis, products, corrs);
+
+    for (int j = 0; j < nthis; j++)
+    {
+      const double * c = corrs + j * length;
+      int imax = 0;
+      double vmax = absolute ? fabs(c[0]) : c[0];
+      for (int i = 1; i < length; i++)
+      {
+        double v = absolute ? fabs(c[i]) : c[i];
+        if (v > vmax)
+        {
+          vmax = v;
+          imax = i;
+        }
+      }
+
+      int lag = imax < (length+1)/2 ? imax : imax - length;
+      if (scores) scores[first + j] = c[imax];
+      if (lags) lags[first + j] = lag;
+
+      if (best.index < 0 || vmax > best_val)
+      {
+        best_val = vmax;
+        best.index = first + j;
+        best.lag = lag;
+        best.score = c[imax];
+      }
+    }
+  }
+
+  return best;
+}
@@ -0,0 +1,83 @@
+#include "Workspace.h"
+#include <fftw3.h>
+
+
+/* Everything handed out is rounded up to this, so that (since each block
+ * comes from fftw_malloc) every allocation is as aligned as the block is.
+ */
+static const size_t chunk = 64;
+static const size_t min_block_size = 4096;
+
+
+FFTtools::Workspace::Workspace(size_t nbytes)
+  : offset(0), nused(0)
+{
+  if (nbytes) addBlock(nbytes);
+}
+
+
+FFTtools::Workspace::~Workspace()
+{
+  for (size_t i = 0; i < blocks.size(); i++)
+  {
+    fftw_free(blocks[i].mem);
+  }
+}
+
+
+void FFTtools::Workspace::addBlock(size_t nbytes)
+{
+  Block b;
+  b.size = nbytes < min_block_size ? min_block_size : nbytes;
+  b.mem = (char*) fftw_malloc(b.size);
+  blocks.push_back(b);
+  offset = 0;
+}
+
+
+size_t FFTtools::Workspace::capacity() const
+{
+  size_t total = 0;
+  for (size_t i = 0; i < blocks.size(); i++)
+  {
+    total += blocks[i].size;
+  }
+  return total;
+}
+
+
+void * FFTtools::Workspace::alloc(size_t nbytes)
+{
+  nbytes = ((nbytes + chunk - 1) / chunk) * chunk;
+
+  if (!blocks.size() || offset + nbytes > blocks.back().size)
+  {
+    //grow geometrically, so we don't end up with lots of little blocks
+    size_t grow = 2 * capacity();
+    addBlock(nbytes > grow ? nbytes : grow);
+  }
+
+  void * answer = blocks.back().mem + offset;
+  offset += nbytes;
+  nused += nbytes;
+  return answer;
+}
+
+
+void FFTtools::Workspace::reset()
+{
+  // if we needed more than one block, replace them with one big enough for all of them
+  if (blocks.size() > 1)
+  {
+    size_t total = capacity();
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+      fftw_free(blocks[i].mem);
+    }
+    blocks.clear();
+    addBlock(total);
+  }
+
+  offset = 0;
+  nused = 0;
+}
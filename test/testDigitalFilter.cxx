@@ -0,0 +1,564 @@
+#include "DigitalFilter.h"
+#include "FFTtools.h"
+#include <iostream>
+#include <vector>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <string>
+#include <algorithm>
+
+#include <TRandom3.h>
+
+/* Checks of the DigitalFilter implementations against each other (and
+ * against the definitions). Prints what fails, and returns non-zero if anything does. */
+
+int testOverlapSave();
+int testSavitzkyGolay();
+int testStreaming();
+int testSections();
+int testChannels();
+int testFiltfilt();
+
+static TRandom3 rng(1984);
+
+static std::vector<double> noise(int n, double offset = 0)
+{
+  std::vector<double> x(n);
+  for (int i = 0; i < n; i++) x[i] = offset + rng.Gaus();
+  return x;
+}
+
+static double maxAbs(int n, const double * x)
+{
+  double m = 0;
+  for (int i = 0; i < n; i++) m = std::max(m, fabs(x[i]));
+  return m;
+}
+
+static double maxDiff(int n, const double * a, const double * b)
+{
+  double m = 0;
+  for (int i = 0; i < n; i++) m = std::max(m, fabs(a[i] - b[i]));
+  return m;
+}
+
+
+int main()
+{
+  int nfail = 0;
+  nfail += testOverlapSave();
+  nfail += testSavitzkyGolay();
+  nfail += testStreaming();
+  nfail += testSections();
+  nfail += testChannels();
+  nfail += testFiltfilt();
+
+  std::cout << (nfail ? "FAILED: " : "All passed") ;
+  if (nfail) std::cout << nfail << " checks";
+  std::cout << std::endl;
+  return nfail ? 1 : 0;
+}
+
+
+/* OVERLAP_SAVE against DIRECT, and DIRECT against the definition
+ *   out[i] = sum_k h[k] * x[i + k + delay - M/2]  (x extended with zeroes or its end values)
+ * for various tap counts, delays and edge handling. Also that AUTO (the
+ * default) agrees for the long built-in filters it sends to OVERLAP_SAVE. */
+int testOverlapSave()
+{
+  int nfail = 0;
+  const int N = 1000;
+  std::vector<double> x = noise(N, 1.5);
+
+  int ntaps[] = {1, 2, 5, 16, 17, 64, 151, 400};
+  for (unsigned it = 0; it < sizeof(ntaps)/sizeof(*ntaps); it++)
+  {
+    int M = ntaps[it];
+    std::vector<double> h = noise(M);
+    int delays[] = {0, 3, -3, M, -M};
+    for (int id = 0; id < 5; id++)
+    {
+      for (int extend = 0; extend < 2; extend++)
+      {
+        FFTtools::FIRFilter f(M, &h[0], delays[id], extend);
+        std::vector<double> direct(N), os(N), expected(N);
+
+        f.setMethod(FFTtools::FIRFilter::DIRECT);
+        f.filterOut(N, &x[0], &direct[0]);
+        f.setMethod(FFTtools::FIRFilter::OVERLAP_SAVE);
+        f.filterOut(N, &x[0], &os[0]);
+
+        for (int i = 0; i < N; i++)
+        {
+          double sum = 0;
+          for (int k = 0; k < M; k++)
+          {
+            int j = i + k + delays[id] - M/2;
+            double xj = j < 0 ? (extend ? x[0] : 0) : j >= N ? (extend ? x[N-1] : 0) : x[j];
+            sum += h[k] * xj;
+          }
+          expected[i] = sum;
+        }
+
+        double scale = maxAbs(N, &expected[0]);
+        double err_direct = maxDiff(N, &direct[0], &expected[0]);
+        double err_os = maxDiff(N, &os[0], &direct[0]);
+        if (err_direct > 1e-12 * scale || err_os > 1e-12 * scale)
+        {
+          std::cout << "testOverlapSave: " << M << " taps, delay " << delays[id] << ", extend " << extend
+                    << ": direct off by " << err_direct << ", overlap-save off by " << err_os << " (scale " << scale << ")" << std::endl;
+          nfail++;
+        }
+      }
+    }
+  }
+
+  // these are long enough that AUTO picks OVERLAP_SAVE
+  FFTtools::GaussianFilter gauss(10, 5);
+  FFTtools::SincFilter sinc(0.1, 20);
+  FFTtools::FIRFilter * builtin[] = {&gauss, &sinc};
+  for (int i = 0; i < 2; i++)
+  {
+    std::vector<double> automatic(N), direct(N);
+    builtin[i]->filterOut(N, &x[0], &automatic[0]);
+    builtin[i]->setMethod(FFTtools::FIRFilter::DIRECT);
+    builtin[i]->filterOut(N, &x[0], &direct[0]);
+    double err = maxDiff(N, &automatic[0], &direct[0]);
+    if (err > 1e-12 * maxAbs(N, &direct[0]))
+    {
+      std::cout << "testOverlapSave: built-in filter " << i << ": AUTO off from DIRECT by " << err << std::endl;
+      nfail++;
+    }
+  }
+
+  return nfail;
+}
+
+
+/* A Savitzky-Golay filter of order p reproduces a polynomial of order p
+ * exactly (away from the ends, where the input is extended), including
+ * asymmetric ones, which were misaligned by their delay. */
+int testSavitzkyGolay()
+{
+  int nfail = 0;
+  const int N = 200;
+  std::vector<double> x(N);
+  for (int i = 0; i < N; i++) x[i] = 3 - 0.2 * i + 0.01 * i * i;
+
+  int windows[][2] = { {4, -1}, {3, 3}, {2, 6}, {7, 1}, {0, 5}, {5, 0} };
+  for (int iw = 0; iw < 6; iw++)
+  {
+    int wleft = windows[iw][0];
+    int wright = windows[iw][1];
+    FFTtools::SavitzkyGolayFilter sg(2, wleft, wright);
+    std::vector<double> y(N);
+    sg.filterOut(N, &x[0], &y[0]);
+
+    int margin = std::max(wleft, wright < 0 ? wleft : wright);
+    double err = maxDiff(N - 2*margin, &x[margin], &y[margin]);
+    if (err > 1e-9)
+    {
+      std::cout << "testSavitzkyGolay: window (" << wleft << "," << wright << ") doesn't reproduce a quadratic, off by " << err << std::endl;
+      nfail++;
+    }
+  }
+
+  return nfail;
+}
+
+
+/* Feeds x through process in random block sizes (up to max_block), then
+ * flush, and checks that this is exactly filterOut of the whole record (and
+ * that process never writes more than it's given and flush no more than the latency) */
+static int checkStream(FFTtools::DigitalFilter & f, int N, const double * x, int max_block, const char * what)
+{
+  std::vector<double> expected(N), got(N + f.latency() + 1);
+  f.filterOut(N, x, &expected[0]);
+
+  f.reset();
+  size_t nout = 0;
+  bool too_many = false;
+  for (int pos = 0; pos < N; )
+  {
+    int n = std::min(N - pos, 1 + rng.Integer(max_block));
+    size_t m = f.process(n, x + pos, &got[nout]);
+    if (m > (size_t) n) too_many = true;
+    nout += m;
+    pos += n;
+  }
+  size_t nflushed = f.flush(&got[nout]);
+  nout += nflushed;
+
+  if (too_many || nflushed > f.latency() || nout != (size_t) N || memcmp(&expected[0], &got[0], N * sizeof(double)))
+  {
+    std::cout << "testStreaming: " << what << " in blocks of up to " << max_block << ": " << nout << " of " << N << " samples";
+    if (too_many) std::cout << ", process wrote more than it was given";
+    if (nflushed > f.latency()) std::cout << ", flush wrote " << nflushed << " > latency " << f.latency();
+    if (nout == (size_t) N)
+    {
+      for (int i = 0; i < N; i++)
+      {
+        if (expected[i] != got[i])
+        {
+          std::cout << ", first differs at " << i << " (" << got[i] << " instead of " << expected[i] << ")";
+          break;
+        }
+      }
+    }
+    std::cout << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+
+/* Streaming in blocks is bit-identical to filterOut, for IIR filters (both
+ * methods), FIR filters (both methods, delays either way, with and without
+ * extend) and series of them. */
+int testStreaming()
+{
+  int nfail = 0;
+  const int N = 3001;
+  std::vector<double> x = noise(N, 2);
+  int max_blocks[] = {1, 3, 64, 1000, 5000};
+
+  std::vector<FFTtools::DigitalFilter*> filters;
+  std::vector<std::string> names;
+
+  FFTtools::ButterworthFilter butter(FFTtools::LOWPASS, 5, 0.2);
+  filters.push_back(&butter); names.push_back("butterworth");
+
+  FFTtools::ChebyshevIFilter cheby(FFTtools::BANDPASS, 8, 1, 0.3, 0.1);
+  cheby.setMethod(FFTtools::TransformedZPKFilter::SECOND_ORDER_SECTIONS);
+  filters.push_back(&cheby); names.push_back("chebyshev (sections)");
+
+  std::vector<double> h = noise(150);
+  int delays[] = {0, 40, -200};
+  FFTtools::FIRFilter::Method methods[] = {FFTtools::FIRFilter::DIRECT, FFTtools::FIRFilter::OVERLAP_SAVE};
+  std::vector<FFTtools::FIRFilter*> firs;
+  for (int id = 0; id < 3; id++)
+  {
+    for (int extend = 0; extend < 2; extend++)
+    {
+      for (int im = 0; im < 2; im++)
+      {
+        FFTtools::FIRFilter * f = new FFTtools::FIRFilter(h.size(), &h[0], delays[id], extend);
+        f->setMethod(methods[im]);
+        firs.push_back(f);
+        filters.push_back(f);
+        char name[128];
+        sprintf(name, "FIR (%s, delay %d%s)", im ? "overlap-save" : "direct", delays[id], extend ? ", extended" : "");
+        names.push_back(name);
+      }
+    }
+  }
+
+  FFTtools::SavitzkyGolayFilter sg(3, 2, 9);
+  filters.push_back(&sg); names.push_back("asymmetric Savitzky-Golay");
+
+  FFTtools::GaussianFilter gauss(10, 5);
+  filters.push_back(&gauss); names.push_back("gaussian (AUTO)");
+
+  FFTtools::BoxFilter box(9);
+  FFTtools::DigitalFilterSeries series;
+  series.add(&butter);
+  series.add(&sg);
+  series.add(firs[3]);
+  series.add(&cheby);
+  series.add(&box);
+  filters.push_back(&series); names.push_back("series");
+
+  FFTtools::DigitalFilterSeries empty;
+  filters.push_back(&empty); names.push_back("empty series");
+
+  for (size_t i = 0; i < filters.size(); i++)
+  {
+    for (unsigned ib = 0; ib < sizeof(max_blocks)/sizeof(*max_blocks); ib++)
+    {
+      nfail += checkStream(*filters[i], N, &x[0], max_blocks[ib], names[i].c_str());
+    }
+  }
+
+  // and a record shorter than one overlap-save block
+  nfail += checkStream(*firs[1], 37, &x[0], 5, "FIR (overlap-save) on a short record");
+
+  for (size_t i = 0; i < firs.size(); i++) delete firs[i];
+  return nfail;
+}
+
+
+/* SECOND_ORDER_SECTIONS agrees with DIRECT_FORM at low order, where both are
+ * fine, and at high order (where the direct form loses it) is still stable and
+ * has the response of its sections: the spectrum of its impulse response is its
+ * transfer function, and a lowpass passes DC. */
+int testSections()
+{
+  int nfail = 0;
+  const int N = 2000;
+  std::vector<double> x = noise(N, 1);
+
+  FFTtools::ButterworthFilter bw2(FFTtools::LOWPASS, 2, 0.2);
+  FFTtools::ButterworthFilter bw3(FFTtools::HIGHPASS, 3, 0.3);
+  FFTtools::ButterworthFilter bw4(FFTtools::BANDPASS, 2, 0.3, 0.1);
+  FFTtools::ChebyshevIFilter ch3(FFTtools::LOWPASS, 3, 0.5, 0.25);
+  FFTtools::RCFilter rc(FFTtools::HIGHPASS, 0.1);
+  FFTtools::TransformedZPKFilter * low[] = {&bw2, &bw3, &bw4, &ch3, &rc};
+  for (int i = 0; i < 5; i++)
+  {
+    std::vector<double> direct(N), sos(N);
+    low[i]->setMethod(FFTtools::TransformedZPKFilter::DIRECT_FORM);
+    low[i]->filterOut(N, &x[0], &direct[0]);
+    low[i]->setMethod(FFTtools::TransformedZPKFilter::SECOND_ORDER_SECTIONS);
+    low[i]->filterOut(N, &x[0], &sos[0]);
+    double err = maxDiff(N, &direct[0], &sos[0]);
+    if (err > 1e-10 * maxAbs(N, &direct[0]))
+    {
+      std::cout << "testSections: low-order filter " << i << ": sections off from direct form by " << err << std::endl;
+      nfail++;
+    }
+  }
+
+  const int Nimp = 16384;
+  FFTtools::ButterworthFilter bw16(FFTtools::LOWPASS, 16, 0.02);
+  FFTtools::ChebyshevIFilter ch16(FFTtools::LOWPASS, 16, 0.5, 0.05);
+  FFTtools::TransformedZPKFilter * high[] = {&bw16, &ch16};
+  for (int i = 0; i < 2; i++)
+  {
+    FFTtools::TransformedZPKFilter * f = high[i];
+    f->setMethod(FFTtools::TransformedZPKFilter::SECOND_ORDER_SECTIONS);
+    std::vector<double> imp(Nimp);
+    f->impulse(Nimp, &imp[0]);
+
+    double peak = maxAbs(Nimp, &imp[0]);
+    double tail = maxAbs(100, &imp[Nimp-100]);
+    double dc = 0;
+    for (int t = 0; t < Nimp; t++) dc += imp[t];
+
+    double err = 0;
+    for (int k = 0; k < Nimp/2; k += 83)
+    {
+      std::complex<double> spectrum(0,0);
+      for (int t = 0; t < Nimp; t++) spectrum += imp[t] * std::polar(1., -2*M_PI*k*t/Nimp);
+      err = std::max(err, std::abs(spectrum - f->transfer(std::polar(1., 2*M_PI*k/Nimp))));
+    }
+
+    // a Chebyshev I of even order has its ripple minimum at DC
+    double dc_expected = i == 0 ? 1 : pow(10, -0.5/20);
+    if (!(peak < 1) || tail > 1e-9 || fabs(dc - dc_expected) > 1e-6 || err > 1e-6)
+    {
+      std::cout << "testSections: order-16 filter " << i << ": impulse response peak " << peak << ", tail " << tail
+                << ", DC gain " << dc << " (should be " << dc_expected << "), spectrum off from transfer by " << err << std::endl;
+      nfail++;
+    }
+  }
+
+  return nfail;
+}
+
+
+/* filterOutChannels gives exactly what filterOut does on each channel, for
+ * channel counts that do and don't fill the SIMD lanes, and in place. In
+ * steady state, a constant comes out as the constant times the DC gain,
+ * with no transient. */
+int testChannels()
+{
+  int nfail = 0;
+  const int N = 500;
+
+  FFTtools::ButterworthFilter butter(FFTtools::HIGHPASS, 4, 0.1);
+  FFTtools::ChebyshevIFilter cheby(FFTtools::LOWPASS, 6, 1, 0.2);
+  cheby.setMethod(FFTtools::TransformedZPKFilter::SECOND_ORDER_SECTIONS);
+  FFTtools::RCFilter rc(FFTtools::LOWPASS, 0.05);
+  FFTtools::GaussianFilter gauss(3, 4);
+  FFTtools::DigitalFilterSeries series;
+  series.add(&cheby);
+  series.add(&gauss);
+  series.add(&butter);
+  FFTtools::DigitalFilter * filters[] = {&butter, &cheby, &rc, &gauss, &series};
+  const char * names[] = {"butterworth", "chebyshev (sections)", "RC", "gaussian", "series"};
+
+  int nchans[] = {1, 5, 8, 9, 20};
+  for (int i = 0; i < 5; i++)
+  {
+    for (int ic = 0; ic < 5; ic++)
+    {
+      int nchan = nchans[ic];
+      std::vector<std::vector<double> > in(nchan), out(nchan, std::vector<double>(N)), expected(nchan, std::vector<double>(N));
+      std::vector<const double *> pin(nchan);
+      std::vector<double *> pout(nchan);
+      for (int c = 0; c < nchan; c++)
+      {
+        in[c] = noise(N, c);
+        filters[i]->filterOut(N, &in[c][0], &expected[c][0]);
+        pin[c] = &in[c][0];
+        pout[c] = &out[c][0];
+      }
+
+      filters[i]->filterOutChannels(nchan, N, &pin[0], &pout[0]);
+      int nbad = 0;
+      for (int c = 0; c < nchan; c++)
+      {
+        if (memcmp(&out[c][0], &expected[c][0], N * sizeof(double))) nbad++;
+      }
+
+      // and in place
+      for (int c = 0; c < nchan; c++) pout[c] = &in[c][0];
+      filters[i]->filterOutChannels(nchan, N, &pin[0], &pout[0]);
+      for (int c = 0; c < nchan; c++)
+      {
+        if (memcmp(&in[c][0], &expected[c][0], N * sizeof(double))) nbad++;
+      }
+
+      if (nbad)
+      {
+        std::cout << "testChannels: " << names[i] << " on " << nchan << " channels: " << nbad << " differ from filterOut" << std::endl;
+        nfail++;
+      }
+    }
+  }
+
+  FFTtools::TransformedZPKFilter * iirs[] = {&butter, &cheby, &rc};
+  for (int i = 0; i < 3; i++)
+  {
+    const int nchan = 11;
+    double dc_gain = std::real(iirs[i]->transfer(1));
+    std::vector<std::vector<double> > x(nchan, std::vector<double>(N));
+    std::vector<double *> px(nchan);
+    for (int c = 0; c < nchan; c++)
+    {
+      std::fill(x[c].begin(), x[c].end(), c - 3.5);
+      px[c] = &x[c][0];
+    }
+    iirs[i]->filterOutChannels(nchan, N, &px[0], &px[0], true);
+
+    double err = 0;
+    for (int c = 0; c < nchan; c++)
+    {
+      for (int j = 0; j < N; j++) err = std::max(err, fabs(x[c][j] - (c - 3.5) * dc_gain));
+    }
+    if (err > 1e-9)
+    {
+      std::cout << "testChannels: " << names[i] << " in steady state doesn't pass a constant through at its DC gain, off by " << err << std::endl;
+      nfail++;
+    }
+  }
+
+  return nfail;
+}
+
+
+/* filtfilt passes a constant at the squared DC gain (so unchanged through a
+ * lowpass), all the way to the ends; keeps a symmetric pulse symmetric and
+ * where it was (zero phase); gives exactly what it does channel by channel
+ * through filtfiltChannels; and copes with records of one or two samples and
+ * with more padding than the record can give. FIR filters zero-extend past
+ * the padding, so the ends of a constant only come through exactly for a
+ * single filter padded by its length, and on short records only for IIRs. */
+int testFiltfilt()
+{
+  int nfail = 0;
+
+  FFTtools::ButterworthFilter butter(FFTtools::LOWPASS, 4, 0.1);
+  FFTtools::ChebyshevIFilter cheby(FFTtools::LOWPASS, 6, 1, 0.2);
+  cheby.setMethod(FFTtools::TransformedZPKFilter::SECOND_ORDER_SECTIONS);
+  FFTtools::RCFilter rc(FFTtools::HIGHPASS, 0.05);
+  FFTtools::GaussianFilter gauss(3, 4);
+  FFTtools::DigitalFilterSeries series;
+  series.add(&cheby);
+  series.add(&gauss);
+  FFTtools::DigitalFilter * filters[] = {&butter, &cheby, &rc, &gauss, &series};
+  const char * names[] = {"butterworth", "chebyshev (sections)", "RC highpass", "gaussian", "series"};
+
+  for (int i = 0; i < 5; i++)
+  {
+    FFTtools::DigitalFilter * f = filters[i];
+    bool iir = i < 3;
+    double gain = std::norm(f->transfer(1));
+
+    const int N = 300;
+    std::vector<double> x(N, 2.5);
+    f->filtfilt(N, &x[0]);
+    double err = 0;
+    for (int j = 0; j < N; j++) err = std::max(err, fabs(x[j] - 2.5 * gain));
+    if (f != &series && !(err <= 1e-9))
+    {
+      std::cout << "testFiltfilt: " << names[i] << " doesn't pass a constant at gain " << gain << ", off by " << err << std::endl;
+      nfail++;
+    }
+
+    // a pulse in the middle, well away from the ends
+    const int Np = 801;
+    std::vector<double> pulse(Np);
+    for (int j = 0; j < Np; j++) pulse[j] = exp(-0.5 * (j - Np/2) * (j - Np/2) / 100.);
+    f->filtfilt(Np, &pulse[0]);
+    double asym = 0;
+    for (int j = 0; j < Np/2; j++) asym = std::max(asym, fabs(pulse[j] - pulse[Np-1-j]));
+    int peak = 0;
+    for (int j = 1; j < Np; j++)
+    {
+      if (fabs(pulse[j]) > fabs(pulse[peak])) peak = j;
+    }
+    if (!(asym <= 1e-9 * maxAbs(Np, &pulse[0])) || peak != Np/2)
+    {
+      std::cout << "testFiltfilt: " << names[i] << " isn't zero phase: a symmetric pulse comes out asymmetric by " << asym
+                << ", peaking at " << peak << " instead of " << Np/2 << std::endl;
+      nfail++;
+    }
+
+    int nchans[] = {1, 5, 8, 9, 20};
+    for (int ic = 0; ic < 5; ic++)
+    {
+      int nchan = nchans[ic];
+      std::vector<std::vector<double> > w(nchan), expected(nchan);
+      std::vector<double *> pw(nchan);
+      for (int c = 0; c < nchan; c++)
+      {
+        w[c] = noise(N, c);
+        expected[c] = w[c];
+        f->filtfilt(N, &expected[c][0]);
+        pw[c] = &w[c][0];
+      }
+      f->filtfiltChannels(nchan, N, &pw[0]);
+      int nbad = 0;
+      for (int c = 0; c < nchan; c++)
+      {
+        if (memcmp(&w[c][0], &expected[c][0], N * sizeof(double))) nbad++;
+      }
+      if (nbad)
+      {
+        std::cout << "testFiltfilt: " << names[i] << " on " << nchan << " channels: " << nbad << " differ from filtfilt" << std::endl;
+        nfail++;
+      }
+    }
+
+    // one and two samples: a constant still comes through at the DC gain
+    // (for an FIR, at least something finite comes out)
+    for (int n = 1; n <= 2; n++)
+    {
+      double y[2] = {-1.5, -1.5};
+      f->filtfilt(n, y);
+      double e = std::max(fabs(y[0] + 1.5 * gain), fabs(y[n-1] + 1.5 * gain));
+      if (iir ? !(e <= 1e-9) : !(e < 10))
+      {
+        std::cout << "testFiltfilt: " << names[i] << " on a constant of " << n << " samples gives " << y[0] << ", " << y[n-1]
+                  << " instead of " << -1.5 * gain << std::endl;
+        nfail++;
+      }
+    }
+
+    // padding beyond n-1 is clamped to n-1
+    const int Ns = 10;
+    std::vector<double> longpad = noise(Ns);
+    std::vector<double> maxpad = longpad;
+    f->filtfilt(Ns, &longpad[0], 50);
+    f->filtfilt(Ns, &maxpad[0], Ns - 1);
+    if (memcmp(&longpad[0], &maxpad[0], Ns * sizeof(double)))
+    {
+      std::cout << "testFiltfilt: " << names[i] << " with padlen 50 on " << Ns << " samples differs from padlen " << Ns - 1 << std::endl;
+      nfail++;
+    }
+  }
+
+  return nfail;
+}
@@ -0,0 +1,95 @@
+#include "SkyMap.h"
+#include <iostream>
+#include <vector>
+#include <math.h>
+
+#include <TRandom3.h>
+
+/* Checks SkyMap::compute against summing the interpolated correlations
+ * directly. Prints what fails, and returns non-zero if anything does. */
+
+int testCompute();
+
+static TRandom3 rng(2001);
+
+static double pairDelay(int pair, double phi, double theta, void * data)
+{
+  (void) data;
+  //something smooth, with both signs and plenty of wrap-around
+  return 30 * (pair + 1) * sin(phi) * cos(theta) - 7.3 * pair;
+}
+
+
+int main()
+{
+  int nfail = 0;
+  nfail += testCompute();
+
+  std::cout << (nfail ? "FAILED: " : "All passed") ;
+  if (nfail) std::cout << nfail << " checks";
+  std::cout << std::endl;
+  return nfail ? 1 : 0;
+}
+
+
+/* Each bin is the average over pairs of the correlation linearly
+ * interpolated (circularly) at that pair's delay, with the fractional part
+ * kept as a float like the table does. Exactly, whatever the vector width,
+ * including rows whose length isn't a multiple of it. */
+int testCompute()
+{
+  int nfail = 0;
+  const int npairs = 6;
+  int nphis[] = {1, 7, 37, 64};
+  int lengths[] = {100, 257};
+
+  for (int il = 0; il < 2; il++)
+  {
+    int len = lengths[il];
+    std::vector<std::vector<double> > corr(npairs, std::vector<double>(len));
+    std::vector<const double *> pcorr(npairs);
+    for (int p = 0; p < npairs; p++)
+    {
+      for (int i = 0; i < len; i++) corr[p][i] = rng.Gaus();
+      pcorr[p] = &corr[p][0];
+    }
+
+    for (int ip = 0; ip < 4; ip++)
+    {
+      int nphi = nphis[ip];
+      const int ntheta = 5;
+      FFTtools::SkyMap map(nphi, -M_PI, M_PI, ntheta, -1, 1);
+      map.setGeometry(npairs, pairDelay);
+      map.compute(len, &pcorr[0]);
+
+      int nbad = 0;
+      for (int itheta = 0; itheta < ntheta; itheta++)
+      {
+        for (int iphi = 0; iphi < nphi; iphi++)
+        {
+          double sum = 0;
+          for (int p = 0; p < npairs; p++)
+          {
+            double d = pairDelay(p, map.getPhi(iphi), map.getTheta(itheta), 0);
+            double fl = floor(d);
+            int j = ((int) fl) % len;
+            if (j < 0) j += len;
+            float f = d - fl;
+            double below = corr[p][j];
+            double above = corr[p][(j+1) % len];
+            sum += below + f * (above - below);
+          }
+          if (sum * (1. / npairs) != map.getValue(iphi, itheta)) nbad++;
+        }
+      }
+
+      if (nbad)
+      {
+        std::cout << "testCompute: " << nphi << " x " << ntheta << " map of length " << len << " correlations: " << nbad << " bins differ" << std::endl;
+        nfail++;
+      }
+    }
+  }
+
+  return nfail;
+}